@@ -0,0 +1,73 @@
+#include "archiveconcatenator.hpp"
+#include "psiarchivereader.hpp"
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+int ConcatArchives(const std::vector<NATIVE_STRING> &names, FILE *fpDest, bool link)
+{
+    CPsiArchiveReader reader;
+    std::vector<CPsiArchiveReader::CHUNK_INFO> chunks;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> linked;
+    const char *error = nullptr;
+    std::string errorName;
+    bool writeFailed = false;
+    for (size_t i = 0; i < names.size() && !error && !writeFailed; ++i) {
+        errorName = NativeToString(names[i].c_str());
+#ifdef _WIN32
+        std::unique_ptr<FILE, decltype(&fclose)> fp(_wfopen(names[i].c_str(), L"rb"), fclose);
+#else
+        std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(names[i].c_str(), "r"), fclose);
+#endif
+        if (!fp) {
+            error = "cannot open archive";
+            break;
+        }
+        int64_t endPos = CPsiArchiveReader::IndexChunks(fp.get(), chunks);
+        if (chunks.empty() || endPos != GetFileSize(fp.get())) {
+            error = chunks.empty() ? "not an archive" : "truncated chunk or trailing data";
+            break;
+        }
+        for (size_t j = 0; j < chunks.size() && !error && !writeFailed; ++j) {
+            CPsiArchiveReader::CHUNK_INFO info = chunks[j];
+            data.resize(static_cast<size_t>(info.size));
+            if (!SeekFile(fp.get(), info.pos) || fread(data.data(), 1, data.size(), fp.get()) != data.size()) {
+                error = "cannot read archive";
+                break;
+            }
+            if (j == 0) {
+                CPsiArchiveReader::CHUNK_STATS stats;
+                if (!CPsiArchiveReader::CheckChunk(data.data(), info, 0, stats)) {
+                    error = "first chunk refers to a previous chunk";
+                    break;
+                }
+                if (link && i > 0) {
+                    reader.LinkChunk(data.data(), info, linked);
+                    data.swap(linked);
+                    CPsiArchiveReader::ParseHeader(data.data(), info);
+                }
+            }
+            // The window is needed only to link the next archive
+            if (link && i + 1 < names.size() && !reader.DecodeChunk(data.data(), info, [](int, uint32_t, const uint8_t *, size_t) {})) {
+                error = CPsiArchiveReader::HasExternalTokens(data.data()) ? "archive refers to a token store and needs rehydrating" : "archive is broken";
+                break;
+            }
+            writeFailed = fwrite(data.data(), 1, data.size(), fpDest) != data.size();
+            if (info.trailerSize == 0) {
+                // The last chunk whose trailer was not written yet
+                uint8_t trailer[] = {0x3d, 0x3d, 0x3d, 0x3d};
+                CPsiArchiveReader::ParseHeader(data.data(), info);
+                writeFailed = fwrite(trailer, 1, info.trailerSize, fpDest) != static_cast<size_t>(info.trailerSize) || writeFailed;
+            }
+        }
+    }
+    writeFailed = fflush(fpDest) != 0 || writeFailed;
+    if (error) {
+        fprintf(stderr, "Error: %s: %s.\n", errorName.c_str(), error);
+    }
+    else if (writeFailed) {
+        fprintf(stderr, "Error: write failed.\n");
+    }
+    return error || writeFailed ? 1 : 0;
+}
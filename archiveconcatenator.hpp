@@ -0,0 +1,12 @@
+#ifndef INCLUDE_ARCHIVECONCATENATOR_HPP
+#define INCLUDE_ARCHIVECONCATENATOR_HPP
+
+#include <stdio.h>
+#include <vector>
+#include "fileutil.hpp"
+
+// Concatenates the archives into fpDest, copying their chunks as they are. If link is true, the first chunk of each archive after
+// the first one is rewritten to refer to the dictionary left by the previous archive instead of sending the same tokens again.
+int ConcatArchives(const std::vector<NATIVE_STRING> &names, FILE *fpDest, bool link);
+
+#endif
@@ -0,0 +1,38 @@
+#include "archivecontext.hpp"
+
+bool AddSection(CPsiArchiver &psiArchiver, CUT_CONTEXT &cutContext, int pid, int64_t pcr, size_t psiSize, const uint8_t *psi)
+{
+    if (!cutContext.enabled) {
+        return psiArchiver.Add(pid, pcr, psiSize, psi);
+    }
+    if (cutContext.initialPcr < 0) {
+        cutContext.initialPcr = cutContext.lastPcr = pcr;
+    }
+    // Check if PCR is valid and not go back.
+    if (pcr < 0 || ((0x200000000 + pcr - cutContext.lastPcr) & 0x1ffffffff) >= 0x100000000) {
+        return true;
+    }
+    cutContext.lastPcr = pcr;
+    int pcrMsec = static_cast<int>(((0x200000000 + pcr - cutContext.initialPcr) & 0x1ffffffff) / 90);
+    while (cutContext.cutList.size() >= 2 && cutContext.cutList[cutContext.cutList.size() - 2] <= pcrMsec) {
+        cutContext.totalCutMsec += cutContext.cutList[cutContext.cutList.size() - 2] - cutContext.cutList.back();
+        cutContext.cutList.pop_back();
+        cutContext.cutList.pop_back();
+    }
+    if (cutContext.cutList.empty() || cutContext.cutList.back() > pcrMsec) {
+        return psiArchiver.Add(pid, (0x200000000 + pcr - cutContext.totalCutMsec * 90) & 0x1ffffffff, psiSize, psi);
+    }
+    return true;
+}
+
+
+bool CheckCompletion(const CPsiExtractor &psiExtractor, int completionTimeout, int64_t &completionInitialPcr)
+{
+    int64_t pcr = psiExtractor.GetPcr();
+    if (pcr >= 0 && completionInitialPcr < 0) {
+        completionInitialPcr = pcr;
+    }
+    return psiExtractor.IsCompleted() ||
+           (completionTimeout > 0 && pcr >= 0 &&
+            ((0x200000000 + pcr - completionInitialPcr) & 0x1ffffffff) >= static_cast<int64_t>(completionTimeout) * 90000);
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_ARCHIVECONTEXT_HPP
+#define INCLUDE_ARCHIVECONTEXT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "psiarchiver.hpp"
+#include "psiextractor.hpp"
+
+// Cut regions (-c) applied to the archived sections
+struct CUT_CONTEXT
+{
+    bool enabled;
+    int totalCutMsec;
+    long long initialPcr;
+    long long lastPcr;
+    std::vector<int> cutList;
+};
+
+// Adds a section to the archive unless it is in the cut regions
+bool AddSection(CPsiArchiver &psiArchiver, CUT_CONTEXT &cutContext, int pid, int64_t pcr, size_t psiSize, const uint8_t *psi);
+// Returns true when all tables are received or the time is up (-w)
+bool CheckCompletion(const CPsiExtractor &psiExtractor, int completionTimeout, int64_t &completionInitialPcr);
+
+#endif
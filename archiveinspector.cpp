@@ -0,0 +1,164 @@
+#include "archiveinspector.hpp"
+#include "psiarchivereader.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace
+{
+// Calls func with each index below count on worker threads
+void RunParallel(int workerCount, size_t count, const std::function<void (size_t)> &func)
+{
+    std::atomic<size_t> nextIndex(0);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::min(workerCount, static_cast<int>(std::min<size_t>(count, 256))); ++i) {
+        workers.emplace_back([&]() {
+            for (size_t index; (index = nextIndex++) < count; ) {
+                func(index);
+            }
+        });
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+}
+
+std::string FormatArchiveTime(uint32_t t)
+{
+    char buf[32] = "-";
+    if (t != CPsiArchiveReader::UNKNOWN_TIME) {
+        snprintf(buf, sizeof(buf), "%.3f", t / 11250.0);
+    }
+    return buf;
+}
+}
+
+int InspectArchives(const std::vector<NATIVE_STRING> &names, FILE *fpReport, int workerCount, bool showInfo)
+{
+    struct ARCHIVE
+    {
+        bool opened;
+        int64_t fileSize;
+        int64_t endPos;
+        std::vector<CPsiArchiveReader::CHUNK_INFO> chunks;
+        std::vector<CPsiArchiveReader::CHUNK_STATS> stats;
+    };
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<ARCHIVE> archives(names.size());
+    RunParallel(workerCount, names.size(), [&](size_t index) {
+        ARCHIVE &archive = archives[index];
+#ifdef _WIN32
+        std::unique_ptr<FILE, decltype(&fclose)> fp(_wfopen(names[index].c_str(), L"rb"), fclose);
+#else
+        std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(names[index].c_str(), "r"), fclose);
+#endif
+        archive.opened = !!fp;
+        if (archive.opened) {
+            archive.endPos = CPsiArchiveReader::IndexChunks(fp.get(), archive.chunks);
+            archive.fileSize = GetFileSize(fp.get());
+            archive.stats.resize(archive.chunks.size());
+        }
+    });
+
+    // Check runs of chunks, so that workers read files sequentially
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < archives.size(); ++i) {
+        int64_t runSize = 0;
+        for (size_t j = 0; j < archives[i].chunks.size(); ++j) {
+            if (j == 0 || runSize >= 4 * 1024 * 1024) {
+                runs.emplace_back(i, j);
+                runSize = 0;
+            }
+            runSize += archives[i].chunks[j].size;
+        }
+    }
+    RunParallel(workerCount, runs.size(), [&](size_t index) {
+        ARCHIVE &archive = archives[runs[index].first];
+        size_t endChunk = index + 1 < runs.size() && runs[index + 1].first == runs[index].first ? runs[index + 1].second : archive.chunks.size();
+#ifdef _WIN32
+        std::unique_ptr<FILE, decltype(&fclose)> fp(_wfopen(names[runs[index].first].c_str(), L"rb"), fclose);
+#else
+        std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(names[runs[index].first].c_str(), "r"), fclose);
+#endif
+        std::vector<uint8_t> buf;
+        for (size_t i = runs[index].second; i < endChunk; ++i) {
+            const CPsiArchiveReader::CHUNK_INFO &info = archive.chunks[i];
+            if (info.pos + info.size > archive.fileSize) {
+                // Indexed chunks are within the file, unless it has been truncated since
+                archive.stats[i].error = "chunk is beyond the end of file";
+                continue;
+            }
+            buf.resize(static_cast<size_t>(info.size));
+            if (!fp || !SeekFile(fp.get(), info.pos) || fread(buf.data(), 1, buf.size(), fp.get()) != buf.size()) {
+                archive.stats[i].error = "cannot read chunk";
+                continue;
+            }
+            CPsiArchiveReader::CheckChunk(buf.data(), info, i == 0 ? 0 : archive.chunks[i - 1].dictionaryWindowLength, archive.stats[i]);
+        }
+    });
+
+    int failedCount = 0;
+    int64_t totalSize = 0;
+    if (showInfo) {
+        fprintf(fpReport, "# offset\tsize\tsections\tnew_tokens\treferences\thit_ratio\tnew_token_bytes\tfirst_time\tlast_time\n");
+    }
+    for (size_t i = 0; i < archives.size(); ++i) {
+        const ARCHIVE &archive = archives[i];
+        std::string name = NativeToString(names[i].c_str());
+        int errorCount = archive.opened ? 0 : 1;
+        uint32_t sectionCount = 0;
+        uint32_t newTokenCount = 0;
+        int64_t newTokenBytes = 0;
+        uint32_t firstTime = CPsiArchiveReader::UNKNOWN_TIME;
+        uint32_t lastTime = CPsiArchiveReader::UNKNOWN_TIME;
+        for (size_t j = 0; j < archive.chunks.size(); ++j) {
+            const CPsiArchiveReader::CHUNK_INFO &info = archive.chunks[j];
+            const CPsiArchiveReader::CHUNK_STATS &stats = archive.stats[j];
+            sectionCount += stats.sectionCount;
+            newTokenCount += stats.newTokenCount;
+            newTokenBytes += stats.newTokenBytes;
+            if (firstTime == CPsiArchiveReader::UNKNOWN_TIME) {
+                firstTime = stats.firstTime;
+            }
+            if (stats.lastTime != CPsiArchiveReader::UNKNOWN_TIME) {
+                lastTime = stats.lastTime;
+            }
+            if (showInfo) {
+                // Sections that needed no new token
+                double hitRatio = stats.sectionCount > 0 ? 1.0 - static_cast<double>(stats.newTokenCount) / stats.sectionCount : 0.0;
+                fprintf(fpReport, "%lld\t%lld\t%u\t%d\t%d\t%.3f\t%lld\t%s\t%s\n", static_cast<long long>(info.pos), static_cast<long long>(info.size),
+                        stats.sectionCount, stats.newTokenCount, stats.referenceCount, hitRatio, static_cast<long long>(stats.newTokenBytes),
+                        FormatArchiveTime(stats.firstTime).c_str(), FormatArchiveTime(stats.lastTime).c_str());
+            }
+            if (!stats.error.empty()) {
+                ++errorCount;
+                fprintf(fpReport, "error\t%lld\t%s\t%s\n", static_cast<long long>(info.pos), stats.error.c_str(), name.c_str());
+            }
+        }
+        if (archive.opened && archive.endPos != archive.fileSize) {
+            ++errorCount;
+            fprintf(fpReport, "error\t%lld\t%s\t%s\n", static_cast<long long>(archive.endPos),
+                    archive.chunks.empty() ? "not an archive" : "truncated chunk or trailing data", name.c_str());
+        }
+        else if (!archive.opened) {
+            fprintf(fpReport, "error\t-\tcannot open archive\t%s\n", name.c_str());
+        }
+        double span = firstTime != CPsiArchiveReader::UNKNOWN_TIME && lastTime != CPsiArchiveReader::UNKNOWN_TIME ?
+                      ((0x40000000 + lastTime - firstTime) & 0x3fffffff) / 11250.0 : 0.0;
+        fprintf(fpReport, "%s\t%d chunks\t%u sections\t%.3f hit_ratio\t%lld new_token_bytes\t%.3f sec\t%s\n", errorCount == 0 ? "ok" : "error",
+                static_cast<int>(archive.chunks.size()), sectionCount,
+                sectionCount > 0 ? 1.0 - static_cast<double>(newTokenCount) / sectionCount : 0.0, static_cast<long long>(newTokenBytes), span, name.c_str());
+        failedCount += errorCount == 0 ? 0 : 1;
+        totalSize += archive.opened ? archive.fileSize : 0;
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    fprintf(fpReport, "# %d archives, %d failed, %.1f MB checked in %.3f sec (%.1f MB/s)\n", static_cast<int>(archives.size()), failedCount,
+            totalSize / 1e6, sec, sec > 0 ? totalSize / 1e6 / sec : 0.0);
+    return failedCount == 0 && fflush(fpReport) == 0 ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+#ifndef INCLUDE_ARCHIVEINSPECTOR_HPP
+#define INCLUDE_ARCHIVEINSPECTOR_HPP
+
+#include <stdio.h>
+#include <vector>
+#include "fileutil.hpp"
+
+// Indexes the chunks of the archives and checks them on worker threads. Reports errors (and statistics of each chunk if showInfo) to fpReport.
+int InspectArchives(const std::vector<NATIVE_STRING> &names, FILE *fpReport, int workerCount, bool showInfo);
+
+#endif
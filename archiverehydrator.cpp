@@ -0,0 +1,59 @@
+#include "archiverehydrator.hpp"
+#include "fileutil.hpp"
+#include "psiarchivereader.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+int RehydrateArchive(FILE *fpSrc, FILE *fpDest, const CTokenStore &tokenStore)
+{
+    auto loadToken = [&tokenStore](const uint8_t *hash, size_t size, std::vector<uint8_t> &token) {
+        return tokenStore.Get(hash, size, token);
+    };
+    int64_t srcFileSize = GetSeekableFileSize(fpSrc);
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> rehydrated;
+    uint8_t header[CPsiArchiveReader::HEADER_SIZE];
+    size_t headerFill = 0;
+    int prevWindowLength = 0;
+    std::string error;
+    bool writeFailed = false;
+    while (error.empty() && !writeFailed) {
+        headerFill += fread(header + headerFill, 1, sizeof(header) - headerFill, fpSrc);
+        if (headerFill == 0) {
+            break;
+        }
+        CPsiArchiveReader::CHUNK_INFO info;
+        if (headerFill < sizeof(header) || !CPsiArchiveReader::ParseHeader(header, info)) {
+            error = "archive is broken or not an archive";
+            break;
+        }
+        size_t bodySize = static_cast<size_t>(info.size - info.trailerSize);
+        data.assign(header, header + sizeof(header));
+        if (!ReadChunkBody(fpSrc, srcFileSize, data, bodySize)) {
+            error = "archive is truncated";
+            break;
+        }
+        // The trailer may be missing or cut off, then its place is the next header
+        headerFill = fread(header, 1, info.trailerSize, fpSrc);
+        if (std::count(header, header + headerFill, 0x3d) == static_cast<int>(headerFill)) {
+            headerFill = 0;
+        }
+        CPsiArchiveReader::CHUNK_STATS stats;
+        if (!CPsiArchiveReader::RehydrateChunk(data.data(), info, prevWindowLength, loadToken, rehydrated, stats)) {
+            error = stats.error;
+            break;
+        }
+        prevWindowLength = info.dictionaryWindowLength;
+        writeFailed = fwrite(rehydrated.data(), 1, rehydrated.size(), fpDest) != rehydrated.size();
+    }
+    writeFailed = fflush(fpDest) != 0 || writeFailed;
+    if (!error.empty()) {
+        fprintf(stderr, "Error: %s.\n", error.c_str());
+    }
+    else if (writeFailed) {
+        fprintf(stderr, "Error: write failed.\n");
+    }
+    return !error.empty() || writeFailed ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_ARCHIVEREHYDRATOR_HPP
+#define INCLUDE_ARCHIVEREHYDRATOR_HPP
+
+#include <stdio.h>
+#include "tokenstore.hpp"
+
+// Copies the archive putting back the tokens which its chunks refer to in the token store, so that it is decodable by itself
+int RehydrateArchive(FILE *fpSrc, FILE *fpDest, const CTokenStore &tokenStore);
+
+#endif
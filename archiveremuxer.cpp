@@ -0,0 +1,136 @@
+#include "archiveremuxer.hpp"
+#include "fileutil.hpp"
+#include "psiarchivereader.hpp"
+#include "sectionpacketizer.hpp"
+#include "util.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+int RemuxArchive(FILE *fpSrc, FILE *fpDest, double speed)
+{
+    static const size_t OUTPUT_BUFFER_SIZE = 188 * 4096;
+    CPsiArchiveReader reader;
+    CSectionPacketizer packetizer;
+    std::vector<uint8_t> buf;
+    // Enough for a few sections over the threshold
+    buf.reserve(OUTPUT_BUFFER_SIZE + 188 * 256);
+    bool writeFailed = false;
+    auto writeOut = [&]() {
+        if (!buf.empty()) {
+            writeFailed = fwrite(buf.data(), 1, buf.size(), fpDest) != buf.size() || writeFailed;
+            buf.clear();
+        }
+    };
+
+    uint32_t groupTime = CPsiArchiveReader::UNKNOWN_TIME;
+    uint32_t pacedTime = CPsiArchiveReader::UNKNOWN_TIME;
+    int64_t elapsedTime = 0;
+    auto baseClock = std::chrono::steady_clock::now();
+    auto paceTo = [&](uint32_t time) {
+        if (speed > 0) {
+            uint32_t diff = (0x40000000 + time - pacedTime) & 0x3fffffff;
+            if (pacedTime == CPsiArchiveReader::UNKNOWN_TIME || diff > 60 * 11250) {
+                // Going back or a long gap is a discontinuity
+                elapsedTime = 0;
+                baseClock = std::chrono::steady_clock::now();
+            }
+            else {
+                elapsedTime += diff;
+                writeOut();
+                writeFailed = fflush(fpDest) != 0 || writeFailed;
+                std::this_thread::sleep_until(baseClock + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                              std::chrono::duration<double>(elapsedTime / 11250.0 / speed)));
+            }
+            pacedTime = time;
+        }
+    };
+
+    // PCRs go to the PCR_PID of the last PMT. PMTs without PCR_PID (as created by the extractor) are rewritten to refer to
+    // REMUX_PCR_PID, which is also used before a PMT is found.
+    static const int REMUX_PCR_PID = 0x1ffe;
+    int pcrPid = REMUX_PCR_PID;
+    uint8_t pmt[4096];
+    uint32_t pcrTime = CPsiArchiveReader::UNKNOWN_TIME;
+    auto onSection = [&](int pid, uint32_t time, const uint8_t *section, size_t size) {
+        if (time != groupTime) {
+            // Only sections of the same time share packets
+            packetizer.FlushPending(buf);
+            groupTime = time;
+            if (time != CPsiArchiveReader::UNKNOWN_TIME) {
+                uint32_t diff = (0x40000000 + time - pcrTime) & 0x3fffffff;
+                bool continuous = pcrTime != CPsiArchiveReader::UNKNOWN_TIME && diff <= 60 * 11250;
+                // Fill the gap with PCRs every 100 msec
+                for (uint32_t t = 1125; continuous && t < diff; t += 1125) {
+                    uint32_t gapTime = (pcrTime + t) & 0x3fffffff;
+                    paceTo(gapTime);
+                    packetizer.AddPcr(pcrPid, static_cast<int64_t>(gapTime) << 3, false, buf);
+                }
+                paceTo(time);
+                packetizer.AddPcr(pcrPid, static_cast<int64_t>(time) << 3, pcrTime != CPsiArchiveReader::UNKNOWN_TIME && !continuous, buf);
+                pcrTime = time;
+            }
+        }
+        if (section[0] == 0x02 && size >= 16 && size <= sizeof(pmt)) {
+            pcrPid = ((section[8] & 0x1f) << 8) | section[9];
+            if (pcrPid == 0x1fff) {
+                pcrPid = REMUX_PCR_PID;
+                std::copy(section, section + size, pmt);
+                pmt[8] = static_cast<uint8_t>(0xe0 | pcrPid >> 8);
+                pmt[9] = static_cast<uint8_t>(pcrPid);
+                uint32_t crc = calc_crc32(pmt, static_cast<int>(size - 4));
+                for (int i = 0; i < 4; ++i) {
+                    pmt[size - 4 + i] = static_cast<uint8_t>(crc >> (24 - i * 8));
+                }
+                section = pmt;
+            }
+        }
+        packetizer.AddSection(pid, section, size, buf);
+        if (buf.size() >= OUTPUT_BUFFER_SIZE) {
+            writeOut();
+        }
+    };
+
+    int64_t srcFileSize = GetSeekableFileSize(fpSrc);
+    std::vector<uint8_t> data;
+    uint8_t header[CPsiArchiveReader::HEADER_SIZE];
+    size_t headerFill = 0;
+    const char *error = nullptr;
+    while (!error && !writeFailed) {
+        headerFill += fread(header + headerFill, 1, sizeof(header) - headerFill, fpSrc);
+        if (headerFill == 0) {
+            break;
+        }
+        CPsiArchiveReader::CHUNK_INFO info;
+        if (headerFill < sizeof(header) || !CPsiArchiveReader::ParseHeader(header, info)) {
+            error = "archive is broken or not an archive";
+            break;
+        }
+        size_t bodySize = static_cast<size_t>(info.size - info.trailerSize);
+        data.assign(header, header + sizeof(header));
+        if (!ReadChunkBody(fpSrc, srcFileSize, data, bodySize)) {
+            error = "archive is truncated";
+            break;
+        }
+        // The trailer may be missing or cut off, then its place is the next header
+        headerFill = fread(header, 1, info.trailerSize, fpSrc);
+        if (std::count(header, header + headerFill, 0x3d) == static_cast<int>(headerFill)) {
+            headerFill = 0;
+        }
+        if (!reader.DecodeChunk(data.data(), info, onSection)) {
+            error = CPsiArchiveReader::HasExternalTokens(data.data()) ? "archive refers to a token store and needs rehydrating" : "archive is broken";
+        }
+    }
+    packetizer.FlushPending(buf);
+    writeOut();
+    writeFailed = fflush(fpDest) != 0 || writeFailed;
+    if (error) {
+        fprintf(stderr, "Error: %s.\n", error);
+    }
+    else if (writeFailed) {
+        fprintf(stderr, "Error: write failed.\n");
+    }
+    return error || writeFailed ? 1 : 0;
+}
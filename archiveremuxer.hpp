@@ -0,0 +1,10 @@
+#ifndef INCLUDE_ARCHIVEREMUXER_HPP
+#define INCLUDE_ARCHIVEREMUXER_HPP
+
+#include <stdio.h>
+
+// Decodes the archive and writes its sections back as TS packets.
+// speed > 0 paces the output by the archived times, where 1 is real time.
+int RemuxArchive(FILE *fpSrc, FILE *fpDest, double speed);
+
+#endif
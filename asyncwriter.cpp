@@ -0,0 +1,80 @@
+#include "asyncwriter.hpp"
+#include "probe.hpp"
+
+CAsyncWriter::CAsyncWriter()
+    : m_fp(nullptr)
+    , m_closing(false)
+    , m_failed(false)
+{
+}
+
+CAsyncWriter::~CAsyncWriter()
+{
+    Close();
+}
+
+void CAsyncWriter::Start(FILE *fp)
+{
+    Close();
+    m_fp = fp;
+    m_closing = false;
+    m_failed = false;
+    m_thread = std::thread([this]() { WriterThread(); });
+}
+
+bool CAsyncWriter::Write(const uint8_t *buf, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_thread.joinable()) {
+        return false;
+    }
+    // Keep memory bounded if the consumer stalls. The writer thread takes the whole buffer at once.
+    m_drainedCond.wait(lock, [this]() { return m_failed || m_buf.size() < MAX_BUFFER_SIZE; });
+    if (m_failed) {
+        return false;
+    }
+    m_buf.insert(m_buf.end(), buf, buf + size);
+    m_cond.notify_one();
+    return true;
+}
+
+bool CAsyncWriter::Close()
+{
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+            m_cond.notify_one();
+        }
+        m_thread.join();
+    }
+    return !m_failed;
+}
+
+void CAsyncWriter::WriterThread()
+{
+    std::vector<uint8_t> buf;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_cond.wait(lock, [this]() { return m_closing || !m_buf.empty(); });
+        if (m_buf.empty()) {
+            // Closing
+            break;
+        }
+        buf.swap(m_buf);
+        m_drainedCond.notify_one();
+        lock.unlock();
+        bool failed = fwrite(buf.data(), 1, buf.size(), m_fp) != buf.size() || fflush(m_fp) != 0;
+        PSISIARC_PROBE2(async_write_done, buf.size(), !failed);
+        if (!failed && m_writtenCallback) {
+            m_writtenCallback(buf.size());
+        }
+        buf.clear();
+        lock.lock();
+        if (failed) {
+            m_failed = true;
+            m_drainedCond.notify_one();
+            break;
+        }
+    }
+}
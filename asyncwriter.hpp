@@ -0,0 +1,41 @@
+#ifndef INCLUDE_ASYNCWRITER_HPP
+#define INCLUDE_ASYNCWRITER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Writes data to a file on a separate thread so that the caller does not wait for slow consumers
+// unless MAX_BUFFER_SIZE bytes are already queued
+class CAsyncWriter
+{
+public:
+    CAsyncWriter();
+    ~CAsyncWriter();
+    // Called on the writer thread with the size of each block written and flushed
+    void SetWrittenCallback(const std::function<void (size_t)> &writtenCallback) { m_writtenCallback = writtenCallback; }
+    void Start(FILE *fp);
+    bool Write(const uint8_t *buf, size_t size);
+    bool Close();
+
+private:
+    static const size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+    void WriterThread();
+
+    FILE *m_fp;
+    std::function<void (size_t)> m_writtenCallback;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::condition_variable m_drainedCond;
+    std::vector<uint8_t> m_buf;
+    bool m_closing;
+    bool m_failed;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "batcharchiver.hpp"
+#include "util.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+// Archives a file with copies of the configured extractor and archiver
+bool ArchiveFile(const NATIVE_STRING &srcName, const NATIVE_STRING &destName, CPsiExtractor psiExtractor, CPsiArchiver psiArchiver,
+                 CUT_CONTEXT cutContext, int completionTimeout, int64_t &srcReadSize)
+{
+    srcReadSize = 0;
+#ifdef _WIN32
+    std::unique_ptr<FILE, decltype(&fclose)> srcFile(_wfopen(srcName.c_str(), L"rbS"), fclose);
+#else
+    std::unique_ptr<FILE, decltype(&fclose)> srcFile(fopen(srcName.c_str(), "r"), fclose);
+#endif
+    if (!srcFile) {
+        // Leave dest untouched
+        return false;
+    }
+#ifdef _WIN32
+    std::unique_ptr<FILE, decltype(&fclose)> destFile(_wfopen(destName.c_str(), L"wb"), fclose);
+#else
+    std::unique_ptr<FILE, decltype(&fclose)> destFile(fopen(destName.c_str(), "w"), fclose);
+#endif
+    if (!destFile) {
+        return false;
+    }
+    psiArchiver.SetFile(destFile.get());
+
+    std::vector<uint8_t> buf(65536);
+    int bufCount = 0;
+    int unitSize = 0;
+    int64_t completionInitialPcr = -1;
+    bool completed = false;
+    for (;;) {
+        int n = static_cast<int>(fread(buf.data() + bufCount, 1, buf.size() - bufCount, srcFile.get()));
+        bufCount += n;
+        srcReadSize += n;
+        if (bufCount == static_cast<int>(buf.size()) || n == 0) {
+            int bufPos = 0;
+            for (; find_ts_packet(buf.data(), bufCount, &bufPos, &unitSize, n == 0, nullptr); bufPos += unitSize) {
+                bool writeFailed = false;
+                psiExtractor.AddPacket(buf.data() + bufPos, [&psiArchiver, &cutContext, &writeFailed](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+                    writeFailed = !AddSection(psiArchiver, cutContext, pid, pcr, psiSize, psi) || writeFailed;
+                });
+                if (writeFailed) {
+                    return false;
+                }
+                if (completionTimeout >= 0) {
+                    completed = CheckCompletion(psiExtractor, completionTimeout, completionInitialPcr);
+                    if (completed) {
+                        break;
+                    }
+                }
+            }
+            if (completed || n == 0) {
+                break;
+            }
+            // Keep the rest for the next buffer
+            std::copy(buf.begin() + bufPos, buf.begin() + bufCount, buf.begin());
+            bufCount -= bufPos;
+        }
+    }
+    bool ret = psiArchiver.Flush();
+    return fclose(destFile.release()) == 0 && ret;
+}
+
+}
+
+int RunBatch(const NATIVE_STRING &listName, FILE *fpStatus, int workerCount, const CPsiExtractor &psiExtractor, const CPsiArchiver &psiArchiver,
+             const CUT_CONTEXT &cutContext, int completionTimeout)
+{
+    std::vector<std::pair<NATIVE_STRING, NATIVE_STRING>> items;
+    std::vector<std::string> lines;
+    if (!ReadList(listName, lines)) {
+        fprintf(stderr, "Error: cannot open batch list.\n");
+        return 1;
+    }
+    for (auto it = lines.cbegin(); it != lines.end(); ++it) {
+        size_t tab = it->find('\t');
+        if (tab == std::string::npos || tab == 0 || tab + 1 == it->size()) {
+            fprintf(stderr, "Error: batch list line must be \"src<TAB>dest\".\n");
+            return 1;
+        }
+        items.emplace_back(Utf8ToNative(it->substr(0, tab)), Utf8ToNative(it->substr(tab + 1)));
+    }
+
+    std::atomic<size_t> nextIndex(0);
+    std::mutex statusMutex;
+    int failedCount = 0;
+    int64_t totalReadSize = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::min(workerCount, static_cast<int>(items.size())); ++i) {
+        workers.emplace_back([&]() {
+            for (;;) {
+                size_t index = nextIndex++;
+                if (index >= items.size()) {
+                    break;
+                }
+                auto itemStartTime = std::chrono::steady_clock::now();
+                int64_t srcReadSize;
+                bool ret = ArchiveFile(items[index].first, items[index].second, psiExtractor, psiArchiver, cutContext, completionTimeout, srcReadSize);
+                double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - itemStartTime).count();
+                std::lock_guard<std::mutex> lock(statusMutex);
+                failedCount += ret ? 0 : 1;
+                totalReadSize += srcReadSize;
+                fprintf(fpStatus, "%s\t%lld\t%.3f\t%s\t%s\n", ret ? "ok" : "error", static_cast<long long>(srcReadSize), sec,
+                        NativeToString(items[index].first.c_str()).c_str(), NativeToString(items[index].second.c_str()).c_str());
+                fflush(fpStatus);
+            }
+        });
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    fprintf(fpStatus, "# %d files, %d failed, %.1f MB read in %.3f sec (%.1f MB/s)\n", static_cast<int>(items.size()), failedCount,
+            totalReadSize / 1e6, sec, sec > 0 ? totalReadSize / 1e6 / sec : 0.0);
+    return failedCount == 0 && fflush(fpStatus) == 0 ? 0 : 1;
+}
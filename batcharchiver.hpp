@@ -0,0 +1,14 @@
+#ifndef INCLUDE_BATCHARCHIVER_HPP
+#define INCLUDE_BATCHARCHIVER_HPP
+
+#include <stdio.h>
+#include "archivecontext.hpp"
+#include "fileutil.hpp"
+#include "psiarchiver.hpp"
+#include "psiextractor.hpp"
+
+// Processes "src<TAB>dest" lines of the list on worker threads and reports the status of each file to fpStatus
+int RunBatch(const NATIVE_STRING &listName, FILE *fpStatus, int workerCount, const CPsiExtractor &psiExtractor, const CPsiArchiver &psiArchiver,
+             const CUT_CONTEXT &cutContext, int completionTimeout);
+
+#endif
@@ -0,0 +1,181 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "fileutil.hpp"
+#include <algorithm>
+#include <memory>
+
+#ifdef _WIN32
+bool SyncFile(FILE *fp)
+{
+    return fflush(fp) == 0 && _commit(_fileno(fp)) == 0;
+}
+
+bool SyncDirectoryOf(const wchar_t *)
+{
+    return true;
+}
+#else
+bool SyncFile(FILE *fp)
+{
+    return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+bool SyncDirectoryOf(const char *name)
+{
+    std::string dirName(name);
+    dirName.erase(dirName.find_last_of('/') + 1);
+    int fd = open(dirName.empty() ? "." : dirName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = fsync(fd) == 0;
+    close(fd);
+    return ret;
+}
+#endif
+
+#ifdef _WIN32
+std::string NativeToString(const wchar_t *s)
+{
+    std::string ret;
+    for (; *s; ++s) {
+        ret += 0 < *s && *s <= 127 ? static_cast<char>(*s) : '?';
+    }
+    return ret;
+}
+#else
+std::string NativeToString(const char *s)
+{
+    return s;
+}
+#endif
+
+#ifdef _WIN32
+NATIVE_STRING Utf8ToNative(const std::string &s)
+{
+    int len = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, nullptr, 0);
+    std::wstring ret(std::max(len, 1), L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, &ret[0], len);
+    ret.pop_back();
+    return ret;
+}
+#else
+NATIVE_STRING Utf8ToNative(const std::string &s)
+{
+    return s;
+}
+#endif
+
+bool GetLine(std::string &line, FILE *fp)
+{
+    line.clear();
+    for (;;) {
+        char buf[1024];
+        bool eof = !fgets(buf, sizeof(buf), fp);
+        if (!eof) {
+            line += buf;
+            if (line.empty() || line.back() != '\n') {
+                continue;
+            }
+        }
+        if (!line.empty() && line.back() == '\n') {
+            line.pop_back();
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        return eof;
+    }
+}
+
+
+bool ReadList(const NATIVE_STRING &listName, std::vector<std::string> &lines)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> listFile(nullptr, fclose);
+    if (listName.size() != 1 || listName[0] != '-') {
+#ifdef _WIN32
+        listFile.reset(_wfopen(listName.c_str(), L"r"));
+#else
+        listFile.reset(fopen(listName.c_str(), "r"));
+#endif
+        if (!listFile) {
+            return false;
+        }
+    }
+    std::string line;
+    for (bool eof = false; !eof; ) {
+        eof = GetLine(line, listFile ? listFile.get() : stdin);
+        if (!line.empty() && line[0] != '#') {
+            lines.push_back(line);
+        }
+    }
+    return true;
+}
+
+
+bool SeekFile(FILE *fp, int64_t pos)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, pos, SEEK_SET) == 0;
+#else
+    return fseeko(fp, pos, SEEK_SET) == 0;
+#endif
+}
+
+
+int64_t GetFileSize(FILE *fp)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, 0, SEEK_END) == 0 ? _ftelli64(fp) : -1;
+#else
+    return fseeko(fp, 0, SEEK_END) == 0 ? static_cast<int64_t>(ftello(fp)) : -1;
+#endif
+}
+
+
+int64_t TellFile(FILE *fp)
+{
+#ifdef _WIN32
+    return _ftelli64(fp);
+#else
+    return static_cast<int64_t>(ftello(fp));
+#endif
+}
+
+
+int64_t GetSeekableFileSize(FILE *fp)
+{
+    int64_t pos = TellFile(fp);
+    if (pos < 0) {
+        return -1;
+    }
+    int64_t size = GetFileSize(fp);
+    return SeekFile(fp, pos) ? size : -1;
+}
+
+
+bool ReadChunkBody(FILE *fp, int64_t fileSize, std::vector<uint8_t> &data, size_t bodySize)
+{
+    static const size_t READ_STEP_SIZE = 1024 * 1024;
+    size_t pos = data.size();
+    if (fileSize >= 0) {
+        int64_t filePos = TellFile(fp);
+        if (filePos < 0 || static_cast<int64_t>(bodySize - pos) > fileSize - filePos) {
+            return false;
+        }
+    }
+    while (pos < bodySize) {
+        size_t n = fileSize >= 0 ? bodySize - pos : std::min(bodySize - pos, READ_STEP_SIZE);
+        data.resize(pos + n);
+        if (fread(data.data() + pos, 1, n, fp) != n) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
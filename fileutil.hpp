@@ -0,0 +1,49 @@
+#ifndef INCLUDE_FILEUTIL_HPP
+#define INCLUDE_FILEUTIL_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+typedef std::wstring NATIVE_STRING;
+#else
+typedef std::string NATIVE_STRING;
+#endif
+
+// Flushes fp and the file contents to the disk
+bool SyncFile(FILE *fp);
+#ifdef _WIN32
+// Does nothing, as renaming with MOVEFILE_WRITE_THROUGH is durable by itself
+bool SyncDirectoryOf(const wchar_t *name);
+#else
+// Flushes the directory entry of name to the disk
+bool SyncDirectoryOf(const char *name);
+#endif
+
+// Converts to ASCII, replacing other characters with '?' on Windows
+#ifdef _WIN32
+std::string NativeToString(const wchar_t *s);
+#else
+std::string NativeToString(const char *s);
+#endif
+NATIVE_STRING Utf8ToNative(const std::string &s);
+// Reads a line without the trailing newline. Returns true at the end of the file.
+bool GetLine(std::string &line, FILE *fp);
+// Reads lines of the list ("-" for stdin) except empty lines and comments
+bool ReadList(const NATIVE_STRING &listName, std::vector<std::string> &lines);
+bool SeekFile(FILE *fp, int64_t pos);
+// Returns -1 on error. The file position is moved to the end.
+int64_t GetFileSize(FILE *fp);
+// Returns -1 on error
+int64_t TellFile(FILE *fp);
+// Returns the file size without moving the file position, or -1 if fp is not seekable (a pipe)
+int64_t GetSeekableFileSize(FILE *fp);
+// Reads the rest of a chunk of bodySize bytes into data, which holds its header.
+// The size comes from the header, so it is checked against fileSize (if not -1) before allocating, and a pipe
+// is read in steps so that a broken header does not make it allocate much more than the bytes that actually arrive.
+bool ReadChunkBody(FILE *fp, int64_t fileSize, std::vector<uint8_t> &data, size_t bodySize);
+
+#endif
@@ -0,0 +1,106 @@
+#include "latencyhistogram.hpp"
+#include <algorithm>
+
+CLatencyHistogram::CLatencyHistogram()
+    : m_totalCount(0)
+    , m_totalUsec(0)
+    , m_maxUsec(0)
+{
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        m_counts[i] = 0;
+    }
+}
+
+void CLatencyHistogram::Record(std::chrono::steady_clock::duration d)
+{
+    int64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    uint64_t v = usec > 0 ? static_cast<uint64_t>(usec) : 0;
+    m_counts[GetBucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+    m_totalCount.fetch_add(1, std::memory_order_relaxed);
+    m_totalUsec.fetch_add(v, std::memory_order_relaxed);
+    uint64_t maxUsec = m_maxUsec.load(std::memory_order_relaxed);
+    while (v > maxUsec && !m_maxUsec.compare_exchange_weak(maxUsec, v, std::memory_order_relaxed)) {
+    }
+}
+
+void CLatencyHistogram::Dump(FILE *fp, const char *name) const
+{
+    uint64_t counts[BUCKET_COUNT];
+    uint64_t totalCount = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        totalCount += counts[i];
+    }
+    // Percentiles are the upper bounds of buckets
+    static const double PERCENTILES[] = {50, 90, 99, 99.9};
+    uint64_t maxUsec = m_maxUsec.load();
+    uint64_t percentileUsec[4] = {};
+    uint64_t accumCount = 0;
+    for (int i = 0, j = 0; i < BUCKET_COUNT && j < 4; ++i) {
+        accumCount += counts[i];
+        for (; j < 4 && counts[i] > 0 && accumCount >= totalCount * PERCENTILES[j] / 100; ++j) {
+            percentileUsec[j] = std::min(GetBucketLowerBound(i + 1), maxUsec);
+        }
+    }
+    fprintf(fp, "# %s usec: count %llu, mean %.1f, p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n", name,
+            static_cast<unsigned long long>(totalCount), totalCount > 0 ? static_cast<double>(m_totalUsec.load()) / totalCount : 0.0,
+            static_cast<unsigned long long>(percentileUsec[0]), static_cast<unsigned long long>(percentileUsec[1]),
+            static_cast<unsigned long long>(percentileUsec[2]), static_cast<unsigned long long>(percentileUsec[3]),
+            static_cast<unsigned long long>(maxUsec));
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        if (counts[i] > 0) {
+            fprintf(fp, "%s\t%llu\t%llu\t%llu\n", name, static_cast<unsigned long long>(GetBucketLowerBound(i)),
+                    static_cast<unsigned long long>(GetBucketLowerBound(i + 1)), static_cast<unsigned long long>(counts[i]));
+        }
+    }
+}
+
+int CLatencyHistogram::GetBucketIndex(uint64_t usec)
+{
+    if (usec < (1 << SUB_BUCKET_BITS)) {
+        return static_cast<int>(usec);
+    }
+    int exponent = SUB_BUCKET_BITS;
+    while (exponent < 40 && usec >> (exponent + 1)) {
+        ++exponent;
+    }
+    if (usec >> (exponent + 1)) {
+        // Too large
+        return BUCKET_COUNT - 1;
+    }
+    int sub = static_cast<int>(usec >> (exponent - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+    return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
+}
+
+uint64_t CLatencyHistogram::GetBucketLowerBound(int index)
+{
+    if (index < (1 << SUB_BUCKET_BITS)) {
+        return index;
+    }
+    int exponent = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+    int sub = index & ((1 << SUB_BUCKET_BITS) - 1);
+    return static_cast<uint64_t>((1 << SUB_BUCKET_BITS) + sub) << (exponent - SUB_BUCKET_BITS);
+}
+
+void CSectionLatencyTracker::HandOver(size_t size)
+{
+    m_handedOverSize += size;
+    if (!m_pendingTimes.empty()) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_chunks.emplace_back();
+        m_chunks.back().endPos = m_handedOverSize;
+        m_chunks.back().addedTimes.swap(m_pendingTimes);
+    }
+}
+
+void CSectionLatencyTracker::Written(size_t size)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_writtenSize += size;
+    for (; !m_chunks.empty() && m_chunks.front().endPos <= m_writtenSize; m_chunks.pop_front()) {
+        for (auto it = m_chunks.front().addedTimes.cbegin(); it != m_chunks.front().addedTimes.end(); ++it) {
+            m_histogram.Record(now - *it);
+        }
+    }
+}
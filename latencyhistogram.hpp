@@ -0,0 +1,61 @@
+#ifndef INCLUDE_LATENCYHISTOGRAM_HPP
+#define INCLUDE_LATENCYHISTOGRAM_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Log-linear histogram of durations in microseconds, where each power of two is split into 8 buckets.
+// Record() may be called from any thread without locking.
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram();
+    void Record(std::chrono::steady_clock::duration d);
+    // Writes the summary and non-empty buckets
+    void Dump(FILE *fp, const char *name) const;
+
+private:
+    static const int SUB_BUCKET_BITS = 3;
+    // Up to 2^40 usec
+    static const int BUCKET_COUNT = (40 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+    static int GetBucketIndex(uint64_t usec);
+    static uint64_t GetBucketLowerBound(int index);
+
+    std::atomic<uint64_t> m_counts[BUCKET_COUNT];
+    std::atomic<uint64_t> m_totalCount;
+    std::atomic<uint64_t> m_totalUsec;
+    std::atomic<uint64_t> m_maxUsec;
+};
+
+// Measures the time from adding each section to the archiver until its chunk is written out
+class CSectionLatencyTracker
+{
+public:
+    CSectionLatencyTracker(CLatencyHistogram &histogram) : m_histogram(histogram), m_handedOverSize(0), m_writtenSize(0) {}
+    // Called after a section is added
+    void AddSection() { m_pendingTimes.push_back(std::chrono::steady_clock::now()); }
+    // Called when the archiver hands over data to the writer. The sections added before are in it.
+    void HandOver(size_t size);
+    // Called when the writer has written the next size bytes. May be called from another thread.
+    void Written(size_t size);
+
+private:
+    struct CHUNK_RECORD
+    {
+        int64_t endPos;
+        std::vector<std::chrono::steady_clock::time_point> addedTimes;
+    };
+    CLatencyHistogram &m_histogram;
+    std::vector<std::chrono::steady_clock::time_point> m_pendingTimes;
+    int64_t m_handedOverSize;
+    std::mutex m_mutex;
+    int64_t m_writtenSize;
+    std::deque<CHUNK_RECORD> m_chunks;
+};
+
+#endif
@@ -0,0 +1,249 @@
+#define PSISIARC_BUILDING
+#include "libpsisiarc.h"
+#include "psiarchiver.hpp"
+#include "psiextractor.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <new>
+#include <vector>
+
+struct psisiarc_context
+{
+    CPsiExtractor psiExtractor;
+    CPsiArchiver psiArchiver;
+    psisiarc_write_callback callback;
+    void *user;
+    std::vector<uint8_t> buf;
+    int unitSize;
+    std::vector<uint8_t> output;
+    size_t outputPos;
+};
+
+namespace
+{
+// Processes buffered packets. Returns false if writing failed.
+bool ProcessBuffer(psisiarc_context *ctx, bool isFinal)
+{
+    int bufCount = static_cast<int>(ctx->buf.size());
+    if (!isFinal && bufCount < (ctx->unitSize != 0 ? ctx->unitSize : 8 * 204)) {
+        return true;
+    }
+    int bufPos = 0;
+    bool writeFailed = false;
+    for (; find_ts_packet(ctx->buf.data(), bufCount, &bufPos, &ctx->unitSize, isFinal, nullptr); bufPos += ctx->unitSize) {
+        ctx->psiExtractor.AddPacket(ctx->buf.data() + bufPos, [ctx, &writeFailed](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+            writeFailed = !ctx->psiArchiver.Add(pid, pcr, psiSize, psi) || writeFailed;
+        });
+    }
+    // Keep the rest for the next call
+    ctx->buf.erase(ctx->buf.begin(), ctx->buf.begin() + bufPos);
+    return !writeFailed;
+}
+}
+
+int psisiarc_get_api_version(void)
+{
+    return PSISIARC_API_VERSION;
+}
+
+psisiarc_context *psisiarc_create(void)
+{
+    psisiarc_context *ctx = nullptr;
+    try {
+        ctx = new psisiarc_context;
+        ctx->callback = nullptr;
+        ctx->user = nullptr;
+        ctx->unitSize = 0;
+        ctx->outputPos = 0;
+        ctx->psiArchiver.SetWriteCallback([ctx](const uint8_t *data, size_t size) {
+            if (ctx->callback) {
+                return ctx->callback(ctx->user, data, size) != 0;
+            }
+            ctx->output.insert(ctx->output.end(), data, data + size);
+            return true;
+        });
+    }
+    catch (const std::bad_alloc &) {
+        delete ctx;
+        return nullptr;
+    }
+    return ctx;
+}
+
+void psisiarc_destroy(psisiarc_context *ctx)
+{
+    delete ctx;
+}
+
+int psisiarc_add_target_pid(psisiarc_context *ctx, int pid)
+{
+    if (!ctx || !(0 <= pid && pid <= 8191)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        ctx->psiExtractor.AddTargetPid(pid);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_add_target_table_id_range(psisiarc_context *ctx, int pid, int table_id_from, int table_id_to)
+{
+    if (!ctx || !(0 <= pid && pid <= 8191) || !(0 <= table_id_from && table_id_from <= table_id_to && table_id_to <= 255)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        ctx->psiExtractor.AddTargetPid(pid);
+        ctx->psiExtractor.AddTargetTableIdRange(pid, table_id_from, table_id_to);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_set_program_number_or_index(psisiarc_context *ctx, int n)
+{
+    if (!ctx || !(-256 <= n && n <= 65535)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        ctx->psiExtractor.SetProgramNumberOrIndex(n);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_add_target_stream_type(psisiarc_context *ctx, int stream_type)
+{
+    if (!ctx || !(0 <= stream_type && stream_type <= 255)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        ctx->psiExtractor.AddTargetStreamType(stream_type);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_add_preset(psisiarc_context *ctx, const char *name)
+{
+    if (!ctx || !name) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        if (!ctx->psiExtractor.AddPreset(name)) {
+            return PSISIARC_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_set_write_interval(psisiarc_context *ctx, double seconds)
+{
+    if (!ctx || !(0 <= seconds && seconds <= 600)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    // 1/11250 seconds resolution
+    uint32_t interval = static_cast<uint32_t>(seconds * 11250 + 0.5);
+    try {
+        ctx->psiArchiver.SetWriteInterval(seconds > 0 ? std::max<uint32_t>(interval, 1) : 0);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_set_dictionary_max_buff_size(psisiarc_context *ctx, size_t size)
+{
+    if (!ctx || size < 8 * 1024 || 1024 * 1024 * 1024 < size) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        ctx->psiArchiver.SetDictionaryMaxBuffSize(size);
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+void psisiarc_set_write_callback(psisiarc_context *ctx, psisiarc_write_callback callback, void *user)
+{
+    if (ctx) {
+        ctx->callback = callback;
+        ctx->user = user;
+    }
+}
+
+int psisiarc_add_packets(psisiarc_context *ctx, const uint8_t *buf, size_t size)
+{
+    if (!ctx || (!buf && size > 0)) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        while (size > 0) {
+            // Keep the buffer small
+            size_t n = std::min<size_t>(size, 65536);
+            ctx->buf.insert(ctx->buf.end(), buf, buf + n);
+            buf += n;
+            size -= n;
+            if (!ProcessBuffer(ctx, false)) {
+                return PSISIARC_ERROR_WRITE;
+            }
+        }
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+    return PSISIARC_OK;
+}
+
+int psisiarc_flush(psisiarc_context *ctx, int is_final)
+{
+    if (!ctx) {
+        return PSISIARC_ERROR_INVALID_ARGUMENT;
+    }
+    try {
+        bool ret = true;
+        if (is_final) {
+            ret = ProcessBuffer(ctx, true);
+            ctx->buf.clear();
+        }
+        ret = ctx->psiArchiver.Flush(!is_final) && ret;
+        return ret ? PSISIARC_OK : PSISIARC_ERROR_WRITE;
+    }
+    catch (const std::bad_alloc &) {
+        return PSISIARC_ERROR_NO_MEMORY;
+    }
+}
+
+size_t psisiarc_get_pending_size(const psisiarc_context *ctx)
+{
+    return ctx ? ctx->output.size() - ctx->outputPos : 0;
+}
+
+size_t psisiarc_read(psisiarc_context *ctx, uint8_t *buf, size_t size)
+{
+    if (!ctx || !buf) {
+        return 0;
+    }
+    size_t n = std::min(size, ctx->output.size() - ctx->outputPos);
+    std::copy(ctx->output.begin() + ctx->outputPos, ctx->output.begin() + ctx->outputPos + n, buf);
+    ctx->outputPos += n;
+    if (ctx->outputPos == ctx->output.size()) {
+        ctx->output.clear();
+        ctx->outputPos = 0;
+    }
+    return n;
+}
@@ -0,0 +1,84 @@
+#ifndef INCLUDE_LIBPSISIARC_H
+#define INCLUDE_LIBPSISIARC_H
+
+/*
+ * C API of psisiarc for in-process embedding.
+ * Functions taking the same context must not be called concurrently. Different contexts are independent.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && !defined(PSISIARC_STATIC)
+#ifdef PSISIARC_BUILDING
+#define PSISIARC_API __declspec(dllexport)
+#else
+#define PSISIARC_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define PSISIARC_API __attribute__((visibility("default")))
+#else
+#define PSISIARC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented when the API changes incompatibly */
+#define PSISIARC_API_VERSION 1
+
+#define PSISIARC_OK 0
+#define PSISIARC_ERROR_INVALID_ARGUMENT (-1)
+#define PSISIARC_ERROR_WRITE (-2)
+#define PSISIARC_ERROR_NO_MEMORY (-3)
+
+typedef struct psisiarc_context psisiarc_context;
+
+/* Receives archive bytes in order. Returns nonzero on success. */
+typedef int (*psisiarc_write_callback)(void *user, const uint8_t *data, size_t size);
+
+PSISIARC_API int psisiarc_get_api_version(void);
+
+PSISIARC_API psisiarc_context *psisiarc_create(void);
+PSISIARC_API void psisiarc_destroy(psisiarc_context *ctx);
+
+/*
+ * Settings. Same as the command line options -p, -n, -t, -r, -i and -b. Call before feeding packets.
+ * Return PSISIARC_ERROR_NO_MEMORY if memory cannot be allocated, and the setting may be partly applied.
+ */
+PSISIARC_API int psisiarc_add_target_pid(psisiarc_context *ctx, int pid);
+PSISIARC_API int psisiarc_add_target_table_id_range(psisiarc_context *ctx, int pid, int table_id_from, int table_id_to);
+PSISIARC_API int psisiarc_set_program_number_or_index(psisiarc_context *ctx, int n);
+PSISIARC_API int psisiarc_add_target_stream_type(psisiarc_context *ctx, int stream_type);
+PSISIARC_API int psisiarc_add_preset(psisiarc_context *ctx, const char *name);
+PSISIARC_API int psisiarc_set_write_interval(psisiarc_context *ctx, double seconds);
+PSISIARC_API int psisiarc_set_dictionary_max_buff_size(psisiarc_context *ctx, size_t size);
+
+/*
+ * Archive bytes are passed to the callback if set.
+ * Otherwise they are kept in the context until the caller takes them with psisiarc_read().
+ */
+PSISIARC_API void psisiarc_set_write_callback(psisiarc_context *ctx, psisiarc_write_callback callback, void *user);
+
+/* Feeds TS bytes. Need not be aligned to packets, 188/192/204-byte packets are detected. */
+PSISIARC_API int psisiarc_add_packets(psisiarc_context *ctx, const uint8_t *buf, size_t size);
+
+/*
+ * Writes out the sections not yet written as a chunk.
+ * If is_final is nonzero, the trailer is written and the archive is complete.
+ * Otherwise the archive can be continued with more packets.
+ */
+PSISIARC_API int psisiarc_flush(psisiarc_context *ctx, int is_final);
+
+/* Size of archive bytes kept in the context when no callback is set */
+PSISIARC_API size_t psisiarc_get_pending_size(const psisiarc_context *ctx);
+
+/* Copies and removes at most size bytes of archive kept in the context. Returns the copied size. */
+PSISIARC_API size_t psisiarc_read(psisiarc_context *ctx, uint8_t *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+#include "metricsserver.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+namespace
+{
+int64_t GetSteadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void AppendMetric(std::string &s, const char *name, const char *type, const char *help, double value)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+    s += buf;
+}
+}
+
+CMetricsServer::CMetricsServer()
+    : m_sock(-1)
+    , m_stopping(false)
+{
+    m_metrics.packetCount = 0;
+    m_metrics.sectionCount = 0;
+    m_metrics.chunkCount = 0;
+    m_metrics.writtenBytes = 0;
+    m_metrics.continuityErrorCount = 0;
+    m_metrics.lastPcrTime = -1;
+    m_metrics.dictionaryBuffSize = 0;
+    m_metrics.dictionaryMaxBuffSize = 0;
+}
+
+CMetricsServer::~CMetricsServer()
+{
+    Close();
+}
+
+bool CMetricsServer::Open(const char *path)
+{
+    Close();
+#ifdef _WIN32
+    static_cast<void>(path);
+    return false;
+#else
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        // Left by a previous instance. Do not remove other files.
+        if (!S_ISSOCK(st.st_mode) || unlink(path) != 0) {
+            return false;
+        }
+    }
+    m_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_sock < 0) {
+        return false;
+    }
+    if (bind(m_sock, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(m_sock);
+        m_sock = -1;
+        return false;
+    }
+    if (listen(m_sock, 4) != 0) {
+        close(m_sock);
+        m_sock = -1;
+        unlink(path);
+        return false;
+    }
+    m_path = path;
+    m_stopping = false;
+    m_thread = std::thread([this]() { ServerThread(); });
+    return true;
+#endif
+}
+
+void CMetricsServer::Close()
+{
+#ifndef _WIN32
+    if (m_thread.joinable()) {
+        m_stopping = true;
+        m_thread.join();
+    }
+    if (m_sock >= 0) {
+        close(m_sock);
+        m_sock = -1;
+        unlink(m_path.c_str());
+    }
+#endif
+}
+
+void CMetricsServer::ServerThread()
+{
+#ifndef _WIN32
+    // Rates are of the last interval of about 1 second
+    RATE_SAMPLE lastSample = TakeSample();
+    RATE_SAMPLE rate = {};
+    double rateSec = 0;
+    while (!m_stopping) {
+        struct pollfd pfd = {};
+        pfd.fd = m_sock;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, 200);
+        RATE_SAMPLE sample = TakeSample();
+        if (sample.time - lastSample.time >= 1000000000) {
+            rate.packetCount = sample.packetCount - lastSample.packetCount;
+            rate.sectionCount = sample.sectionCount - lastSample.sectionCount;
+            rate.chunkCount = sample.chunkCount - lastSample.chunkCount;
+            rateSec = (sample.time - lastSample.time) / 1e9;
+            lastSample = sample;
+        }
+        if (ret <= 0 || !(pfd.revents & POLLIN)) {
+            continue;
+        }
+        int client = accept(m_sock, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        // Give a short time for an HTTP request
+        char req[512];
+        int reqSize = 0;
+        struct pollfd cfd = {};
+        cfd.fd = client;
+        cfd.events = POLLIN;
+        if (poll(&cfd, 1, 100) > 0) {
+            reqSize = static_cast<int>(recv(client, req, sizeof(req), 0));
+        }
+        std::string body = Format(rate, rateSec);
+        std::string response;
+        if (reqSize >= 4 && memcmp(req, "GET ", 4) == 0) {
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        }
+        response += body;
+        for (size_t pos = 0; pos < response.size();) {
+#ifdef MSG_NOSIGNAL
+            ssize_t n = send(client, response.data() + pos, response.size() - pos, MSG_NOSIGNAL);
+#else
+            ssize_t n = send(client, response.data() + pos, response.size() - pos, 0);
+#endif
+            if (n <= 0) {
+                break;
+            }
+            pos += n;
+        }
+        close(client);
+    }
+#endif
+}
+
+std::string CMetricsServer::Format(const RATE_SAMPLE &rate, double rateSec) const
+{
+    std::string s;
+    AppendMetric(s, "psisiarc_packets_total", "counter", "TS packets read.",
+                 static_cast<double>(m_metrics.packetCount.load(std::memory_order_relaxed)));
+    AppendMetric(s, "psisiarc_packets_per_second", "gauge", "TS packets read per second.",
+                 rateSec > 0 ? rate.packetCount / rateSec : 0);
+    AppendMetric(s, "psisiarc_sections_total", "counter", "Sections added to the archive.",
+                 static_cast<double>(m_metrics.sectionCount.load(std::memory_order_relaxed)));
+    AppendMetric(s, "psisiarc_sections_per_second", "gauge", "Sections added to the archive per second.",
+                 rateSec > 0 ? rate.sectionCount / rateSec : 0);
+    AppendMetric(s, "psisiarc_chunks_total", "counter", "Chunks written.",
+                 static_cast<double>(m_metrics.chunkCount.load(std::memory_order_relaxed)));
+    AppendMetric(s, "psisiarc_chunks_per_second", "gauge", "Chunks written per second.",
+                 rateSec > 0 ? rate.chunkCount / rateSec : 0);
+    AppendMetric(s, "psisiarc_written_bytes_total", "counter", "Bytes of the archive written.",
+                 static_cast<double>(m_metrics.writtenBytes.load(std::memory_order_relaxed)));
+    AppendMetric(s, "psisiarc_continuity_errors_total", "counter", "Continuity counter errors of TS packets.",
+                 static_cast<double>(m_metrics.continuityErrorCount.load(std::memory_order_relaxed)));
+    int64_t lastPcrTime = m_metrics.lastPcrTime.load(std::memory_order_relaxed);
+    AppendMetric(s, "psisiarc_seconds_since_last_pcr", "gauge", "Seconds since the PCR last changed, or -1 if not seen.",
+                 lastPcrTime < 0 ? -1 : (GetSteadyNanoseconds() - lastPcrTime) / 1e9);
+    int64_t dictionaryBuffSize = m_metrics.dictionaryBuffSize.load(std::memory_order_relaxed);
+    int64_t dictionaryMaxBuffSize = m_metrics.dictionaryMaxBuffSize.load(std::memory_order_relaxed);
+    AppendMetric(s, "psisiarc_dictionary_buffer_bytes", "gauge", "Dictionary buffer size of the current chunk.",
+                 static_cast<double>(dictionaryBuffSize));
+    AppendMetric(s, "psisiarc_dictionary_fill_ratio", "gauge", "Dictionary buffer size relative to the limit.",
+                 dictionaryMaxBuffSize > 0 ? static_cast<double>(dictionaryBuffSize) / dictionaryMaxBuffSize : 0);
+    return s;
+}
+
+CMetricsServer::RATE_SAMPLE CMetricsServer::TakeSample() const
+{
+    RATE_SAMPLE sample;
+    sample.time = GetSteadyNanoseconds();
+    sample.packetCount = m_metrics.packetCount.load(std::memory_order_relaxed);
+    sample.sectionCount = m_metrics.sectionCount.load(std::memory_order_relaxed);
+    sample.chunkCount = m_metrics.chunkCount.load(std::memory_order_relaxed);
+    return sample;
+}
@@ -0,0 +1,54 @@
+#ifndef INCLUDE_METRICSSERVER_HPP
+#define INCLUDE_METRICSSERVER_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Serves counters in the Prometheus text format on a Unix domain socket from a separate thread.
+// Each connection gets one response and is closed. Clients sending "GET" get it as an HTTP response.
+class CMetricsServer
+{
+public:
+    // Updated by the caller with relaxed stores
+    struct METRICS
+    {
+        std::atomic<int64_t> packetCount;
+        std::atomic<int64_t> sectionCount;
+        std::atomic<int64_t> chunkCount;
+        std::atomic<int64_t> writtenBytes;
+        std::atomic<int64_t> continuityErrorCount;
+        // In steady_clock nanoseconds, or -1 if no PCR has been seen
+        std::atomic<int64_t> lastPcrTime;
+        std::atomic<int64_t> dictionaryBuffSize;
+        std::atomic<int64_t> dictionaryMaxBuffSize;
+    };
+    CMetricsServer();
+    ~CMetricsServer();
+    // Not supported on Windows
+    bool Open(const char *path);
+    void Close();
+    bool IsOpen() const { return m_sock >= 0; }
+    METRICS &GetMetrics() { return m_metrics; }
+
+private:
+    struct RATE_SAMPLE
+    {
+        int64_t time;
+        int64_t packetCount;
+        int64_t sectionCount;
+        int64_t chunkCount;
+    };
+    void ServerThread();
+    std::string Format(const RATE_SAMPLE &rate, double rateSec) const;
+    RATE_SAMPLE TakeSample() const;
+
+    int m_sock;
+    std::string m_path;
+    std::thread m_thread;
+    std::atomic<bool> m_stopping;
+    METRICS m_metrics;
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "parallelarchiver.hpp"
+#include "fileutil.hpp"
+#include "util.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+// Reads the file like the main loop from the buffer beginning at bufPos until the next buffer would begin at or after endPos.
+// Reads to the end if endPos < 0. On return bufPos is the beginning of the next buffer, or -1 at the end of the file.
+bool ExtractFileRange(FILE *fp, int64_t &bufPos, int64_t endPos, int &unitSize, CPsiExtractor &psiExtractor, std::vector<uint8_t> &buf,
+                      const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract)
+{
+    if (!SeekFile(fp, bufPos)) {
+        return false;
+    }
+    int bufCount = 0;
+    for (;;) {
+        int n = static_cast<int>(fread(buf.data() + bufCount, 1, buf.size() - bufCount, fp));
+        bufCount += n;
+        if (bufCount == static_cast<int>(buf.size()) || n == 0) {
+            int bufOffset = 0;
+            for (; find_ts_packet(buf.data(), bufCount, &bufOffset, &unitSize, n == 0, nullptr); bufOffset += unitSize) {
+                psiExtractor.AddPacket(buf.data() + bufOffset, onExtract);
+            }
+            if (n == 0) {
+                bufPos = -1;
+                return !ferror(fp);
+            }
+            std::copy(buf.begin() + bufOffset, buf.begin() + bufCount, buf.begin());
+            bufPos += bufOffset;
+            bufCount -= bufOffset;
+            if (endPos >= 0 && bufPos >= endPos) {
+                return true;
+            }
+        }
+    }
+}
+
+struct EXTRACTED_SECTION
+{
+    int pid;
+    bool createdTable;
+    int64_t pcr;
+    size_t dataPos;
+    size_t size;
+};
+
+// A range of the file whose sections are extracted by a worker
+struct PARALLEL_RANGE
+{
+    // Where the worker starts to read without knowing the state before
+    int64_t warmUpBufPos;
+    int warmUpUnitSize;
+    int64_t beginPos;
+    int64_t endPos;
+    bool done;
+    bool failed;
+    // States of the reader and the extractor at the first buffers beginning at or after beginPos and endPos
+    int64_t beginBufPos;
+    int beginUnitSize;
+    CPsiExtractor beginExtractor;
+    int64_t endBufPos;
+    int endUnitSize;
+    CPsiExtractor endExtractor;
+    std::vector<EXTRACTED_SECTION> sections;
+    std::vector<uint8_t> sectionData;
+};
+
+#ifdef _WIN32
+void ExtractParallelRange(const wchar_t *srcName, const CPsiExtractor &initialExtractor, PARALLEL_RANGE &range)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> srcFile(_wfopen(srcName, L"rbS"), fclose);
+#else
+void ExtractParallelRange(const char *srcName, const CPsiExtractor &initialExtractor, PARALLEL_RANGE &range)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> srcFile(fopen(srcName, "r"), fclose);
+#endif
+    range.failed = !srcFile;
+    if (range.failed) {
+        return;
+    }
+    CPsiExtractor psiExtractor = initialExtractor;
+    std::vector<uint8_t> buf(65536);
+    int64_t bufPos = range.warmUpBufPos;
+    int unitSize = range.warmUpUnitSize;
+    if (bufPos < range.beginPos) {
+        // Sections before the range are discarded
+        range.failed = !ExtractFileRange(srcFile.get(), bufPos, range.beginPos, unitSize, psiExtractor, buf,
+                                         [](int, int64_t, size_t, const uint8_t *) {});
+    }
+    range.beginBufPos = bufPos;
+    range.beginUnitSize = unitSize;
+    range.beginExtractor = psiExtractor;
+    if (!range.failed && bufPos >= 0) {
+        range.failed = !ExtractFileRange(srcFile.get(), bufPos, range.endPos, unitSize, psiExtractor, buf,
+                                         [&range, &psiExtractor](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+            EXTRACTED_SECTION section = {pid, psiExtractor.IsExtractingCreatedTable(), pcr, range.sectionData.size(), psiSize};
+            range.sections.push_back(section);
+            range.sectionData.insert(range.sectionData.end(), psi, psi + psiSize);
+        });
+    }
+    range.endBufPos = bufPos;
+    range.endUnitSize = unitSize;
+    range.endExtractor = psiExtractor;
+}
+
+// Adds a section from a worker to the archive, renumbering the created PAT or PMT to continue from the previous range
+bool AddExtractedSection(CPsiArchiver &psiArchiver, CUT_CONTEXT &cutContext, int pid, bool createdTable, int64_t pcr, size_t psiSize,
+                         const uint8_t *psi, int patVersionDiff, int pmtVersionDiff)
+{
+    int diff = pid == 0 ? patVersionDiff : pmtVersionDiff;
+    if (createdTable && diff != 0) {
+        uint8_t table[1024];
+        std::copy(psi, psi + std::min<size_t>(psiSize, sizeof(table)), table);
+        CPsiExtractor::ShiftCreatedTableVersion(table, std::min<size_t>(psiSize, sizeof(table)), diff);
+        return AddSection(psiArchiver, cutContext, pid, pcr, psiSize, table);
+    }
+    return AddSection(psiArchiver, cutContext, pid, pcr, psiSize, psi);
+}
+}
+
+#ifdef _WIN32
+bool ArchiveFileInParallel(const wchar_t *srcName, FILE *fpSrc, int workerCount, const CPsiExtractor &psiExtractor, CPsiArchiver &psiArchiver,
+                           CUT_CONTEXT &cutContext)
+#else
+bool ArchiveFileInParallel(const char *srcName, FILE *fpSrc, int workerCount, const CPsiExtractor &psiExtractor, CPsiArchiver &psiArchiver,
+                           CUT_CONTEXT &cutContext)
+#endif
+{
+    static const int64_t WARM_UP_SIZE = 16 * 1024 * 1024;
+    static const int64_t MIN_RANGE_SIZE = 64 * 1024 * 1024;
+    static const int64_t MAX_RANGE_SIZE = 512 * 1024 * 1024;
+
+    // Pre-scan the first buffer to predict where the main loop begins each buffer
+    std::vector<uint8_t> buf(65536);
+    int unitSize = 0;
+    int64_t fileSize = GetFileSize(fpSrc);
+    if (fileSize < 0 || !SeekFile(fpSrc, 0)) {
+        fprintf(stderr, "Error: cannot seek file.\n");
+        return false;
+    }
+    int firstCount = static_cast<int>(fread(buf.data(), 1, buf.size(), fpSrc));
+    int firstOffset = 0;
+    find_ts_packet(buf.data(), firstCount, &firstOffset, &unitSize, firstCount < static_cast<int>(buf.size()), nullptr);
+    int64_t rangeSize = std::min(std::max(fileSize / (workerCount * 4), MIN_RANGE_SIZE), MAX_RANGE_SIZE);
+    size_t rangeCount = firstCount == static_cast<int>(buf.size()) && unitSize != 0 ? static_cast<size_t>(std::max<int64_t>(fileSize / rangeSize, 1)) : 1;
+    // If the packets are aligned, the second buffer begins at secondBufPos and later buffers advance by bufStep
+    int64_t secondBufPos = firstOffset + (firstCount - firstOffset) / std::max(unitSize, 1) * unitSize;
+    int64_t bufStep = static_cast<int64_t>(buf.size()) / std::max(unitSize, 1) * unitSize;
+
+    std::vector<std::unique_ptr<PARALLEL_RANGE>> ranges;
+    for (size_t i = 0; i < rangeCount; ++i) {
+        ranges.emplace_back(new PARALLEL_RANGE);
+        PARALLEL_RANGE &range = *ranges.back();
+        range.beginPos = static_cast<int64_t>(i) * rangeSize;
+        range.endPos = i + 1 < rangeCount ? range.beginPos + rangeSize : -1;
+        range.done = false;
+        range.failed = false;
+        int64_t warmUpPos = range.beginPos - WARM_UP_SIZE;
+        if (i == 0 || warmUpPos < secondBufPos) {
+            // From the beginning as the main loop does
+            range.warmUpBufPos = 0;
+            range.warmUpUnitSize = 0;
+        }
+        else {
+            range.warmUpBufPos = secondBufPos + (warmUpPos - secondBufPos) / bufStep * bufStep;
+            range.warmUpUnitSize = unitSize;
+        }
+    }
+
+    std::mutex rangeMutex;
+    std::condition_variable rangeCond;
+    size_t nextRange = 0;
+    size_t addedRangeCount = 0;
+    bool aborted = false;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::min(workerCount, static_cast<int>(rangeCount)); ++i) {
+        workers.emplace_back([&]() {
+            std::unique_lock<std::mutex> lock(rangeMutex);
+            for (;;) {
+                // Do not get too far ahead of the archiver, so that sections do not pile up
+                rangeCond.wait(lock, [&]() { return aborted || nextRange >= rangeCount || nextRange < addedRangeCount + workerCount * 2; });
+                if (aborted || nextRange >= rangeCount) {
+                    break;
+                }
+                PARALLEL_RANGE &range = *ranges[nextRange++];
+                lock.unlock();
+                ExtractParallelRange(srcName, psiExtractor, range);
+                lock.lock();
+                range.done = true;
+                rangeCond.notify_all();
+            }
+        });
+    }
+
+    // State at the end of the previous range. Version numbers of the created tables differ by these from the actual ones.
+    CPsiExtractor lastExtractor = psiExtractor;
+    int64_t bufPos = 0;
+    unitSize = 0;
+    int patVersionDiff = 0;
+    int pmtVersionDiff = 0;
+    bool ret = true;
+    for (size_t i = 0; ret && i < rangeCount && bufPos >= 0; ++i) {
+        PARALLEL_RANGE &range = *ranges[i];
+        {
+            std::unique_lock<std::mutex> lock(rangeMutex);
+            rangeCond.wait(lock, [&range]() { return range.done; });
+        }
+        if (range.failed) {
+            fprintf(stderr, "Error: cannot read file.\n");
+            ret = false;
+            break;
+        }
+        int patDiff;
+        int pmtDiff;
+        if (range.beginBufPos == bufPos && range.beginUnitSize == unitSize &&
+            lastExtractor.CompareState(range.beginExtractor, patDiff, pmtDiff)) {
+            patVersionDiff = (patVersionDiff + patDiff) & 0x1f;
+            pmtVersionDiff = (pmtVersionDiff + pmtDiff) & 0x1f;
+            for (auto it = range.sections.cbegin(); ret && it != range.sections.end(); ++it) {
+                ret = AddExtractedSection(psiArchiver, cutContext, it->pid, it->createdTable, it->pcr, it->size,
+                                          range.sectionData.data() + it->dataPos, patVersionDiff, pmtVersionDiff);
+            }
+            lastExtractor = range.endExtractor;
+            bufPos = range.endBufPos;
+            unitSize = range.endUnitSize;
+        }
+        else {
+            // The worker did not catch up, so extract the range again
+            if (!ExtractFileRange(fpSrc, bufPos, range.endPos, unitSize, lastExtractor, buf,
+                                  [&](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+                    ret = AddExtractedSection(psiArchiver, cutContext, pid, lastExtractor.IsExtractingCreatedTable(), pcr, psiSize, psi,
+                                              patVersionDiff, pmtVersionDiff) && ret;
+                })) {
+                fprintf(stderr, "Error: cannot read file.\n");
+                ret = false;
+            }
+        }
+        ranges[i].reset();
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        ++addedRangeCount;
+        rangeCond.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        aborted = true;
+        rangeCond.notify_all();
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+    return ret;
+}
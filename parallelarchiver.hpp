@@ -0,0 +1,20 @@
+#ifndef INCLUDE_PARALLELARCHIVER_HPP
+#define INCLUDE_PARALLELARCHIVER_HPP
+
+#include <stdio.h>
+#include "archivecontext.hpp"
+#include "psiarchiver.hpp"
+#include "psiextractor.hpp"
+
+// Extracts sections of ranges of the file on worker threads and adds them to the archive in order.
+// A worker starts a little before its range, so its state usually catches up with the end of the previous range.
+// Otherwise the range is extracted again from that state. The archive is the same as the one made by the main loop.
+#ifdef _WIN32
+bool ArchiveFileInParallel(const wchar_t *srcName, FILE *fpSrc, int workerCount, const CPsiExtractor &psiExtractor, CPsiArchiver &psiArchiver,
+                           CUT_CONTEXT &cutContext);
+#else
+bool ArchiveFileInParallel(const char *srcName, FILE *fpSrc, int workerCount, const CPsiExtractor &psiExtractor, CPsiArchiver &psiArchiver,
+                           CUT_CONTEXT &cutContext);
+#endif
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef INCLUDE_PROBE_HPP
+#define INCLUDE_PROBE_HPP
+
+// Static probes for tracers, like "bpftrace -e 'usdt:./psisiarc:psisiarc:flush_end { ... }'".
+// Enabled by "make USDT=1" with <sys/sdt.h>. Otherwise they are compiled out.
+// An enabled probe is a single nop until a tracer attaches to it.
+#ifdef PSISIARC_USDT
+#include <sys/sdt.h>
+#define PSISIARC_PROBE1(name, a1) DTRACE_PROBE1(psisiarc, name, a1)
+#define PSISIARC_PROBE2(name, a1, a2) DTRACE_PROBE2(psisiarc, name, a1, a2)
+#define PSISIARC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(psisiarc, name, a1, a2, a3)
+#else
+#define PSISIARC_PROBE1(name, a1) ((void)0)
+#define PSISIARC_PROBE2(name, a1, a2) ((void)0)
+#define PSISIARC_PROBE3(name, a1, a2, a3) ((void)0)
+#endif
+
+#endif
@@ -1,17 +1,28 @@
 #include "psiarchiver.hpp"
+#include "probe.hpp"
 #include <algorithm>
+#include <chrono>
 
 CPsiArchiver::CPsiArchiver()
     : m_dictionaryDataSize(0)
     , m_dictionaryBuffSize(0)
     , m_dictionaryMaxBuffSize(16 * 1024 * 1024)
+    , m_externalTokenMinSize(0)
     , m_currentTime(UNKNOWN_TIME)
     , m_currentRelTime(0)
     , m_sameTimeCodeCount(0)
+    , m_chunkFirstTime(UNKNOWN_TIME)
+    , m_chunkLastTime(UNKNOWN_TIME)
     , m_lastWriteTime(UNKNOWN_TIME)
     , m_writeInterval(UNKNOWN_TIME)
     , m_trailerSize(0)
+    , m_writtenSize(0)
     , m_fp(nullptr)
+    , m_statsEnabled(false)
+    , m_stats()
+    , m_flushReason(FLUSH_REQUESTED)
+    , m_sectionTracker(nullptr)
+    , m_flushHistogram(nullptr)
 {
 }
 
@@ -25,38 +36,37 @@ void CPsiArchiver::SetDictionaryMaxBuffSize(size_t size)
     m_dictionaryMaxBuffSize = std::min<size_t>(std::max<size_t>(size, 8 * 1024), 1024 * 1024 * 1024);
 }
 
+void CPsiArchiver::SetExternalTokenCallback(size_t minSize, const std::function<bool (const uint8_t *, const uint8_t *, size_t)> &externalTokenCallback)
+{
+    m_externalTokenMinSize = externalTokenCallback ? std::max(minSize, EXTERNAL_TOKEN_SIZE + 1) : 0;
+    m_externalTokenCallback = externalTokenCallback;
+}
+
 bool CPsiArchiver::Add(int pid, int64_t pcr, size_t psiSize, const uint8_t *psi)
 {
     if (psiSize == 0) {
         return true;
     }
+    PSISIARC_PROBE2(add, pid, psiSize);
     if (m_lastWriteTime == UNKNOWN_TIME) {
         m_lastWriteTime = m_currentTime;
     }
     uint32_t elapsedTime = (0x40000000 + m_currentTime - m_lastWriteTime) & 0x3fffffff;
     bool ret = true;
-    if (m_timeList.size() / 4 >= 65536 - 4 ||
-        m_dict.size() >= 65536 - CODE_NUMBER_BEGIN ||
-        m_dictionaryBuffSize + 2 + 4096 > m_dictionaryMaxBuffSize ||
-        (m_currentTime != UNKNOWN_TIME && elapsedTime >= m_writeInterval))
-    {
-        uint32_t currentTime = m_currentTime;
-        ret = Flush(true);
-        if (m_lastWriteTime == UNKNOWN_TIME) {
-            m_lastWriteTime = currentTime;
-            // Keep intervals as exact as possible
-            if (currentTime != UNKNOWN_TIME && elapsedTime >= m_writeInterval && elapsedTime < m_writeInterval + 11250) {
-                m_lastWriteTime = (0x40000000 + currentTime - (elapsedTime - m_writeInterval)) & 0x3fffffff;
-            }
-        }
+    FLUSH_REASON reason = m_timeList.size() / 4 >= 65536 - 4 ? FLUSH_TIME_LIST_FULL :
+                          m_dict.size() >= 65536 - CODE_NUMBER_BEGIN ? FLUSH_DICTIONARY_FULL :
+                          m_dictionaryBuffSize + 2 + 4096 > m_dictionaryMaxBuffSize ? FLUSH_BUFFER_LIMIT :
+                          m_currentTime != UNKNOWN_TIME && elapsedTime >= m_writeInterval ? FLUSH_INTERVAL : FLUSH_REQUESTED;
+    if (reason != FLUSH_REQUESTED) {
+        ret = FlushAndSetLastWriteTime(m_currentTime, elapsedTime, reason);
+    }
+    ++m_stats.sectionCount;
+    if (m_sectionTracker) {
+        m_sectionTracker->AddSection();
     }
     AddToTimeList(pcr < 0 ? UNKNOWN_TIME : static_cast<uint32_t>(pcr >> 3));
 
-    uint32_t hash = pid;
-    if (psiSize >= 4) {
-        hash ^= psi[psiSize - 4] | (psi[psiSize - 3] << 8) | (psi[psiSize - 2] << 16) |
-                (static_cast<uint32_t>(psi[psiSize - 1]) << 24);
-    }
+    uint32_t hash = GetTokenHash(pid, psi, psiSize);
     auto eqRange = m_dictHashMap.equal_range(hash);
     for (; eqRange.first != eqRange.second; ++eqRange.first) {
         if (m_dict[eqRange.first->second].token.size() == psiSize &&
@@ -83,36 +93,82 @@ bool CPsiArchiver::Add(int pid, int64_t pcr, size_t psiSize, const uint8_t *psi)
         if (eqRange.first == eqRange.second) {
             item.codeOrSize = static_cast<uint16_t>(psiSize - 1);
             item.token.assign(psi, psi + psiSize);
-            m_dictionaryDataSize += 2 + item.token.size();
+            // The buffer size still counts the whole token, which the decoder needs
+            m_dictionaryDataSize += 2 + (IsExternalToken(psiSize) ? static_cast<size_t>(EXTERNAL_TOKEN_SIZE) : psiSize);
+            ++m_stats.newTokenCount;
+            m_stats.newTokenBytes += psiSize;
+            if (IsExternalToken(psiSize)) {
+                ++m_stats.externalTokenCount;
+                m_stats.externalTokenBytes += psiSize;
+            }
+            if (m_statsEnabled) {
+                CountResentToken(pid, psi, psiSize);
+            }
         }
         else {
             item.codeOrSize = CODE_NUMBER_BEGIN + eqRange.first->second;
             item.token.swap(m_lastDict[eqRange.first->second].token);
+            ++m_stats.carriedOverCount;
         }
         item.pid = static_cast<uint16_t>(pid);
         m_dictionaryBuffSize += 2 + item.token.size();
     }
     else {
         dictIndex = eqRange.first->second;
+        ++m_stats.hitCount;
     }
     m_codeList.push_back(static_cast<uint8_t>(CODE_NUMBER_BEGIN + dictIndex));
     m_codeList.push_back(static_cast<uint8_t>((CODE_NUMBER_BEGIN + dictIndex) >> 8));
     return ret;
 }
 
+bool CPsiArchiver::CheckWriteInterval(int64_t pcr)
+{
+    // Sections may be left unwritten longer than the interval if no more sections arrive
+    if (pcr < 0 || m_codeList.empty() || m_lastWriteTime == UNKNOWN_TIME) {
+        return true;
+    }
+    uint32_t currentTime = static_cast<uint32_t>(pcr >> 3);
+    uint32_t elapsedTime = (0x40000000 + currentTime - m_lastWriteTime) & 0x3fffffff;
+    if (elapsedTime < m_writeInterval || elapsedTime >= 0x20000000) {
+        // Not elapsed or the clock went back
+        return true;
+    }
+    return FlushAndSetLastWriteTime(currentTime, elapsedTime, FLUSH_INTERVAL);
+}
+
+bool CPsiArchiver::FlushAndSetLastWriteTime(uint32_t currentTime, uint32_t elapsedTime, FLUSH_REASON reason)
+{
+    m_flushReason = reason;
+    bool ret = Flush(true);
+    if (m_lastWriteTime == UNKNOWN_TIME) {
+        m_lastWriteTime = currentTime;
+        // Keep intervals as exact as possible
+        if (currentTime != UNKNOWN_TIME && elapsedTime >= m_writeInterval &&
+            elapsedTime < m_writeInterval + std::min<uint32_t>(m_writeInterval, 11250)) {
+            m_lastWriteTime = (0x40000000 + currentTime - (elapsedTime - m_writeInterval)) & 0x3fffffff;
+        }
+    }
+    return ret;
+}
+
 bool CPsiArchiver::Flush(bool suppressTrailer)
 {
     bool ret = true;
     uint8_t trailer[] = {0x3d, 0x3d, 0x3d, 0x3d};
     if (m_codeList.empty()) {
-        if (!suppressTrailer && m_fp && m_trailerSize > 0) {
+        if (!suppressTrailer && (m_fp || m_writeCallback) && m_trailerSize > 0) {
             // Write a pending trailer
-            ret = ret && WriteBuffer(trailer, m_trailerSize, m_fp);
+            WriteBuffer(trailer, m_trailerSize);
             m_trailerSize = 0;
-            ret = ret && fflush(m_fp) == 0;
+            ret = WriteOut();
         }
+        m_flushReason = FLUSH_REQUESTED;
         return ret;
     }
+    PSISIARC_PROBE2(flush_start, m_flushReason, m_codeList.size() / 2);
+    bool timed = m_statsEnabled || m_flushHistogram;
+    auto flushStartTime = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
     if (m_sameTimeCodeCount > 0) {
         m_timeList.push_back(static_cast<uint8_t>(m_currentRelTime));
         m_timeList.push_back(static_cast<uint8_t>(m_currentRelTime >> 8));
@@ -121,6 +177,7 @@ bool CPsiArchiver::Flush(bool suppressTrailer)
     }
 
     size_t dictionaryWindowSize = m_dict.size();
+    bool endSegment = false;
     if (m_writeInterval != UNKNOWN_TIME) {
         // Leave unused items in back of the dictionary
         for (auto it = m_lastDict.cbegin(); it != m_lastDict.end(); ++it) {
@@ -137,16 +194,34 @@ bool CPsiArchiver::Flush(bool suppressTrailer)
         }
     }
 
-    if (m_fp) {
+    // Tokens are stored before the chunk referring to them
+    std::vector<uint8_t> externalRefs;
+    for (auto it = m_dict.cbegin(); it != m_dict.end() && ret; ++it) {
+        if (it->codeOrSize < CODE_NUMBER_BEGIN && IsExternalToken(it->token.size())) {
+            externalRefs.resize(externalRefs.size() + EXTERNAL_TOKEN_SIZE);
+            uint8_t *ref = externalRefs.data() + externalRefs.size() - EXTERNAL_TOKEN_SIZE;
+            ref[0] = 0xff;
+            ref[1] = 0;
+            ref[2] = static_cast<uint8_t>(EXTERNAL_TOKEN_SIZE - 3);
+            ref[3] = static_cast<uint8_t>(it->token.size() >> 8);
+            ref[4] = static_cast<uint8_t>(it->token.size());
+            calc_sha256(it->token.data(), it->token.size(), ref + 5);
+            ret = m_externalTokenCallback(ref + 5, it->token.data(), it->token.size());
+        }
+    }
+
+    if (ret && (m_fp || m_writeCallback)) {
         if (m_trailerSize > 0) {
             // Write a pending trailer
-            ret = ret && WriteBuffer(trailer, m_trailerSize, m_fp);
+            WriteBuffer(trailer, m_trailerSize);
         }
+        size_t chunkPos = m_writeBuf.size();
         uint8_t header[32] = {
             // Magic number
             0x50, 0x73, 0x73, 0x63, 0x0d, 0x0a, 0x9a, 0x0a,
+            static_cast<uint8_t>(externalRefs.empty() ? 0 : EXTERNAL_TOKEN_FLAG),
             // Reserved
-            0, 0,
+            0,
             static_cast<uint8_t>(m_timeList.size() / 4),
             static_cast<uint8_t>((m_timeList.size() / 4) >> 8),
             static_cast<uint8_t>(m_dict.size()),
@@ -168,14 +243,16 @@ bool CPsiArchiver::Flush(bool suppressTrailer)
             // Reserved
             0, 0, 0, 0
         };
-        ret = ret && WriteBuffer(header, 32, m_fp);
-        ret = ret && WriteBuffer(m_timeList.data(), m_timeList.size(), m_fp);
+        WriteBuffer(header, 32);
+        WriteBuffer(m_timeList.data(), m_timeList.size());
         for (auto it = m_dict.cbegin(); it != m_dict.end(); ++it) {
+            uint16_t codeOrSize = it->codeOrSize < CODE_NUMBER_BEGIN && IsExternalToken(it->token.size()) ?
+                                      static_cast<uint16_t>(EXTERNAL_TOKEN_SIZE - 1) : it->codeOrSize;
             uint8_t buf[] = {
-                static_cast<uint8_t>(it->codeOrSize),
-                static_cast<uint8_t>(it->codeOrSize >> 8)
+                static_cast<uint8_t>(codeOrSize),
+                static_cast<uint8_t>(codeOrSize >> 8)
             };
-            ret = ret && WriteBuffer(buf, 2, m_fp);
+            WriteBuffer(buf, 2);
         }
         for (auto it = m_dict.cbegin(); it != m_dict.end(); ++it) {
             if (it->codeOrSize < CODE_NUMBER_BEGIN) {
@@ -183,38 +260,49 @@ bool CPsiArchiver::Flush(bool suppressTrailer)
                     static_cast<uint8_t>(it->pid),
                     static_cast<uint8_t>(it->pid >> 8 | 0xe0)
                 };
-                ret = ret && WriteBuffer(buf, 2, m_fp);
+                WriteBuffer(buf, 2);
             }
         }
+        const uint8_t *ref = externalRefs.data();
         for (auto it = m_dict.cbegin(); it != m_dict.end(); ++it) {
             if (it->codeOrSize < CODE_NUMBER_BEGIN) {
-                ret = ret && WriteBuffer(it->token.data(), it->token.size(), m_fp);
+                if (IsExternalToken(it->token.size())) {
+                    WriteBuffer(ref, EXTERNAL_TOKEN_SIZE);
+                    ref += EXTERNAL_TOKEN_SIZE;
+                }
+                else {
+                    WriteBuffer(it->token.data(), it->token.size());
+                }
             }
         }
         if (m_dictionaryDataSize % 2) {
             uint8_t alignment = 0xff;
-            ret = ret && WriteBuffer(&alignment, 1, m_fp);
+            WriteBuffer(&alignment, 1);
         }
-        ret = ret && WriteBuffer(m_codeList.data(), m_codeList.size(), m_fp);
+        WriteBuffer(m_codeList.data(), m_codeList.size());
 
         m_trailerSize = (m_dict.size() + (m_dictionaryDataSize + 1) / 2 + m_codeList.size() / 2) % 2 ? 2 : 4;
-        if (!suppressTrailer) {
-            ret = ret && WriteBuffer(trailer, m_trailerSize, m_fp);
+        WriteBuffer(trailer, m_trailerSize);
+        if (m_chunkCallback) {
+            bool independent = std::none_of(m_dict.begin(), m_dict.end(),
+                                            [](const DICTIONARY_ITEM &item) { return item.codeOrSize >= CODE_NUMBER_BEGIN; });
+            endSegment = m_chunkCallback(m_writeBuf.data() + chunkPos, m_writeBuf.size() - chunkPos, m_chunkFirstTime, m_chunkLastTime, independent);
+        }
+        if (suppressTrailer && !endSegment) {
+            // Write it later
+            m_writeBuf.resize(m_writeBuf.size() - m_trailerSize);
+        }
+        else {
             m_trailerSize = 0;
         }
-        ret = ret && fflush(m_fp) == 0;
+        ret = WriteOut();
     }
 
     // Leave unused items in back of the dictionary
-    for (auto it = m_lastDict.begin(); m_dict.size() < dictionaryWindowSize; ++it) {
+    for (auto it = m_lastDict.begin(); !endSegment && m_dict.size() < dictionaryWindowSize; ++it) {
         if (!it->token.empty()) {
             uint16_t dictIndex = static_cast<uint16_t>(m_dict.size());
-            uint32_t hash = it->pid;
-            if (it->token.size() >= 4) {
-                hash ^= it->token[it->token.size() - 4] | (it->token[it->token.size() - 3] << 8) |
-                        (it->token[it->token.size() - 2] << 16) |
-                        (static_cast<uint32_t>(it->token[it->token.size() - 1]) << 24);
-            }
+            uint32_t hash = GetTokenHash(it->pid, it->token.data(), it->token.size());
             m_dictHashMap.emplace(hash, dictIndex);
             m_dict.emplace_back();
             auto &item = m_dict.back();
@@ -223,21 +311,169 @@ bool CPsiArchiver::Flush(bool suppressTrailer)
         }
     }
 
+    ++m_stats.chunkCount;
+    ++m_stats.flushCount[m_flushReason];
+    m_flushReason = FLUSH_REQUESTED;
+    m_stats.peakDictionaryBuffSize = std::max(m_stats.peakDictionaryBuffSize, m_dictionaryBuffSize);
+    if (timed) {
+        auto flushTime = std::chrono::steady_clock::now() - flushStartTime;
+        m_stats.flushSec += std::chrono::duration<double>(flushTime).count();
+        if (m_flushHistogram) {
+            m_flushHistogram->Record(flushTime);
+        }
+    }
+    PSISIARC_PROBE1(flush_end, ret);
+
     m_timeList.clear();
     m_dict.swap(m_lastDict);
     m_dictHashMap.swap(m_lastDictHashMap);
     m_dict.clear();
     m_dictHashMap.clear();
+    if (endSegment) {
+        // The next chunk begins a new segment and refers to nothing before
+        m_lastDict.clear();
+        m_lastDictHashMap.clear();
+    }
     m_codeList.clear();
     m_dictionaryDataSize = 0;
     m_dictionaryBuffSize = 0;
     m_currentTime = UNKNOWN_TIME;
     m_currentRelTime = 0;
     m_sameTimeCodeCount = 0;
+    m_chunkFirstTime = UNKNOWN_TIME;
+    m_chunkLastTime = UNKNOWN_TIME;
     m_lastWriteTime = UNKNOWN_TIME;
     return ret;
 }
 
+bool CPsiArchiver::WriteOut()
+{
+    bool ret;
+    if (m_sectionTracker) {
+        m_sectionTracker->HandOver(m_writeBuf.size());
+    }
+    if (m_writeCallback) {
+        // The callback reports to the tracker by itself
+        ret = m_writeCallback(m_writeBuf.data(), m_writeBuf.size());
+    }
+    else {
+        ret = fwrite(m_writeBuf.data(), 1, m_writeBuf.size(), m_fp) == m_writeBuf.size() && fflush(m_fp) == 0;
+        if (ret && m_sectionTracker) {
+            m_sectionTracker->Written(m_writeBuf.size());
+        }
+    }
+    PSISIARC_PROBE2(write_out, m_writeBuf.size(), ret);
+    if (ret) {
+        m_writtenSize += m_writeBuf.size();
+    }
+    m_writeBuf.clear();
+    return ret;
+}
+
+void CPsiArchiver::CountResentToken(int pid, const uint8_t *token, size_t tokenSize)
+{
+    uint8_t key[34];
+    key[0] = static_cast<uint8_t>(pid);
+    key[1] = static_cast<uint8_t>(pid >> 8);
+    calc_sha256(token, tokenSize, key + 2);
+    std::string keyString(reinterpret_cast<const char *>(key), sizeof(key));
+    bool resent = m_oldWrittenTokenKeys.count(keyString) != 0;
+    if (!m_writtenTokenKeys.insert(keyString).second || resent) {
+        ++m_stats.resentTokenCount;
+    }
+    if (m_writtenTokenKeys.size() >= WRITTEN_TOKEN_KEYS_LIMIT) {
+        m_oldWrittenTokenKeys.clear();
+        m_oldWrittenTokenKeys.swap(m_writtenTokenKeys);
+    }
+}
+
+uint32_t CPsiArchiver::GetTokenHash(int pid, const uint8_t *token, size_t tokenSize)
+{
+    uint32_t hash = pid;
+    if (tokenSize >= 4) {
+        hash ^= token[tokenSize - 4] | (token[tokenSize - 3] << 8) | (token[tokenSize - 2] << 16) |
+                (static_cast<uint32_t>(token[tokenSize - 1]) << 24);
+    }
+    return hash;
+}
+
+void CPsiArchiver::SaveState(std::vector<uint8_t> &state) const
+{
+    // Settings are not saved
+    put_state_data(state, m_timeList.data(), m_timeList.size());
+    SaveDictionary(state, m_dict);
+    SaveDictionary(state, m_lastDict);
+    put_state_data(state, m_codeList.data(), m_codeList.size());
+    put_state_int(state, m_dictionaryDataSize);
+    put_state_int(state, m_dictionaryBuffSize);
+    put_state_int(state, m_currentTime);
+    put_state_int(state, m_currentRelTime);
+    put_state_int(state, m_sameTimeCodeCount);
+    put_state_int(state, m_lastWriteTime);
+    put_state_int(state, m_trailerSize);
+    put_state_int(state, m_writtenSize);
+    put_state_int(state, m_chunkFirstTime);
+    put_state_int(state, m_chunkLastTime);
+}
+
+bool CPsiArchiver::LoadState(STATE_READER &r)
+{
+    size_t size;
+    const uint8_t *data = get_state_data(&r, &size);
+    m_timeList.assign(data, data + size);
+    if (!LoadDictionary(r, m_dict, m_dictHashMap) ||
+        !LoadDictionary(r, m_lastDict, m_lastDictHashMap)) {
+        return false;
+    }
+    data = get_state_data(&r, &size);
+    m_codeList.assign(data, data + size);
+    m_dictionaryDataSize = static_cast<size_t>(get_state_int(&r));
+    m_dictionaryBuffSize = static_cast<size_t>(get_state_int(&r));
+    m_currentTime = static_cast<uint32_t>(get_state_int(&r));
+    m_currentRelTime = static_cast<uint16_t>(get_state_int(&r));
+    m_sameTimeCodeCount = static_cast<uint16_t>(get_state_int(&r));
+    m_lastWriteTime = static_cast<uint32_t>(get_state_int(&r));
+    m_trailerSize = static_cast<size_t>(get_state_int(&r));
+    m_writtenSize = get_state_int(&r);
+    m_chunkFirstTime = static_cast<uint32_t>(get_state_int(&r));
+    m_chunkLastTime = static_cast<uint32_t>(get_state_int(&r));
+    return !r.failed;
+}
+
+void CPsiArchiver::SaveDictionary(std::vector<uint8_t> &state, const std::vector<DICTIONARY_ITEM> &dict)
+{
+    put_state_int(state, dict.size());
+    for (auto it = dict.cbegin(); it != dict.end(); ++it) {
+        put_state_int(state, it->codeOrSize);
+        put_state_int(state, it->pid);
+        put_state_data(state, it->token.data(), it->token.size());
+    }
+}
+
+bool CPsiArchiver::LoadDictionary(STATE_READER &r, std::vector<DICTIONARY_ITEM> &dict, std::unordered_multimap<uint32_t, uint16_t> &hashMap)
+{
+    dict.clear();
+    hashMap.clear();
+    int64_t n = get_state_int(&r);
+    if (n < 0 || n > 65536 - CODE_NUMBER_BEGIN) {
+        return false;
+    }
+    for (int64_t i = 0; i < n && !r.failed; ++i) {
+        dict.emplace_back();
+        auto &item = dict.back();
+        item.codeOrSize = static_cast<uint16_t>(get_state_int(&r));
+        item.pid = static_cast<uint16_t>(get_state_int(&r));
+        size_t size;
+        const uint8_t *data = get_state_data(&r, &size);
+        item.token.assign(data, data + size);
+        // Tokens already moved to the next dictionary are no longer looked up
+        if (!item.token.empty()) {
+            hashMap.emplace(GetTokenHash(item.pid, item.token.data(), item.token.size()), static_cast<uint16_t>(i));
+        }
+    }
+    return !r.failed;
+}
+
 void CPsiArchiver::AddToTimeList(uint32_t pcr11khz)
 {
     bool setAbsoluteTime = m_currentTime == UNKNOWN_TIME ? pcr11khz != UNKNOWN_TIME :
@@ -254,6 +490,12 @@ void CPsiArchiver::AddToTimeList(uint32_t pcr11khz)
     }
     ++m_sameTimeCodeCount;
     m_currentTime = pcr11khz;
+    if (pcr11khz != UNKNOWN_TIME) {
+        if (m_chunkFirstTime == UNKNOWN_TIME) {
+            m_chunkFirstTime = pcr11khz;
+        }
+        m_chunkLastTime = pcr11khz;
+    }
 
     if (setAbsoluteTime) {
         m_timeList.push_back(static_cast<uint8_t>(m_currentTime));
@@ -1,20 +1,79 @@
 #ifndef INCLUDE_PSIARCHIVER_HPP
 #define INCLUDE_PSIARCHIVER_HPP
 
+#include "latencyhistogram.hpp"
+#include "util.hpp"
 #include <stdint.h>
 #include <stdio.h>
+#include <functional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 class CPsiArchiver
 {
 public:
+    enum FLUSH_REASON
+    {
+        // By the caller
+        FLUSH_REQUESTED,
+        FLUSH_TIME_LIST_FULL,
+        FLUSH_DICTIONARY_FULL,
+        FLUSH_BUFFER_LIMIT,
+        FLUSH_INTERVAL,
+        FLUSH_REASON_COUNT
+    };
+    struct STATS
+    {
+        int64_t chunkCount;
+        int64_t flushCount[FLUSH_REASON_COUNT];
+        int64_t sectionCount;
+        // Sections found in the dictionary of the chunk
+        int64_t hitCount;
+        // Sections referring to the dictionary of the previous chunk
+        int64_t carriedOverCount;
+        int64_t newTokenCount;
+        int64_t newTokenBytes;
+        // New tokens which had been written in an earlier chunk, among about the last WRITTEN_TOKEN_KEYS_LIMIT * 2 tokens written
+        int64_t resentTokenCount;
+        // New tokens moved to the external store and their bytes
+        int64_t externalTokenCount;
+        int64_t externalTokenBytes;
+        size_t peakDictionaryBuffSize;
+        // Time spent in Flush()
+        double flushSec;
+    };
+    // A new token not smaller than the threshold of SetExternalTokenCallback() is written in the chunk as a reference of
+    // EXTERNAL_TOKEN_SIZE bytes: 0xff (table_id never used), section_length, the token size (16bit big-endian) and the SHA-256
+    // of the token. Bit0 of the first reserved byte of the header (EXTERNAL_TOKEN_FLAG) is set if the chunk has references.
+    static const size_t EXTERNAL_TOKEN_SIZE = 37;
+    static const uint8_t EXTERNAL_TOKEN_FLAG = 0x01;
     CPsiArchiver();
     void SetFile(FILE *fp) { m_fp = fp; }
+    void SetWriteCallback(const std::function<bool (const uint8_t *, size_t)> &writeCallback) { m_writeCallback = writeCallback; }
+    // Called with each chunk including its trailer, the time range of the chunk, and whether it is decodable by itself.
+    // Returning true ends the output segment with the chunk, so that the next chunk does not refer to it.
+    void SetChunkCallback(const std::function<bool (const uint8_t *, size_t, uint32_t, uint32_t, bool)> &chunkCallback) { m_chunkCallback = chunkCallback; }
     void SetWriteInterval(uint32_t interval);
     void SetDictionaryMaxBuffSize(size_t size);
+    // Called with the SHA-256, the data and size of each token to be referred to, before the chunk is written.
+    // Returning false fails the flush. minSize is at least EXTERNAL_TOKEN_SIZE + 1.
+    void SetExternalTokenCallback(size_t minSize, const std::function<bool (const uint8_t *, const uint8_t *, size_t)> &externalTokenCallback);
     bool Add(int pid, int64_t pcr, size_t psiSize, const uint8_t *psi);
+    bool CheckWriteInterval(int64_t pcr);
     bool Flush(bool suppressTrailer = false);
+    bool IsEmpty() const { return m_codeList.empty(); }
+    int64_t GetWrittenSize() const { return m_writtenSize; }
+    size_t GetDictionaryBuffSize() const { return m_dictionaryBuffSize; }
+    size_t GetDictionaryMaxBuffSize() const { return m_dictionaryMaxBuffSize; }
+    // Counting resent tokens keeps the SHA-256 of recently written tokens
+    void EnableStats() { m_statsEnabled = true; }
+    const STATS &GetStats() const { return m_stats; }
+    // Records the section-to-write latency and the time spent in each flush. Either may be null.
+    void SetLatencyHistograms(CSectionLatencyTracker *sectionTracker, CLatencyHistogram *flushHistogram) { m_sectionTracker = sectionTracker; m_flushHistogram = flushHistogram; }
+    void SaveState(std::vector<uint8_t> &state) const;
+    bool LoadState(STATE_READER &r);
 
 private:
     struct DICTIONARY_ITEM
@@ -23,11 +82,19 @@ private:
         uint16_t pid;
         std::vector<uint8_t> token;
     };
+    static uint32_t GetTokenHash(int pid, const uint8_t *token, size_t tokenSize);
+    void CountResentToken(int pid, const uint8_t *token, size_t tokenSize);
+    bool IsExternalToken(size_t tokenSize) const { return m_externalTokenMinSize != 0 && tokenSize >= m_externalTokenMinSize; }
+    static void SaveDictionary(std::vector<uint8_t> &state, const std::vector<DICTIONARY_ITEM> &dict);
+    static bool LoadDictionary(STATE_READER &r, std::vector<DICTIONARY_ITEM> &dict, std::unordered_multimap<uint32_t, uint16_t> &hashMap);
+    bool FlushAndSetLastWriteTime(uint32_t currentTime, uint32_t elapsedTime, FLUSH_REASON reason);
     void AddToTimeList(uint32_t pcr11khz);
-    static bool WriteBuffer(const uint8_t *buf, size_t size, FILE *fp) { return fwrite(buf, 1, size, fp) == size; }
+    void WriteBuffer(const uint8_t *buf, size_t size) { m_writeBuf.insert(m_writeBuf.end(), buf, buf + size); }
+    bool WriteOut();
 
     static const uint32_t UNKNOWN_TIME = 0xffffffff;
     static const uint16_t CODE_NUMBER_BEGIN = 4096;
+    static const size_t WRITTEN_TOKEN_KEYS_LIMIT = 65536;
     std::vector<uint8_t> m_timeList;
     std::vector<DICTIONARY_ITEM> m_dict, m_lastDict;
     std::unordered_multimap<uint32_t, uint16_t> m_dictHashMap, m_lastDictHashMap;
@@ -35,13 +102,28 @@ private:
     size_t m_dictionaryDataSize;
     size_t m_dictionaryBuffSize;
     size_t m_dictionaryMaxBuffSize;
+    size_t m_externalTokenMinSize;
     uint32_t m_currentTime;
     uint16_t m_currentRelTime;
     uint16_t m_sameTimeCodeCount;
+    uint32_t m_chunkFirstTime;
+    uint32_t m_chunkLastTime;
     uint32_t m_lastWriteTime;
     uint32_t m_writeInterval;
     size_t m_trailerSize;
+    int64_t m_writtenSize;
     FILE *m_fp;
+    std::function<bool (const uint8_t *, size_t)> m_writeCallback;
+    std::function<bool (const uint8_t *, size_t, uint32_t, uint32_t, bool)> m_chunkCallback;
+    std::function<bool (const uint8_t *, const uint8_t *, size_t)> m_externalTokenCallback;
+    std::vector<uint8_t> m_writeBuf;
+    bool m_statsEnabled;
+    STATS m_stats;
+    FLUSH_REASON m_flushReason;
+    // The current and previous generations, which is dropped when the current one is full
+    std::unordered_set<std::string> m_writtenTokenKeys, m_oldWrittenTokenKeys;
+    CSectionLatencyTracker *m_sectionTracker;
+    CLatencyHistogram *m_flushHistogram;
 };
 
 #endif
@@ -0,0 +1,380 @@
+#include "psiarchivereader.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <unordered_map>
+
+namespace
+{
+inline int Read16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+inline uint32_t Read32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); }
+inline void Write16(uint8_t *p, int v) { p[0] = static_cast<uint8_t>(v); p[1] = static_cast<uint8_t>(v >> 8); }
+inline void Write32(uint8_t *p, uint32_t v) { Write16(p, v & 0xffff); Write16(p + 2, v >> 16); }
+
+uint32_t GetTokenHash(int pid, const uint8_t *token, size_t tokenSize)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261 ^ pid;
+    for (size_t i = 0; i < tokenSize; ++i) {
+        hash = (hash ^ token[i]) * 16777619;
+    }
+    return hash;
+}
+
+bool SeekFile(FILE *fp, int64_t pos)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, pos, SEEK_SET) == 0;
+#else
+    return fseeko(fp, pos, SEEK_SET) == 0;
+#endif
+}
+}
+
+bool CPsiArchiveReader::ParseHeader(const uint8_t *header, CHUNK_INFO &info)
+{
+    static const uint8_t MAGIC[8] = {0x50, 0x73, 0x73, 0x63, 0x0d, 0x0a, 0x9a, 0x0a};
+    if (!std::equal(MAGIC, MAGIC + 8, header)) {
+        return false;
+    }
+    info.timeListLength = Read16(header + 10);
+    info.dictionaryLength = Read16(header + 12);
+    info.dictionaryWindowLength = Read16(header + 14);
+    info.dictionaryDataSize = Read32(header + 16);
+    info.dictionaryBuffSize = Read32(header + 20);
+    info.codeListLength = Read32(header + 24);
+    // The trailer makes the chunk a multiple of 4 bytes
+    info.trailerSize = (info.dictionaryLength + (info.dictionaryDataSize + 1) / 2 + info.codeListLength) % 2 ? 2 : 4;
+    info.size = HEADER_SIZE + info.timeListLength * 4 + info.dictionaryLength * 2 +
+                (info.dictionaryDataSize + 1) / 2 * 2 + static_cast<int64_t>(info.codeListLength) * 2 + info.trailerSize;
+    return true;
+}
+
+int64_t CPsiArchiveReader::IndexChunks(FILE *fp, std::vector<CHUNK_INFO> &chunks)
+{
+    chunks.clear();
+#ifdef _WIN32
+    int64_t fileSize = _fseeki64(fp, 0, SEEK_END) == 0 ? _ftelli64(fp) : -1;
+#else
+    int64_t fileSize = fseeko(fp, 0, SEEK_END) == 0 ? static_cast<int64_t>(ftello(fp)) : -1;
+#endif
+    int64_t pos = 0;
+    while (fileSize >= 0 && SeekFile(fp, pos)) {
+        uint8_t header[HEADER_SIZE];
+        CHUNK_INFO info;
+        if (fread(header, 1, HEADER_SIZE, fp) != HEADER_SIZE || !ParseHeader(header, info)) {
+            break;
+        }
+        info.pos = pos;
+        if (pos + info.size - info.trailerSize > fileSize) {
+            // Truncated
+            break;
+        }
+        uint8_t trailer[4] = {};
+        if (pos + info.size > fileSize ||
+            !SeekFile(fp, pos + info.size - info.trailerSize) ||
+            fread(trailer, 1, info.trailerSize, fp) != static_cast<size_t>(info.trailerSize) ||
+            std::count(trailer, trailer + info.trailerSize, 0x3d) != info.trailerSize) {
+            // Not written yet
+            info.size -= info.trailerSize;
+            info.trailerSize = 0;
+        }
+        chunks.push_back(info);
+        pos += info.size;
+    }
+    return pos;
+}
+
+bool CPsiArchiveReader::CheckChunk(const uint8_t *data, const CHUNK_INFO &info, int prevWindowLength, CHUNK_STATS &stats)
+{
+    stats.error.clear();
+    stats.sectionCount = info.codeListLength;
+    stats.newTokenCount = 0;
+    stats.referenceCount = 0;
+    stats.newTokenBytes = 0;
+    stats.externalTokenCount = 0;
+    stats.crcErrorCount = 0;
+    stats.firstTime = UNKNOWN_TIME;
+    stats.lastTime = UNKNOWN_TIME;
+
+    if ((data[8] & ~EXTERNAL_TOKEN_FLAG) != 0 || data[9] != 0 || Read32(data + 28) != 0) {
+        stats.error = "reserved field is not zero";
+        return false;
+    }
+    if (info.dictionaryLength > info.dictionaryWindowLength || info.dictionaryWindowLength > 65536 - CODE_NUMBER_BEGIN) {
+        stats.error = "dictionary window length is invalid";
+        return false;
+    }
+    if (info.dictionaryDataSize > info.dictionaryBuffSize) {
+        stats.error = "dictionary data size exceeds buffer size";
+        return false;
+    }
+
+    // Time list
+    const uint8_t *p = data + HEADER_SIZE;
+    uint32_t currentTime = UNKNOWN_TIME;
+    uint32_t timedCodeCount = 0;
+    for (int i = 0; i < info.timeListLength; ++i, p += 4) {
+        uint32_t v = Read32(p);
+        if (v & 0x80000000) {
+            currentTime = v == 0xffffffff ? UNKNOWN_TIME : v & 0x3fffffff;
+        }
+        else {
+            if (currentTime != UNKNOWN_TIME) {
+                currentTime = (currentTime + (v & 0xffff)) & 0x3fffffff;
+                if (stats.firstTime == UNKNOWN_TIME) {
+                    stats.firstTime = currentTime;
+                }
+                stats.lastTime = currentTime;
+            }
+            timedCodeCount += (v >> 16) + 1;
+        }
+    }
+    if (timedCodeCount != info.codeListLength) {
+        stats.error = "time list does not match code list length";
+        return false;
+    }
+
+    // Dictionary
+    const uint8_t *dict = p;
+    std::vector<uint8_t> referenced(prevWindowLength);
+    for (int i = 0; i < info.dictionaryLength; ++i) {
+        int codeOrSize = Read16(dict + i * 2);
+        if (codeOrSize < CODE_NUMBER_BEGIN) {
+            ++stats.newTokenCount;
+            stats.newTokenBytes += codeOrSize + 1;
+        }
+        else if (codeOrSize - CODE_NUMBER_BEGIN >= prevWindowLength || referenced[codeOrSize - CODE_NUMBER_BEGIN]) {
+            stats.error = "dictionary refers to an item out of the previous window";
+            return false;
+        }
+        else {
+            referenced[codeOrSize - CODE_NUMBER_BEGIN] = 1;
+            ++stats.referenceCount;
+        }
+    }
+    if (info.dictionaryWindowLength - info.dictionaryLength > prevWindowLength - stats.referenceCount) {
+        stats.error = "dictionary window is longer than the items left";
+        return false;
+    }
+    if (stats.newTokenCount * 2 + stats.newTokenBytes != info.dictionaryDataSize) {
+        stats.error = "dictionary data size does not match token sizes";
+        return false;
+    }
+    const uint8_t *pidList = dict + info.dictionaryLength * 2;
+    const uint8_t *token = pidList + stats.newTokenCount * 2;
+    for (int i = 0, j = 0; i < info.dictionaryLength; ++i) {
+        int codeOrSize = Read16(dict + i * 2);
+        if (codeOrSize < CODE_NUMBER_BEGIN) {
+            if ((Read16(pidList + j * 2) & 0xe000) != 0xe000) {
+                stats.error = "PID list is invalid";
+                return false;
+            }
+            ++j;
+            int tokenSize = codeOrSize + 1;
+            if (tokenSize < 3 || 3 + (((token[1] & 0x0f) << 8) | token[2]) != tokenSize) {
+                stats.error = "section length does not match token size";
+                return false;
+            }
+            if (HasExternalTokens(data) && tokenSize == EXTERNAL_TOKEN_SIZE && token[0] == 0xff) {
+                ++stats.externalTokenCount;
+            }
+            // Long form sections and TOT have CRC
+            else if ((tokenSize >= 7 && ((token[1] & 0x80) || token[0] == 0x73)) && calc_crc32(token, tokenSize) != 0) {
+                ++stats.crcErrorCount;
+            }
+            token += tokenSize;
+        }
+    }
+    if (info.dictionaryDataSize % 2 && *token++ != 0xff) {
+        stats.error = "alignment byte is not 0xff";
+        return false;
+    }
+
+    // Code list
+    for (uint32_t i = 0; i < info.codeListLength; ++i) {
+        int code = Read16(token + i * 2);
+        if (code < CODE_NUMBER_BEGIN || code - CODE_NUMBER_BEGIN >= info.dictionaryLength) {
+            stats.error = "code list refers to an item out of the dictionary";
+            return false;
+        }
+    }
+    if (info.trailerSize == 0) {
+        stats.error = "trailer is missing";
+    }
+    else if (stats.crcErrorCount > 0) {
+        stats.error = "section CRC mismatch";
+    }
+    return true;
+}
+
+bool CPsiArchiveReader::DecodeChunk(const uint8_t *data, const CHUNK_INFO &info, const std::function<void (int, uint32_t, const uint8_t *, size_t)> &onSection)
+{
+    CHUNK_STATS stats;
+    if (!CheckChunk(data, info, static_cast<int>(m_window.size()), stats) || stats.externalTokenCount > 0) {
+        return false;
+    }
+
+    // Dictionary
+    const uint8_t *dict = data + HEADER_SIZE + info.timeListLength * 4;
+    const uint8_t *pidList = dict + info.dictionaryLength * 2;
+    const uint8_t *token = pidList + stats.newTokenCount * 2;
+    m_dict.clear();
+    m_dict.resize(info.dictionaryLength);
+    for (int i = 0; i < info.dictionaryLength; ++i) {
+        int codeOrSize = Read16(dict + i * 2);
+        if (codeOrSize < CODE_NUMBER_BEGIN) {
+            m_dict[i].pid = Read16(pidList) & 0x1fff;
+            m_dict[i].token.assign(token, token + codeOrSize + 1);
+            pidList += 2;
+            token += codeOrSize + 1;
+        }
+        else {
+            // Move it from the window
+            m_dict[i].pid = m_window[codeOrSize - CODE_NUMBER_BEGIN].pid;
+            m_dict[i].token.swap(m_window[codeOrSize - CODE_NUMBER_BEGIN].token);
+        }
+    }
+    if (info.dictionaryDataSize % 2) {
+        ++token;
+    }
+
+    // Time list and code list
+    const uint8_t *codeList = token;
+    const uint8_t *p = data + HEADER_SIZE;
+    uint32_t currentTime = UNKNOWN_TIME;
+    for (int i = 0; i < info.timeListLength; ++i, p += 4) {
+        uint32_t v = Read32(p);
+        if (v & 0x80000000) {
+            currentTime = v == 0xffffffff ? UNKNOWN_TIME : v & 0x3fffffff;
+            continue;
+        }
+        if (currentTime != UNKNOWN_TIME) {
+            currentTime = (currentTime + (v & 0xffff)) & 0x3fffffff;
+        }
+        for (uint32_t n = (v >> 16) + 1; n > 0; --n, codeList += 2) {
+            const DICTIONARY_ITEM &item = m_dict[Read16(codeList) - CODE_NUMBER_BEGIN];
+            onSection(item.pid, currentTime, item.token.data(), item.token.size());
+        }
+    }
+
+    // Leave unused items in back of the window
+    for (auto it = m_window.begin(); it != m_window.end() && static_cast<int>(m_dict.size()) < info.dictionaryWindowLength; ++it) {
+        if (!it->token.empty()) {
+            m_dict.emplace_back();
+            m_dict.back().pid = it->pid;
+            m_dict.back().token.swap(it->token);
+        }
+    }
+    m_window.swap(m_dict);
+    return true;
+}
+
+bool CPsiArchiveReader::LinkChunk(const uint8_t *data, const CHUNK_INFO &info, std::vector<uint8_t> &linked) const
+{
+    CHUNK_STATS stats;
+    if (!CheckChunk(data, info, 0, stats)) {
+        return false;
+    }
+    std::unordered_multimap<uint32_t, int> windowHashMap;
+    for (size_t i = 0; i < m_window.size(); ++i) {
+        windowHashMap.emplace(GetTokenHash(m_window[i].pid, m_window[i].token.data(), m_window[i].token.size()), static_cast<int>(i));
+    }
+
+    const uint8_t *dict = data + HEADER_SIZE + info.timeListLength * 4;
+    const uint8_t *pidList = dict + info.dictionaryLength * 2;
+    const uint8_t *token = pidList + stats.newTokenCount * 2;
+    const uint8_t *codeList = pidList + (info.dictionaryDataSize + 1) / 2 * 2;
+    std::vector<uint8_t> codes(info.dictionaryLength * 2);
+    std::vector<uint8_t> pids;
+    std::vector<uint8_t> tokens;
+    for (int i = 0; i < info.dictionaryLength; ++i) {
+        int tokenSize = Read16(dict + i * 2) + 1;
+        int pid = Read16(pidList) & 0x1fff;
+        auto eqRange = windowHashMap.equal_range(GetTokenHash(pid, token, tokenSize));
+        for (; eqRange.first != eqRange.second; ++eqRange.first) {
+            const DICTIONARY_ITEM &item = m_window[eqRange.first->second];
+            if (item.pid == pid && item.token.size() == static_cast<size_t>(tokenSize) && std::equal(token, token + tokenSize, item.token.begin())) {
+                break;
+            }
+        }
+        if (eqRange.first != eqRange.second) {
+            // Each item of the window can be referred to once
+            Write16(codes.data() + i * 2, CODE_NUMBER_BEGIN + eqRange.first->second);
+            windowHashMap.erase(eqRange.first);
+        }
+        else {
+            Write16(codes.data() + i * 2, tokenSize - 1);
+            pids.insert(pids.end(), pidList, pidList + 2);
+            tokens.insert(tokens.end(), token, token + tokenSize);
+        }
+        pidList += 2;
+        token += tokenSize;
+    }
+
+    linked.assign(data, dict);
+    uint32_t dictionaryDataSize = static_cast<uint32_t>(pids.size() + tokens.size());
+    Write32(linked.data() + 16, dictionaryDataSize);
+    linked.insert(linked.end(), codes.begin(), codes.end());
+    linked.insert(linked.end(), pids.begin(), pids.end());
+    linked.insert(linked.end(), tokens.begin(), tokens.end());
+    if (dictionaryDataSize % 2) {
+        linked.push_back(0xff);
+    }
+    linked.insert(linked.end(), codeList, codeList + info.codeListLength * 2);
+    CHUNK_INFO linkedInfo;
+    ParseHeader(linked.data(), linkedInfo);
+    linked.insert(linked.end(), linkedInfo.trailerSize, 0x3d);
+    return true;
+}
+
+bool CPsiArchiveReader::RehydrateChunk(const uint8_t *data, const CHUNK_INFO &info, int prevWindowLength,
+                                       const std::function<bool (const uint8_t *, size_t, std::vector<uint8_t> &)> &loadToken,
+                                       std::vector<uint8_t> &rehydrated, CHUNK_STATS &stats)
+{
+    if (!CheckChunk(data, info, prevWindowLength, stats)) {
+        return false;
+    }
+    const uint8_t *dict = data + HEADER_SIZE + info.timeListLength * 4;
+    const uint8_t *pidList = dict + info.dictionaryLength * 2;
+    const uint8_t *token = pidList + stats.newTokenCount * 2;
+    const uint8_t *codeList = pidList + (info.dictionaryDataSize + 1) / 2 * 2;
+    std::vector<uint8_t> codes(dict, pidList);
+    std::vector<uint8_t> tokens;
+    std::vector<uint8_t> loaded;
+    for (int i = 0; i < info.dictionaryLength; ++i) {
+        int codeOrSize = Read16(dict + i * 2);
+        if (codeOrSize >= CODE_NUMBER_BEGIN) {
+            continue;
+        }
+        int tokenSize = codeOrSize + 1;
+        if (HasExternalTokens(data) && tokenSize == EXTERNAL_TOKEN_SIZE && token[0] == 0xff) {
+            size_t size = (token[3] << 8) | token[4];
+            if (size == 0 || size > 4096 || !loadToken(token + 5, size, loaded) || loaded.size() != size) {
+                stats.error = "external token cannot be loaded";
+                return false;
+            }
+            Write16(codes.data() + i * 2, static_cast<int>(size - 1));
+            tokens.insert(tokens.end(), loaded.begin(), loaded.end());
+        }
+        else {
+            tokens.insert(tokens.end(), token, token + tokenSize);
+        }
+        token += tokenSize;
+    }
+
+    rehydrated.assign(data, dict);
+    rehydrated[8] &= ~EXTERNAL_TOKEN_FLAG;
+    uint32_t dictionaryDataSize = static_cast<uint32_t>(stats.newTokenCount * 2 + tokens.size());
+    Write32(rehydrated.data() + 16, dictionaryDataSize);
+    rehydrated.insert(rehydrated.end(), codes.begin(), codes.end());
+    rehydrated.insert(rehydrated.end(), pidList, pidList + stats.newTokenCount * 2);
+    rehydrated.insert(rehydrated.end(), tokens.begin(), tokens.end());
+    if (dictionaryDataSize % 2) {
+        rehydrated.push_back(0xff);
+    }
+    rehydrated.insert(rehydrated.end(), codeList, codeList + info.codeListLength * 2);
+    CHUNK_INFO rehydratedInfo;
+    ParseHeader(rehydrated.data(), rehydratedInfo);
+    rehydrated.insert(rehydrated.end(), rehydratedInfo.trailerSize, 0x3d);
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef INCLUDE_PSIARCHIVEREADER_HPP
+#define INCLUDE_PSIARCHIVEREADER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reads the structure of archives made by CPsiArchiver and decodes them
+class CPsiArchiveReader
+{
+public:
+    struct CHUNK_INFO
+    {
+        int64_t pos;
+        // Including the trailer
+        int64_t size;
+        // 0 if the trailer is missing
+        int trailerSize;
+        int timeListLength;
+        int dictionaryLength;
+        int dictionaryWindowLength;
+        uint32_t dictionaryDataSize;
+        uint32_t dictionaryBuffSize;
+        uint32_t codeListLength;
+    };
+    struct CHUNK_STATS
+    {
+        // Empty if the chunk is valid
+        std::string error;
+        uint32_t sectionCount;
+        int newTokenCount;
+        int referenceCount;
+        int64_t newTokenBytes;
+        // New tokens which are references to an external store (see CPsiArchiver::EXTERNAL_TOKEN_SIZE)
+        int externalTokenCount;
+        int crcErrorCount;
+        // In 1/11250 seconds, or UNKNOWN_TIME
+        uint32_t firstTime;
+        uint32_t lastTime;
+    };
+    static const size_t HEADER_SIZE = 32;
+    static const uint32_t UNKNOWN_TIME = 0xffffffff;
+
+    // Returns false if header is not a chunk header
+    static bool ParseHeader(const uint8_t *header, CHUNK_INFO &info);
+    // True if the chunk refers to tokens in an external store, which must be rehydrated before decoding
+    static bool HasExternalTokens(const uint8_t *header) { return (header[8] & EXTERNAL_TOKEN_FLAG) != 0; }
+    // Lists chunks following the size fields of their headers. Returns the end position of the archive.
+    static int64_t IndexChunks(FILE *fp, std::vector<CHUNK_INFO> &chunks);
+    // Checks a chunk loaded in data without decoding the previous chunks.
+    // prevWindowLength is the dictionary window length of the previous chunk, or 0 for the first chunk.
+    // Returns false if the chunk is not decodable. Otherwise stats.error may still tell a missing trailer or CRC mismatch.
+    static bool CheckChunk(const uint8_t *data, const CHUNK_INFO &info, int prevWindowLength, CHUNK_STATS &stats);
+
+    // Rewrites a chunk loaded in data into rehydrated, replacing its references to an external store with the tokens given by
+    // loadToken (called with the SHA-256 and size of each token). The trailer is always written.
+    // Returns false with stats.error if the chunk is not decodable or a token cannot be loaded.
+    static bool RehydrateChunk(const uint8_t *data, const CHUNK_INFO &info, int prevWindowLength,
+                               const std::function<bool (const uint8_t *, size_t, std::vector<uint8_t> &)> &loadToken,
+                               std::vector<uint8_t> &rehydrated, CHUNK_STATS &stats);
+
+    // Decodes a chunk loaded in data following the chunks decoded before, and calls onSection with the PID,
+    // time (or UNKNOWN_TIME) and each section in the archived order. Returns false if the chunk is not decodable
+    // or has external tokens.
+    bool DecodeChunk(const uint8_t *data, const CHUNK_INFO &info, const std::function<void (int, uint32_t, const uint8_t *, size_t)> &onSection);
+    // The next chunk must be the first chunk of an archive
+    void ClearDictionary() { m_window.clear(); }
+    // Rewrites the first chunk of an archive (referring to no previous chunk) into linked, so that its new tokens found in the
+    // window left by the chunks decoded before are referred to instead. The items and the window of its dictionary are unchanged,
+    // so are the following chunks. The trailer is always written. Returns false if the chunk is not decodable by itself.
+    bool LinkChunk(const uint8_t *data, const CHUNK_INFO &info, std::vector<uint8_t> &linked) const;
+
+private:
+    struct DICTIONARY_ITEM
+    {
+        int pid;
+        std::vector<uint8_t> token;
+    };
+    static const int CODE_NUMBER_BEGIN = 4096;
+    static const int EXTERNAL_TOKEN_SIZE = 37;
+    static const uint8_t EXTERNAL_TOKEN_FLAG = 0x01;
+    // Dictionary items which the next chunk can refer to
+    std::vector<DICTIONARY_ITEM> m_window;
+    std::vector<DICTIONARY_ITEM> m_dict;
+};
+
+#endif
@@ -1,11 +1,23 @@
 #include "psiextractor.hpp"
 #include <algorithm>
+#include <string>
 
 CPsiExtractor::CPsiExtractor()
     : m_programNumberOrIndex(0)
+    , m_targetPmtPid(0)
+    , m_targetProgramNumber(0)
+    , m_patNitPid(0)
+    , m_patUpdated(false)
+    , m_pmtVersionNumber(0)
+    , m_pmtCrc32(0)
     , m_nitPid(0)
     , m_pcrPid(0)
     , m_pcr(-1)
+    , m_checkCompletion(false)
+    , m_incompleteTableCount(0)
+    , m_maxCyclePeriod(0)
+    , m_lastNewTablePcr(-1)
+    , m_extractingCreatedTable(false)
 {
     static const PAT zeroPat = {};
     m_pat = zeroPat;
@@ -19,28 +31,71 @@ void CPsiExtractor::AddTargetPid(int pid)
     m_targetPsiSiMap[pid].specified = true;
 }
 
+void CPsiExtractor::AddTargetTableIdRange(int pid, int tableIdFrom, int tableIdTo)
+{
+    // Sections of this PID are extracted only if their table_id is in one of the ranges
+    std::vector<uint8_t> &filter = m_tableIdFilterMap[pid];
+    filter.resize(256);
+    for (int i = std::max(tableIdFrom, 0); i <= std::min(tableIdTo, 255); ++i) {
+        filter[i] = 1;
+    }
+}
+
 void CPsiExtractor::AddTargetStreamType(int streamType)
 {
     m_targetStreamTypes.insert(streamType);
 }
 
+bool CPsiExtractor::AddPreset(const char *name)
+{
+    std::string s = name;
+    bool isAribData = s == "arib-data";
+    bool isAribEpg = s == "arib-epg";
+    if (isAribData || isAribEpg) {
+        SetProgramNumberOrIndex(-1);
+        AddTargetPid(17);
+        AddTargetPid(18);
+        AddTargetPid(20);
+        AddTargetPid(31);
+        AddTargetPid(36);
+        if (isAribData) {
+            AddTargetStreamType(11);
+            AddTargetStreamType(12);
+            AddTargetStreamType(13);
+        }
+    }
+    return isAribData || isAribEpg;
+}
+
 void CPsiExtractor::AddPacket(const uint8_t *packet, const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract)
 {
     int unitStart = extract_ts_header_unit_start(packet);
     int pid = extract_ts_header_pid(packet);
-    int adaptation = extract_ts_header_adaptation(packet);
     int counter = extract_ts_header_counter(packet);
     int payloadSize = get_ts_payload_size(packet);
     const uint8_t *payload = packet + 188 - payloadSize;
 
     if (pid == 0 && m_programNumberOrIndex != 0) {
-        extract_pat(&m_pat, payload, payloadSize, unitStart, counter);
-        auto itPmt = FindTargetPmtRef(m_pat.pmt);
-        if (itPmt != m_pat.pmt.end()) {
+        if (extract_pat(&m_pat, payload, payloadSize, unitStart, counter)) {
+            // Look up the target only when PAT is changed
+            auto itPmt = FindTargetPmtRef(m_pat.pmt);
+            auto itNit = FindNitRef(m_pat.pmt);
+            m_targetPmtPid = itPmt != m_pat.pmt.end() ? itPmt->pmt_pid : 0;
+            m_targetProgramNumber = itPmt != m_pat.pmt.end() ? itPmt->program_number : 0;
+            m_patNitPid = itNit != m_pat.pmt.end() ? itNit->pmt_pid : 0;
+            m_patUpdated = true;
+            m_pmtVersionNumber = 0;
+        }
+        if (m_targetPmtPid != 0) {
             if (unitStart) {
-                auto itNit = FindNitRef(m_pat.pmt);
-                AddPat(m_pat.transport_stream_id, itPmt->program_number, itPmt->pmt_pid,
-                       itNit != m_pat.pmt.end() ? itNit->pmt_pid : 0, onExtract);
+                if (m_patUpdated || m_lastPat.empty()) {
+                    AddPat(m_pat.transport_stream_id, m_targetProgramNumber, m_targetPmtPid, m_patNitPid, onExtract);
+                    m_patUpdated = false;
+                }
+                else {
+                    // Unchanged
+                    ExtractCreatedTable(0, m_lastPat.size(), m_lastPat.data(), onExtract);
+                }
             }
         }
         else {
@@ -50,9 +105,8 @@ void CPsiExtractor::AddPacket(const uint8_t *packet, const std::function<void (i
     }
     else {
         if (m_programNumberOrIndex != 0) {
-            auto itPmt = FindTargetPmtRef(m_pat.pmt);
-            if (itPmt != m_pat.pmt.end()) {
-                if (pid == itPmt->pmt_pid) {
+            if (m_targetPmtPid != 0) {
+                if (pid == m_targetPmtPid) {
                     int done;
                     do {
                         done = extract_psi(&m_pmtPsi, payload, payloadSize, unitStart, counter);
@@ -63,28 +117,297 @@ void CPsiExtractor::AddPacket(const uint8_t *packet, const std::function<void (i
                     while (!done);
                 }
                 if (pid == m_pcrPid) {
-                    if (adaptation & 2) {
-                        int adaptationLength = packet[4];
-                        if (adaptationLength >= 6 && !!(packet[5] & 0x10)) {
-                            m_pcr = (packet[10] >> 7) |
-                                    (packet[9] << 1) |
-                                    (packet[8] << 9) |
-                                    (packet[7] << 17) |
-                                    (static_cast<int64_t>(packet[6]) << 25);
-                        }
+                    int64_t pcr = extract_ts_header_pcr(packet);
+                    if (pcr >= 0) {
+                        m_pcr = pcr;
                     }
                 }
             }
         }
         auto it = m_targetPsiSiMap.find(pid);
         if (it != m_targetPsiSiMap.end()) {
-            ExtractPsiSi(it->second, payload, payloadSize, unitStart, counter, [this, pid, &onExtract](int dataSize, const uint8_t *data) {
+            const uint8_t *tableIdFilter = nullptr;
+            if (!m_tableIdFilterMap.empty()) {
+                auto itFilter = m_tableIdFilterMap.find(pid);
+                if (itFilter != m_tableIdFilterMap.end()) {
+                    tableIdFilter = itFilter->second.data();
+                }
+            }
+            ExtractPsiSi(it->second, payload, payloadSize, unitStart, counter, tableIdFilter, [this, pid, &onExtract](int dataSize, const uint8_t *data) {
+                if (m_checkCompletion) {
+                    UpdateTableCompletion(pid, dataSize, data);
+                }
                 onExtract(pid, m_pcr, dataSize, data);
             });
         }
     }
 }
 
+void CPsiExtractor::ResetContinuity()
+{
+    m_pat.psi.continuity_counter = 0;
+    m_pmtPsi.continuity_counter = 0;
+    for (auto it = m_targetPsiSiMap.begin(); it != m_targetPsiSiMap.end(); ++it) {
+        it->second.continuityCounter = it->second.dataCount = it->second.skipCount = 0;
+    }
+}
+
+void CPsiExtractor::SaveState(std::vector<uint8_t> &state) const
+{
+    // Settings (targets and filters) are not saved
+    put_state_int(state, m_pat.transport_stream_id);
+    put_state_int(state, m_pat.version_number);
+    put_state_int(state, m_pat.crc32);
+    put_state_int(state, m_pat.pmt.size());
+    for (auto it = m_pat.pmt.cbegin(); it != m_pat.pmt.end(); ++it) {
+        put_state_int(state, it->pmt_pid);
+        put_state_int(state, it->program_number);
+    }
+    SavePsi(state, m_pat.psi);
+    SavePsi(state, m_pmtPsi);
+    put_state_int(state, m_targetPsiSiMap.size());
+    for (auto it = m_targetPsiSiMap.cbegin(); it != m_targetPsiSiMap.end(); ++it) {
+        put_state_int(state, it->first);
+        put_state_int(state, it->second.specified);
+        put_state_int(state, it->second.existsOnPmt);
+        put_state_int(state, it->second.continuityCounter);
+        put_state_int(state, it->second.skipCount);
+        put_state_data(state, it->second.data, it->second.dataCount);
+    }
+    put_state_int(state, m_targetPmtPid);
+    put_state_int(state, m_targetProgramNumber);
+    put_state_int(state, m_patNitPid);
+    put_state_int(state, m_patUpdated);
+    put_state_int(state, m_pmtVersionNumber);
+    put_state_int(state, m_pmtCrc32);
+    put_state_int(state, m_nitPid);
+    put_state_int(state, m_pcrPid);
+    put_state_int(state, m_pcr);
+    put_state_data(state, m_lastPat.data(), m_lastPat.size());
+    put_state_data(state, m_lastPmt.data(), m_lastPmt.size());
+    put_state_int(state, m_tableCompletionMap.size());
+    for (auto it = m_tableCompletionMap.cbegin(); it != m_tableCompletionMap.end(); ++it) {
+        put_state_int(state, it->first);
+        put_state_int(state, it->second.completed);
+        put_state_int(state, it->second.cycled);
+        put_state_int(state, it->second.versionNumber);
+        put_state_int(state, it->second.firstSectionNumber);
+        put_state_int(state, it->second.firstPcr);
+        put_state_data(state, it->second.receivedSections, sizeof(it->second.receivedSections));
+        put_state_data(state, it->second.expectedSections, sizeof(it->second.expectedSections));
+    }
+    put_state_int(state, m_incompleteTableCount);
+    put_state_int(state, m_maxCyclePeriod);
+    put_state_int(state, m_lastNewTablePcr);
+}
+
+bool CPsiExtractor::LoadState(STATE_READER &r)
+{
+    m_pat.transport_stream_id = static_cast<int>(get_state_int(&r));
+    m_pat.version_number = static_cast<int>(get_state_int(&r));
+    m_pat.crc32 = static_cast<uint32_t>(get_state_int(&r));
+    int64_t n = get_state_int(&r);
+    m_pat.pmt.clear();
+    for (int64_t i = 0; i < n && !r.failed; ++i) {
+        PMT_REF ref;
+        ref.pmt_pid = static_cast<int>(get_state_int(&r));
+        ref.program_number = static_cast<int>(get_state_int(&r));
+        m_pat.pmt.push_back(ref);
+    }
+    if (!LoadPsi(r, m_pat.psi) || !LoadPsi(r, m_pmtPsi)) {
+        return false;
+    }
+    m_targetPsiSiMap.clear();
+    n = get_state_int(&r);
+    for (int64_t i = 0; i < n && !r.failed; ++i) {
+        static const PSI_SI zeroPsiSi = {};
+        PSI_SI &psiSi = m_targetPsiSiMap.emplace(static_cast<int>(get_state_int(&r)), zeroPsiSi).first->second;
+        psiSi.specified = get_state_int(&r) != 0;
+        psiSi.existsOnPmt = get_state_int(&r) != 0;
+        psiSi.continuityCounter = static_cast<int>(get_state_int(&r));
+        psiSi.skipCount = static_cast<int>(get_state_int(&r));
+        size_t size;
+        const uint8_t *data = get_state_data(&r, &size);
+        if (size > sizeof(psiSi.data)) {
+            return false;
+        }
+        std::copy(data, data + size, psiSi.data);
+        psiSi.dataCount = static_cast<int>(size);
+    }
+    m_targetPmtPid = static_cast<int>(get_state_int(&r));
+    m_targetProgramNumber = static_cast<int>(get_state_int(&r));
+    m_patNitPid = static_cast<int>(get_state_int(&r));
+    m_patUpdated = get_state_int(&r) != 0;
+    m_pmtVersionNumber = static_cast<int>(get_state_int(&r));
+    m_pmtCrc32 = static_cast<uint32_t>(get_state_int(&r));
+    m_nitPid = static_cast<int>(get_state_int(&r));
+    m_pcrPid = static_cast<int>(get_state_int(&r));
+    m_pcr = get_state_int(&r);
+    size_t size;
+    const uint8_t *data = get_state_data(&r, &size);
+    m_lastPat.assign(data, data + size);
+    data = get_state_data(&r, &size);
+    m_lastPmt.assign(data, data + size);
+    m_tableCompletionMap.clear();
+    n = get_state_int(&r);
+    for (int64_t i = 0; i < n && !r.failed; ++i) {
+        static const TABLE_COMPLETION zeroTable = {};
+        TABLE_COMPLETION &table = m_tableCompletionMap.emplace(static_cast<uint64_t>(get_state_int(&r)), zeroTable).first->second;
+        table.completed = get_state_int(&r) != 0;
+        table.cycled = get_state_int(&r) != 0;
+        table.versionNumber = static_cast<int>(get_state_int(&r));
+        table.firstSectionNumber = static_cast<int>(get_state_int(&r));
+        table.firstPcr = get_state_int(&r);
+        data = get_state_data(&r, &size);
+        if (size != sizeof(table.receivedSections)) {
+            return false;
+        }
+        std::copy(data, data + size, table.receivedSections);
+        data = get_state_data(&r, &size);
+        if (size != sizeof(table.expectedSections)) {
+            return false;
+        }
+        std::copy(data, data + size, table.expectedSections);
+    }
+    m_incompleteTableCount = static_cast<size_t>(get_state_int(&r));
+    m_maxCyclePeriod = get_state_int(&r);
+    m_lastNewTablePcr = get_state_int(&r);
+    return !r.failed;
+}
+
+bool CPsiExtractor::CompareState(const CPsiExtractor &other, int &patVersionDiff, int &pmtVersionDiff) const
+{
+    if (!IsSameCreatedTable(m_lastPat, other.m_lastPat, patVersionDiff) ||
+        !IsSameCreatedTable(m_lastPmt, other.m_lastPmt, pmtVersionDiff)) {
+        return false;
+    }
+    if (m_pat.transport_stream_id != other.m_pat.transport_stream_id ||
+        m_pat.version_number != other.m_pat.version_number ||
+        m_pat.crc32 != other.m_pat.crc32 ||
+        m_pat.pmt.size() != other.m_pat.pmt.size() ||
+        !std::equal(m_pat.pmt.begin(), m_pat.pmt.end(), other.m_pat.pmt.begin(), [](const PMT_REF &a, const PMT_REF &b) {
+            return a.pmt_pid == b.pmt_pid && a.program_number == b.program_number; }) ||
+        !IsSamePsi(m_pat.psi, other.m_pat.psi) ||
+        !IsSamePsi(m_pmtPsi, other.m_pmtPsi) ||
+        m_targetPmtPid != other.m_targetPmtPid ||
+        m_targetProgramNumber != other.m_targetProgramNumber ||
+        m_patNitPid != other.m_patNitPid ||
+        m_patUpdated != other.m_patUpdated ||
+        m_pmtVersionNumber != other.m_pmtVersionNumber ||
+        m_pmtCrc32 != other.m_pmtCrc32 ||
+        m_nitPid != other.m_nitPid ||
+        m_pcrPid != other.m_pcrPid ||
+        m_pcr != other.m_pcr ||
+        m_incompleteTableCount != other.m_incompleteTableCount ||
+        m_maxCyclePeriod != other.m_maxCyclePeriod ||
+        m_lastNewTablePcr != other.m_lastNewTablePcr ||
+        m_targetPsiSiMap.size() != other.m_targetPsiSiMap.size() ||
+        m_tableCompletionMap.size() != other.m_tableCompletionMap.size()) {
+        return false;
+    }
+    for (auto it = m_targetPsiSiMap.cbegin(); it != m_targetPsiSiMap.end(); ++it) {
+        auto itOther = other.m_targetPsiSiMap.find(it->first);
+        if (itOther == other.m_targetPsiSiMap.end() ||
+            it->second.specified != itOther->second.specified ||
+            it->second.existsOnPmt != itOther->second.existsOnPmt ||
+            it->second.continuityCounter != itOther->second.continuityCounter ||
+            it->second.skipCount != itOther->second.skipCount ||
+            it->second.dataCount != itOther->second.dataCount ||
+            !std::equal(it->second.data, it->second.data + it->second.dataCount, itOther->second.data)) {
+            return false;
+        }
+    }
+    for (auto it = m_tableCompletionMap.cbegin(); it != m_tableCompletionMap.end(); ++it) {
+        auto itOther = other.m_tableCompletionMap.find(it->first);
+        if (itOther == other.m_tableCompletionMap.end() ||
+            it->second.completed != itOther->second.completed ||
+            it->second.cycled != itOther->second.cycled ||
+            it->second.versionNumber != itOther->second.versionNumber ||
+            it->second.firstSectionNumber != itOther->second.firstSectionNumber ||
+            it->second.firstPcr != itOther->second.firstPcr ||
+            !std::equal(it->second.receivedSections, it->second.receivedSections + sizeof(it->second.receivedSections), itOther->second.receivedSections) ||
+            !std::equal(it->second.expectedSections, it->second.expectedSections + sizeof(it->second.expectedSections), itOther->second.expectedSections)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CPsiExtractor::ShiftCreatedTableVersion(uint8_t *table, size_t size, int diff)
+{
+    if (size >= 12 && (diff & 0x1f) != 0) {
+        table[5] = 0xc1 | (((table[5] >> 1) + diff) & 0x1f) << 1;
+        uint32_t crc = calc_crc32(table, static_cast<int>(size - 4));
+        table[size - 4] = crc >> 24;
+        table[size - 3] = (crc >> 16) & 0xff;
+        table[size - 2] = (crc >> 8) & 0xff;
+        table[size - 1] = crc & 0xff;
+    }
+}
+
+bool CPsiExtractor::IsSamePsi(const PSI &a, const PSI &b)
+{
+    // Same fields as SavePsi()
+    return a.table_id == b.table_id &&
+           a.section_length == b.section_length &&
+           a.version_number == b.version_number &&
+           a.current_next_indicator == b.current_next_indicator &&
+           a.continuity_counter == b.continuity_counter &&
+           a.data_count == b.data_count &&
+           std::equal(a.data, a.data + a.data_count, b.data);
+}
+
+bool CPsiExtractor::IsSameCreatedTable(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, int &versionDiff)
+{
+    versionDiff = 0;
+    if (a.size() != b.size()) {
+        return false;
+    }
+    if (a.size() < 12) {
+        return a == b;
+    }
+    // Ignore the version number and CRC
+    versionDiff = ((a[5] >> 1) - (b[5] >> 1)) & 0x1f;
+    return std::equal(a.begin(), a.begin() + 5, b.begin()) &&
+           ((a[5] ^ b[5]) & 0xc1) == 0 &&
+           std::equal(a.begin() + 6, a.end() - 4, b.begin() + 6);
+}
+
+void CPsiExtractor::ExtractCreatedTable(int pid, size_t size, const uint8_t *table,
+                                        const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract)
+{
+    m_extractingCreatedTable = true;
+    onExtract(pid, m_pcr, size, table);
+    m_extractingCreatedTable = false;
+}
+
+void CPsiExtractor::SavePsi(std::vector<uint8_t> &state, const PSI &psi)
+{
+    put_state_int(state, psi.table_id);
+    put_state_int(state, psi.section_length);
+    put_state_int(state, psi.version_number);
+    put_state_int(state, psi.current_next_indicator);
+    put_state_int(state, psi.continuity_counter);
+    put_state_data(state, psi.data, psi.data_count);
+}
+
+bool CPsiExtractor::LoadPsi(STATE_READER &r, PSI &psi)
+{
+    psi.table_id = static_cast<int>(get_state_int(&r));
+    psi.section_length = static_cast<int>(get_state_int(&r));
+    psi.version_number = static_cast<int>(get_state_int(&r));
+    psi.current_next_indicator = static_cast<int>(get_state_int(&r));
+    psi.continuity_counter = static_cast<int>(get_state_int(&r));
+    size_t size;
+    const uint8_t *data = get_state_data(&r, &size);
+    if (r.failed || size > sizeof(psi.data)) {
+        return false;
+    }
+    std::copy(data, data + size, psi.data);
+    psi.data_count = static_cast<int>(size);
+    return true;
+}
+
 std::vector<PMT_REF>::const_iterator CPsiExtractor::FindNitRef(const std::vector<PMT_REF> &pmt)
 {
     return std::find_if(pmt.begin(), pmt.end(), [](const PMT_REF &a) { return a.program_number == 0; });
@@ -156,7 +479,7 @@ void CPsiExtractor::AddPat(int transportStreamID, int programNumber, int pmtPid,
         m_lastPat.assign(buf, buf + bufLen);
     }
 
-    onExtract(0, m_pcr, bufLen, buf);
+    ExtractCreatedTable(0, bufLen, buf, onExtract);
 }
 
 void CPsiExtractor::AddPmt(const PSI &psi, int pid, const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract)
@@ -165,6 +488,16 @@ void CPsiExtractor::AddPmt(const PSI &psi, int pid, const std::function<void (in
         return;
     }
     const uint8_t *table = psi.data;
+    const uint8_t *crc = table + 3 + psi.section_length - 4;
+    uint32_t crc32 = (static_cast<uint32_t>(crc[0]) << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+    if (psi.version_number == m_pmtVersionNumber && crc32 == m_pmtCrc32 && !m_lastPmt.empty()) {
+        // Unchanged, so the last PMT created is still valid
+        if (m_pcrPid == 0x1fff) {
+            m_pcr = -1;
+        }
+        ExtractCreatedTable(pid, m_lastPmt.size(), m_lastPmt.data(), onExtract);
+        return;
+    }
     m_pcrPid = ((table[8] & 0x1f) << 8) | table[9];
     if (m_pcrPid == 0x1fff) {
         m_pcr = -1;
@@ -242,22 +575,130 @@ void CPsiExtractor::AddPmt(const PSI &psi, int pid, const std::function<void (in
         buf[bufLen++] = crc & 0xff;
         m_lastPmt.assign(buf, buf + bufLen);
     }
+    m_pmtVersionNumber = psi.version_number;
+    m_pmtCrc32 = crc32;
 
-    onExtract(pid, m_pcr, bufLen, buf);
+    ExtractCreatedTable(pid, bufLen, buf, onExtract);
+}
+
+bool CPsiExtractor::IsCompleted() const
+{
+    return !m_tableCompletionMap.empty() && m_incompleteTableCount == 0 && m_pcr >= 0 && m_lastNewTablePcr >= 0 &&
+           ((0x200000000 + m_pcr - m_lastNewTablePcr) & 0x1ffffffff) >= m_maxCyclePeriod;
+}
+
+CPsiExtractor::TABLE_COMPLETION &CPsiExtractor::FindOrAddTableCompletion(uint64_t key, bool &added)
+{
+    auto it = m_tableCompletionMap.find(key);
+    added = it == m_tableCompletionMap.end();
+    if (added) {
+        static const TABLE_COMPLETION zeroTable = {};
+        it = m_tableCompletionMap.emplace(key, zeroTable).first;
+        it->second.firstPcr = -1;
+        ++m_incompleteTableCount;
+    }
+    return it->second;
+}
+
+void CPsiExtractor::UpdateTableCompletion(int pid, int sectionSize, const uint8_t *section)
+{
+    // Only sections with the syntax of long form are counted
+    if (sectionSize < 12 || !(section[1] & 0x80) || !(section[5] & 0x01) || calc_crc32(section, sectionSize) != 0) {
+        return;
+    }
+    int tableId = section[0];
+    bool isEit = 0x4e <= tableId && tableId <= 0x6f;
+    if (isEit && sectionSize < 14 + 4) {
+        return;
+    }
+    if (m_lastNewTablePcr < 0) {
+        // Sub-tables seen before the first PCR
+        m_lastNewTablePcr = m_pcr;
+    }
+    // PID, table_id, table_id_extension and transport_stream_id (EIT only) identify a sub-table
+    uint64_t serviceKey = (static_cast<uint64_t>(pid) << 40) | (static_cast<uint32_t>(section[3]) << 24) | (section[4] << 16) |
+                          (isEit ? (section[8] << 8) | section[9] : 0);
+    bool added;
+    TABLE_COMPLETION &table = FindOrAddTableCompletion(serviceKey | (static_cast<uint64_t>(tableId) << 32), added);
+    if (added || table.versionNumber == 0) {
+        // A sub-table not seen before may have been missed until now
+        m_lastNewTablePcr = m_pcr;
+    }
+    if (0x50 <= tableId && tableId <= 0x6f && section[13] > tableId && (section[13] & 0xf8) == (tableId & 0xf8)) {
+        // The other tables of an EIT schedule up to last_table_id are expected even if they are slow to come
+        for (int i = (tableId & 0xf8); i <= section[13]; ++i) {
+            FindOrAddTableCompletion(serviceKey | (static_cast<uint64_t>(i) << 32), added);
+        }
+    }
+    int versionNumber = 0x20 | ((section[5] >> 1) & 0x1f);
+    int sectionNumber = section[6];
+    int lastSectionNumber = section[7];
+    if (table.versionNumber != versionNumber) {
+        // The carousel of this sub-table starts over
+        if (table.completed) {
+            table.completed = false;
+            ++m_incompleteTableCount;
+        }
+        table.cycled = false;
+        table.versionNumber = versionNumber;
+        table.firstSectionNumber = sectionNumber;
+        table.firstPcr = m_pcr;
+        std::fill_n(table.receivedSections, sizeof(table.receivedSections), 0);
+        std::fill_n(table.expectedSections, sizeof(table.expectedSections), 0);
+    }
+    else if (sectionNumber == table.firstSectionNumber && !table.cycled) {
+        if (table.firstPcr < 0) {
+            // The cycle cannot be timed, so wait for another
+            table.firstPcr = m_pcr;
+        }
+        else if (m_pcr >= 0) {
+            // A whole cycle has been received
+            table.cycled = true;
+            m_maxCyclePeriod = std::max(m_maxCyclePeriod, (0x200000000 + m_pcr - table.firstPcr) & 0x1ffffffff);
+        }
+    }
+    table.receivedSections[sectionNumber >> 3] |= 1 << (sectionNumber & 7);
+
+    if (isEit) {
+        // Sections after segment_last_section_number in each segment are not sent
+        int segmentLastSectionNumber = std::min(std::min(static_cast<int>(section[12]), lastSectionNumber), sectionNumber | 7);
+        for (int i = sectionNumber & 0xf8; i <= segmentLastSectionNumber; ++i) {
+            table.expectedSections[i >> 3] |= 1 << (i & 7);
+        }
+    }
+    else {
+        for (int i = 0; i <= lastSectionNumber; ++i) {
+            table.expectedSections[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    bool completed = table.cycled;
+    for (size_t i = 0; completed && i < sizeof(table.expectedSections); ++i) {
+        completed = (table.expectedSections[i] & ~table.receivedSections[i]) == 0;
+    }
+    if (table.completed != completed) {
+        table.completed = completed;
+        if (completed) {
+            --m_incompleteTableCount;
+        }
+        else {
+            ++m_incompleteTableCount;
+        }
+    }
 }
 
 void CPsiExtractor::ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payloadSize, int unitStart, int counter,
-                                 const std::function<void (int, const uint8_t *)> &onExtract)
+                                 const uint8_t *tableIdFilter, const std::function<void (int, const uint8_t *)> &onExtract)
 {
     int copyPos = 0;
     if (unitStart) {
         if (payloadSize < 1) {
-            psiSi.continuityCounter = psiSi.dataCount = 0;
+            psiSi.continuityCounter = psiSi.dataCount = psiSi.skipCount = 0;
             return;
         }
         int pointer = payload[0];
         psiSi.continuityCounter = (psiSi.continuityCounter + 1) & 0x2f;
-        if (pointer > 0 && psiSi.continuityCounter == (0x20 | counter)) {
+        if (pointer > 0 && psiSi.continuityCounter == (0x20 | counter) && psiSi.skipCount == 0) {
             copyPos = 1;
             if (copyPos + pointer <= payloadSize) {
                 int copySize = std::min(pointer, static_cast<int>(sizeof(psiSi.data)) - psiSi.dataCount);
@@ -265,7 +706,7 @@ void CPsiExtractor::ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payl
                 psiSi.dataCount += copySize;
             }
 
-            if (psiSi.dataCount >= 3 && psiSi.data[0] != 0xff) {
+            if (psiSi.dataCount >= 3 && psiSi.data[0] != 0xff && (!tableIdFilter || tableIdFilter[psiSi.data[0]])) {
                 // Non-stuffing section
                 int sectionLength = ((psiSi.data[1] & 0x0f) << 8) | psiSi.data[2];
                 if (psiSi.dataCount >= 3 + sectionLength) {
@@ -274,7 +715,7 @@ void CPsiExtractor::ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payl
             }
         }
         psiSi.continuityCounter = 0x20 | counter;
-        psiSi.dataCount = 0;
+        psiSi.dataCount = psiSi.skipCount = 0;
         copyPos = 1 + pointer;
     }
     else {
@@ -284,14 +725,27 @@ void CPsiExtractor::ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payl
         }
         psiSi.continuityCounter = (psiSi.continuityCounter + 1) & 0x2f;
         if (psiSi.continuityCounter != (0x20 | counter)) {
-            psiSi.continuityCounter = psiSi.dataCount = 0;
+            psiSi.continuityCounter = psiSi.dataCount = psiSi.skipCount = 0;
             return;
         }
     }
 
     for (;;) {
+        if (psiSi.skipCount > 0) {
+            // Discard the rest of a filtered section
+            int skipSize = std::min(psiSi.skipCount, std::max(payloadSize - copyPos, 0));
+            copyPos += skipSize;
+            psiSi.skipCount -= skipSize;
+            if (psiSi.skipCount > 0) {
+                break;
+            }
+        }
         if (copyPos < payloadSize) {
             int copySize = std::min(payloadSize - copyPos, static_cast<int>(sizeof(psiSi.data)) - psiSi.dataCount);
+            if (tableIdFilter && psiSi.dataCount < 3) {
+                // Copy the section header only, so that filtered sections are never copied
+                copySize = std::min(copySize, 3 - psiSi.dataCount);
+            }
             std::copy(payload + copyPos, payload + copyPos + copySize, psiSi.data + psiSi.dataCount);
             psiSi.dataCount += copySize;
             copyPos += copySize;
@@ -301,7 +755,23 @@ void CPsiExtractor::ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payl
         }
         // Non-stuffing section
         int sectionLength = ((psiSi.data[1] & 0x0f) << 8) | psiSi.data[2];
+        if (tableIdFilter && !tableIdFilter[psiSi.data[0]]) {
+            // Filtered section
+            if (psiSi.dataCount < 3 + sectionLength) {
+                psiSi.skipCount = 3 + sectionLength - psiSi.dataCount;
+                psiSi.dataCount = 0;
+            }
+            else {
+                std::copy(psiSi.data + 3 + sectionLength, psiSi.data + psiSi.dataCount, psiSi.data);
+                psiSi.dataCount -= 3 + sectionLength;
+            }
+            continue;
+        }
         if (psiSi.dataCount < 3 + sectionLength) {
+            if (copyPos < payloadSize && psiSi.dataCount < static_cast<int>(sizeof(psiSi.data))) {
+                // Copy the rest
+                continue;
+            }
             break;
         }
         onExtract(3 + sectionLength, psiSi.data);
@@ -15,7 +15,27 @@ public:
     CPsiExtractor();
     void SetProgramNumberOrIndex(int n) { m_programNumberOrIndex = n; }
     void AddTargetPid(int pid);
+    void AddTargetTableIdRange(int pid, int tableIdFrom, int tableIdTo);
     void AddTargetStreamType(int streamType);
+    // "arib-data" or "arib-epg"
+    bool AddPreset(const char *name);
+    void SetCheckCompletion(bool check) { m_checkCompletion = check; }
+    // True when every sub-table seen or announced has been received in full, and no new one has appeared
+    // for the longest cycle of them
+    bool IsCompleted() const;
+    int64_t GetPcr() const { return m_pcr; }
+    int GetPcrPid() const { return m_pcrPid; }
+    // Discards sections being received, as when packets are lost. Called when the input jumps.
+    void ResetContinuity();
+    void SaveState(std::vector<uint8_t> &state) const;
+    bool LoadState(STATE_READER &r);
+    // The version numbers of the PAT and PMT created by the extractor count their changes from the beginning of the stream.
+    // Returns true if the state is the same as other except for them, and the differences of the version numbers.
+    bool CompareState(const CPsiExtractor &other, int &patVersionDiff, int &pmtVersionDiff) const;
+    // True while onExtract is called with the PAT or PMT created by the extractor
+    bool IsExtractingCreatedTable() const { return m_extractingCreatedTable; }
+    // Adds diff to the version number of a created PAT or PMT and updates its CRC
+    static void ShiftCreatedTableVersion(uint8_t *table, size_t size, int diff);
     void AddPacket(const uint8_t *packet, const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract);
 
 private:
@@ -25,26 +45,59 @@ private:
         bool existsOnPmt;
         int continuityCounter;
         int dataCount;
+        int skipCount;
         uint8_t data[4096];
     };
+    struct TABLE_COMPLETION
+    {
+        bool completed;
+        bool cycled;
+        // 0 if only announced by last_table_id of an EIT schedule
+        int versionNumber;
+        int firstSectionNumber;
+        // PCR when firstSectionNumber was received, or -1
+        int64_t firstPcr;
+        uint8_t receivedSections[32];
+        uint8_t expectedSections[32];
+    };
     static std::vector<PMT_REF>::const_iterator FindNitRef(const std::vector<PMT_REF> &pmt);
     std::vector<PMT_REF>::const_iterator FindTargetPmtRef(const std::vector<PMT_REF> &pmt) const;
     void AddPat(int transportStreamID, int programNumber, int pmtPid, int nitPid,
                 const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract);
     void AddPmt(const PSI &psi, int pid, const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract);
+    static void SavePsi(std::vector<uint8_t> &state, const PSI &psi);
+    static bool LoadPsi(STATE_READER &r, PSI &psi);
+    static bool IsSamePsi(const PSI &a, const PSI &b);
+    static bool IsSameCreatedTable(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, int &versionDiff);
+    void ExtractCreatedTable(int pid, size_t size, const uint8_t *table, const std::function<void (int, int64_t, size_t, const uint8_t *)> &onExtract);
+    void UpdateTableCompletion(int pid, int sectionSize, const uint8_t *section);
+    TABLE_COMPLETION &FindOrAddTableCompletion(uint64_t key, bool &added);
     static void ExtractPsiSi(PSI_SI &psiSi, const uint8_t *payload, int payloadSize, int unitStart, int counter,
-                             const std::function<void (int, const uint8_t *)> &onExtract);
+                             const uint8_t *tableIdFilter, const std::function<void (int, const uint8_t *)> &onExtract);
 
     int m_programNumberOrIndex;
     PAT m_pat;
     PSI m_pmtPsi;
     std::unordered_map<int, PSI_SI> m_targetPsiSiMap;
+    std::unordered_map<int, std::vector<uint8_t>> m_tableIdFilterMap;
     std::unordered_set<int> m_targetStreamTypes;
+    int m_targetPmtPid;
+    int m_targetProgramNumber;
+    int m_patNitPid;
+    bool m_patUpdated;
+    int m_pmtVersionNumber;
+    uint32_t m_pmtCrc32;
     int m_nitPid;
     int m_pcrPid;
     int64_t m_pcr;
     std::vector<uint8_t> m_lastPat;
     std::vector<uint8_t> m_lastPmt;
+    bool m_checkCompletion;
+    std::unordered_map<uint64_t, TABLE_COMPLETION> m_tableCompletionMap;
+    size_t m_incompleteTableCount;
+    int64_t m_maxCyclePeriod;
+    int64_t m_lastNewTablePcr;
+    bool m_extractingCreatedTable;
 };
 
 #endif
@@ -1,56 +1,265 @@
 #ifdef _WIN32
+#include <windows.h>
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
 #endif
+#include <ctype.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
+#include "archiveconcatenator.hpp"
+#include "archivecontext.hpp"
+#include "archiveinspector.hpp"
+#include "archiverehydrator.hpp"
+#include "archiveremuxer.hpp"
+#include "asyncwriter.hpp"
+#include "batcharchiver.hpp"
+#include "fileutil.hpp"
+#include "latencyhistogram.hpp"
+#include "metricsserver.hpp"
+#include "parallelarchiver.hpp"
+#include "probe.hpp"
 #include "psiarchiver.hpp"
 #include "psiextractor.hpp"
+#include "segmentwriter.hpp"
+#include "shmring.hpp"
+#include "tokenstore.hpp"
+#include "udpreceiver.hpp"
+#include "uringio.hpp"
 #include "util.hpp"
 
 namespace
 {
-#ifdef _WIN32
-std::string NativeToString(const wchar_t *s)
+volatile sig_atomic_t g_stopRequested = 0;
+
+void OnStopSignal(int)
 {
-    std::string ret;
-    for (; *s; ++s) {
-        ret += 0 < *s && *s <= 127 ? static_cast<char>(*s) : '?';
-    }
-    return ret;
+    g_stopRequested = 1;
 }
-#else
-std::string NativeToString(const char *s)
+
+#ifndef _WIN32
+volatile sig_atomic_t g_dumpRequested = 0;
+
+void OnDumpSignal(int)
 {
-    return s;
+    g_dumpRequested = 1;
 }
 #endif
 
-bool GetLine(std::string &line, FILE *fp)
+// Parses a decimal number, or a hexadecimal one if prefixed with "0x". Unlike strtol(..., 0), a leading zero does not mean octal.
+// *endp is s if there are no digits, including when a sign or whitespace comes first.
+long ParseDecimalOrHex(const char *s, char **endp)
 {
-    line.clear();
-    for (;;) {
-        char buf[1024];
-        bool eof = !fgets(buf, sizeof(buf), fp);
-        if (!eof) {
-            line += buf;
-            if (line.empty() || line.back() != '\n') {
+    bool isHex = s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+    unsigned char c = s[isHex ? 2 : 0];
+    if (!(isHex ? isxdigit(c) : isdigit(c)) || (isHex && c == '0' && (s[3] == 'x' || s[3] == 'X'))) {
+        // strtol() would accept a sign, whitespace or (with base 16) another prefix
+        *endp = const_cast<char *>(s);
+        return 0;
+    }
+    return strtol(s + (isHex ? 2 : 0), endp, isHex ? 16 : 10);
+}
+
+int ReadInput(uint8_t *buf, int size, FILE *fp, bool partial)
+{
+    if (!partial) {
+        return static_cast<int>(fread(buf, 1, size, fp));
+    }
+    // Return as soon as some data is available
+#ifdef _WIN32
+    int n = _read(_fileno(fp), buf, size);
+#else
+    ssize_t n;
+    do {
+        n = read(fileno(fp), buf, size);
+    }
+    while (n < 0 && errno == EINTR);
+#endif
+    return n < 0 ? 0 : static_cast<int>(n);
+}
+
+// Reads the input (through uringReader if open) and forwards it unchanged to fpPass (if not null). Returns -1 if forwarding failed.
+int ReadAndForwardInput(uint8_t *buf, int size, FILE *fp, bool partial, FILE *fpPass, bool pipeTee, CUringReader &uringReader)
+{
+#ifdef __linux__
+    if (pipeTee) {
+        // Duplicate the data on the input pipe inside the kernel and then consume it
+        ssize_t n;
+        do {
+            n = tee(fileno(fp), fileno(fpPass), size, 0);
+        }
+        while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return -1;
+        }
+        int count = 0;
+        while (count < n) {
+            ssize_t m = read(fileno(fp), buf + count, n - count);
+            if (m < 0 && errno == EINTR) {
                 continue;
             }
+            if (m <= 0) {
+                return -1;
+            }
+            count += static_cast<int>(m);
+        }
+        return count;
+    }
+#else
+    static_cast<void>(pipeTee);
+#endif
+    int n = uringReader.IsOpen() ? uringReader.Read(buf, size) : ReadInput(buf, size, fp, partial);
+    if (fpPass && n > 0) {
+        if (fwrite(buf, 1, n, fpPass) != static_cast<size_t>(n) || (partial && fflush(fpPass) != 0)) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// Waits for a file being recorded to grow
+class CFileFollower
+{
+public:
+    CFileFollower() : m_timeoutMsec(0), m_waiting(false), m_backoffMsec(0), m_inotifyFd(-1) {}
+    ~CFileFollower()
+    {
+#ifdef __linux__
+        if (m_inotifyFd >= 0) {
+            close(m_inotifyFd);
+        }
+#endif
+    }
+#ifdef _WIN32
+    void Start(const wchar_t *name, int timeoutMsec)
+    {
+        static_cast<void>(name);
+        m_timeoutMsec = timeoutMsec;
+    }
+#else
+    void Start(const char *name, int timeoutMsec)
+    {
+        m_timeoutMsec = timeoutMsec;
+#ifdef __linux__
+        m_inotifyFd = inotify_init1(IN_CLOEXEC);
+        if (m_inotifyFd >= 0 && inotify_add_watch(m_inotifyFd, name, IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            // Fall back to polling
+            close(m_inotifyFd);
+            m_inotifyFd = -1;
         }
-        if (!line.empty() && line.back() == '\n') {
-            line.pop_back();
+#else
+        static_cast<void>(name);
+#endif
+    }
+#endif
+    bool IsEnabled() const { return m_timeoutMsec > 0; }
+    void Reset() { m_waiting = false; }
+
+    // Returns false if no data is appended for the timeout.
+    // The writer closing the file is not the end, since a recorder may reopen it to append.
+    bool Wait()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (!m_waiting) {
+            m_waiting = true;
+            m_idleTime = now;
+            m_backoffMsec = 10;
         }
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+        int remainingMsec = m_timeoutMsec - static_cast<int>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - m_idleTime).count());
+        if (remainingMsec <= 0) {
+            return false;
         }
-        return eof;
+#ifdef __linux__
+        if (m_inotifyFd >= 0) {
+            struct pollfd pfd = {};
+            pfd.fd = m_inotifyFd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, remainingMsec) > 0) {
+                // Any event wakes up to read what has been written
+                alignas(struct inotify_event) char buf[4096];
+                static_cast<void>(read(m_inotifyFd, buf, sizeof(buf)));
+            }
+            return true;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::min(m_backoffMsec, remainingMsec)));
+        m_backoffMsec = std::min(m_backoffMsec * 2, 500);
+        return true;
+    }
+
+private:
+    int m_timeoutMsec;
+    bool m_waiting;
+    int m_backoffMsec;
+    int m_inotifyFd;
+    std::chrono::steady_clock::time_point m_idleTime;
+};
+
+const uint8_t CHECKPOINT_MAGIC[8] = {0x50, 0x73, 0x73, 0x63, 0x43, 0x6b, 0x70, 0x74};
+
+#ifdef _WIN32
+bool ReadCheckpoint(const wchar_t *name, std::vector<uint8_t> &checkpoint)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> fp(_wfopen(name, L"rb"), fclose);
+#else
+bool ReadCheckpoint(const char *name, std::vector<uint8_t> &checkpoint)
+{
+    std::unique_ptr<FILE, decltype(&fclose)> fp(fopen(name, "r"), fclose);
+#endif
+    checkpoint.clear();
+    if (!fp) {
+        return false;
+    }
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp.get())) != 0) {
+        checkpoint.insert(checkpoint.end(), buf, buf + n);
     }
+    return true;
+}
+
+#ifdef _WIN32
+bool WriteCheckpoint(const wchar_t *name, const std::vector<uint8_t> &checkpoint)
+{
+    // Replace atomically
+    std::wstring tmpName = std::wstring(name) + L".tmp";
+    FILE *fp = _wfopen(tmpName.c_str(), L"wb");
+#else
+bool WriteCheckpoint(const char *name, const std::vector<uint8_t> &checkpoint)
+{
+    // Replace atomically
+    std::string tmpName = std::string(name) + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "w");
+#endif
+    if (!fp) {
+        return false;
+    }
+    // On the disk before it replaces the old one, so that a power loss leaves either of them
+    bool ret = fwrite(checkpoint.data(), 1, checkpoint.size(), fp) == checkpoint.size() && SyncFile(fp);
+    ret = fclose(fp) == 0 && ret;
+#ifdef _WIN32
+    return ret && MoveFileExW(tmpName.c_str(), name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) && SyncDirectoryOf(name);
+#else
+    return ret && rename(tmpName.c_str(), name) == 0 && SyncDirectoryOf(name);
+#endif
 }
 
 bool IsMatchChapterNamePattern(const std::string &s, const std::string &pattern)
@@ -161,6 +370,251 @@ std::vector<int> CreateCutListFromOgmStyleChapter(std::string staPattern, std::s
     }
     return cutList;
 }
+
+// Reads packets from pos and returns the first PCR of pcrPid, or -1 if it is not found soon. pcrPos is the position of the packet.
+int64_t ReadPcrFrom(FILE *fp, int64_t pos, int pcrPid, int unitSize, int64_t &pcrPos, std::vector<uint8_t> &buf)
+{
+    // Longer than any PCR interval
+    static const int64_t PCR_SEARCH_SIZE = 4 * 1024 * 1024;
+    if (!SeekFile(fp, pos)) {
+        return -1;
+    }
+    int bufCount = 0;
+    for (int64_t bufBegin = pos; bufBegin - pos < PCR_SEARCH_SIZE;) {
+        int n = static_cast<int>(fread(buf.data() + bufCount, 1, buf.size() - bufCount, fp));
+        bufCount += n;
+        int bufPos = 0;
+        for (; find_ts_packet(buf.data(), bufCount, &bufPos, &unitSize, n == 0, nullptr); bufPos += unitSize) {
+            const uint8_t *packet = buf.data() + bufPos;
+            int64_t pcr = extract_ts_header_pid(packet) == pcrPid ? extract_ts_header_pcr(packet) : -1;
+            if (pcr >= 0) {
+                pcrPos = bufBegin + bufPos;
+                return pcr;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        std::copy(buf.begin() + bufPos, buf.begin() + bufCount, buf.begin());
+        bufCount -= bufPos;
+        bufBegin += bufPos;
+    }
+    return -1;
+}
+
+// Finds where to continue reading to skip a cut region by bisecting the file between pos and fileSize with PCR samples.
+// pcr is the PCR at pos and pcrMsec its time on the cut list, and endMsec is the end of the region. Returns the position of a
+// packet whose PCR is a little before endMsec, so that PAT, PMT and other tables are received again before the end, or pos if
+// the PCR cannot locate the time (e.g. it goes back) or the region is too short to skip.
+int64_t FindCutEndPosition(FILE *fp, int64_t pos, int64_t fileSize, int pcrPid, int unitSize, int64_t pcr, int pcrMsec, int endMsec,
+                           std::vector<uint8_t> &buf)
+{
+    static const int SEEK_MARGIN_MSEC = 3000;
+    // Reading this much is cheaper than bisecting further
+    static const int64_t SEEK_PRECISION = 4 * 1024 * 1024;
+    int targetMsec = endMsec - SEEK_MARGIN_MSEC;
+    int64_t lo = pos;
+    int64_t loPcr = pcr;
+    int loMsec = pcrMsec;
+    int64_t hi = fileSize;
+    int hiMsec = -1;
+    while (loMsec < targetMsec && hi - lo > SEEK_PRECISION) {
+        int64_t guess = lo + (hi - lo) / 2;
+        if (hiMsec > loMsec) {
+            // Assume a constant bitrate
+            guess = lo + static_cast<int64_t>((hi - lo) * (static_cast<double>(targetMsec - loMsec) / (hiMsec - loMsec)));
+        }
+        // Narrow the range by at least 1/16 and stay on the packet boundaries
+        guess = std::min(std::max(guess, lo + (hi - lo) / 16), hi - (hi - lo) / 16);
+        guess = lo + (guess - lo) / unitSize * unitSize;
+        int64_t pcrPos;
+        int64_t nextPcr = ReadPcrFrom(fp, guess, pcrPid, unitSize, pcrPos, buf);
+        if (nextPcr < 0 || pcrPos >= hi) {
+            hi = guess;
+            hiMsec = -1;
+            continue;
+        }
+        int64_t diff = (0x200000000 + nextPcr - loPcr) & 0x1ffffffff;
+        int msec = loMsec + static_cast<int>(diff / 90);
+        if (diff >= 0x100000000 || (hiMsec >= 0 && msec > hiMsec)) {
+            // Not monotonic
+            return pos;
+        }
+        if (msec < targetMsec) {
+            lo = pcrPos;
+            loPcr = nextPcr;
+            loMsec = msec;
+        }
+        else {
+            hi = guess;
+            hiMsec = msec;
+        }
+    }
+    return lo - pos >= SEEK_PRECISION ? lo : pos;
+}
+
+struct RUN_STATS
+{
+    int64_t packetCount;
+    int64_t resyncCount;
+    int64_t droppedBytes;
+    int64_t discontinuityCount;
+    // Cut regions skipped by seeking
+    int64_t seekCount;
+    int64_t skippedBytes;
+    // Keyed by (pid << 8 | table_id)
+    std::map<int, int64_t> sectionCounts;
+    // Including waits for input
+    double readSec;
+    // Extracting sections from the data read and archiving them, including CPsiArchiver::STATS::flushSec.
+    // The "extract" time printed is this minus flushSec.
+    double processSec;
+    // -1 if not seen yet
+    int lastCounter[8192];
+};
+
+void CountPacket(RUN_STATS &stats, const uint8_t *packet)
+{
+    ++stats.packetCount;
+    int pid = extract_ts_header_pid(packet);
+    int adaptation = extract_ts_header_adaptation(packet);
+    int counter = extract_ts_header_counter(packet);
+    if (pid == 0x1fff) {
+        return;
+    }
+    // Ignore if discontinuity_indicator is set
+    bool discontinuity = (adaptation & 2) && packet[4] > 0 && (packet[5] & 0x80);
+    if (stats.lastCounter[pid] >= 0 && !discontinuity) {
+        // The counter does not increment without payload, and a packet may be duplicated once
+        int expected = (adaptation & 1) ? (stats.lastCounter[pid] + 1) & 0x0f : stats.lastCounter[pid];
+        if (counter != expected && !((adaptation & 1) && counter == stats.lastCounter[pid])) {
+            ++stats.discontinuityCount;
+        }
+    }
+    stats.lastCounter[pid] = counter;
+}
+
+void UpdateMetrics(CMetricsServer::METRICS &metrics, const RUN_STATS &stats, const CPsiArchiver &psiArchiver)
+{
+    metrics.packetCount.store(stats.packetCount, std::memory_order_relaxed);
+    metrics.continuityErrorCount.store(stats.discontinuityCount, std::memory_order_relaxed);
+    metrics.sectionCount.store(psiArchiver.GetStats().sectionCount, std::memory_order_relaxed);
+    metrics.chunkCount.store(psiArchiver.GetStats().chunkCount, std::memory_order_relaxed);
+    metrics.writtenBytes.store(psiArchiver.GetWrittenSize(), std::memory_order_relaxed);
+    metrics.dictionaryBuffSize.store(psiArchiver.GetDictionaryBuffSize(), std::memory_order_relaxed);
+    metrics.dictionaryMaxBuffSize.store(psiArchiver.GetDictionaryMaxBuffSize(), std::memory_order_relaxed);
+}
+
+void PrintRunStats(FILE *fp, bool json, const RUN_STATS &stats, int64_t inputBytes, int unitSize, const CPsiArchiver &psiArchiver, double wallSec)
+{
+    const CPsiArchiver::STATS &as = psiArchiver.GetStats();
+    static const char *const FLUSH_REASON_NAMES[] = {"requested", "time_list_full", "dictionary_full", "buffer_limit", "interval"};
+    double hitRate = as.sectionCount > 0 ? static_cast<double>(as.hitCount + as.carriedOverCount) / as.sectionCount : 0;
+    double mbps = wallSec > 0 ? inputBytes / 1e6 / wallSec : 0;
+    if (json) {
+        fprintf(fp, "{\"input\":{\"bytes\":%lld,\"packets\":%lld,\"unit_size\":%d,\"resyncs\":%lld,\"dropped_bytes\":%lld,\"discontinuities\":%lld,"
+                    "\"seeks\":%lld,\"skipped_bytes\":%lld},\"sections\":[",
+                static_cast<long long>(inputBytes), static_cast<long long>(stats.packetCount), unitSize, static_cast<long long>(stats.resyncCount),
+                static_cast<long long>(stats.droppedBytes), static_cast<long long>(stats.discontinuityCount),
+                static_cast<long long>(stats.seekCount), static_cast<long long>(stats.skippedBytes));
+        for (auto it = stats.sectionCounts.cbegin(); it != stats.sectionCounts.end(); ++it) {
+            fprintf(fp, "%s{\"pid\":%d,\"table_id\":%d,\"count\":%lld}", it == stats.sectionCounts.begin() ? "" : ",",
+                    it->first >> 8, it->first & 0xff, static_cast<long long>(it->second));
+        }
+        fprintf(fp, "],\"archive\":{\"bytes\":%lld,\"chunks\":%lld,\"flush_reasons\":{",
+                static_cast<long long>(psiArchiver.GetWrittenSize()), static_cast<long long>(as.chunkCount));
+        for (int i = 0; i < CPsiArchiver::FLUSH_REASON_COUNT; ++i) {
+            fprintf(fp, "%s\"%s\":%lld", i == 0 ? "" : ",", FLUSH_REASON_NAMES[i], static_cast<long long>(as.flushCount[i]));
+        }
+        fprintf(fp, "},\"sections\":%lld,\"dictionary_hits\":%lld,\"carried_over_tokens\":%lld,\"new_tokens\":%lld,\"new_token_bytes\":%lld,"
+                    "\"resent_tokens\":%lld,\"external_tokens\":%lld,\"external_token_bytes\":%lld,\"hit_rate\":%.4f,\"peak_dictionary_bytes\":%lld},",
+                static_cast<long long>(as.sectionCount), static_cast<long long>(as.hitCount), static_cast<long long>(as.carriedOverCount),
+                static_cast<long long>(as.newTokenCount), static_cast<long long>(as.newTokenBytes), static_cast<long long>(as.resentTokenCount),
+                static_cast<long long>(as.externalTokenCount), static_cast<long long>(as.externalTokenBytes), hitRate, static_cast<long long>(as.peakDictionaryBuffSize));
+        fprintf(fp, "\"time\":{\"read_sec\":%.3f,\"extract_sec\":%.3f,\"flush_sec\":%.3f,\"wall_sec\":%.3f,\"mb_per_sec\":%.1f}}\n",
+                stats.readSec, stats.processSec - as.flushSec, as.flushSec, wallSec, mbps);
+        return;
+    }
+    fprintf(fp, "input: %lld bytes, %lld packets of %d bytes, %lld resyncs dropping %lld bytes, %lld discontinuities, %lld seeks skipping %lld bytes\n",
+            static_cast<long long>(inputBytes), static_cast<long long>(stats.packetCount), unitSize, static_cast<long long>(stats.resyncCount),
+            static_cast<long long>(stats.droppedBytes), static_cast<long long>(stats.discontinuityCount),
+            static_cast<long long>(stats.seekCount), static_cast<long long>(stats.skippedBytes));
+    for (auto it = stats.sectionCounts.cbegin(); it != stats.sectionCounts.end(); ++it) {
+        fprintf(fp, "sections: pid 0x%04x table_id 0x%02x: %lld\n", it->first >> 8, it->first & 0xff, static_cast<long long>(it->second));
+    }
+    fprintf(fp, "archive: %lld bytes, %lld chunks flushed by", static_cast<long long>(psiArchiver.GetWrittenSize()), static_cast<long long>(as.chunkCount));
+    for (int i = 0; i < CPsiArchiver::FLUSH_REASON_COUNT; ++i) {
+        fprintf(fp, " %s %lld%s", FLUSH_REASON_NAMES[i], static_cast<long long>(as.flushCount[i]), i + 1 < CPsiArchiver::FLUSH_REASON_COUNT ? "," : "\n");
+    }
+    fprintf(fp, "dictionary: %lld sections, %lld hits, %lld carried over, %lld new tokens (%lld bytes, %lld resent, %lld external of %lld bytes), "
+                "hit rate %.3f, peak %lld bytes\n",
+            static_cast<long long>(as.sectionCount), static_cast<long long>(as.hitCount), static_cast<long long>(as.carriedOverCount),
+            static_cast<long long>(as.newTokenCount), static_cast<long long>(as.newTokenBytes), static_cast<long long>(as.resentTokenCount),
+            static_cast<long long>(as.externalTokenCount), static_cast<long long>(as.externalTokenBytes), hitRate, static_cast<long long>(as.peakDictionaryBuffSize));
+    fprintf(fp, "time: read %.3f sec, extract %.3f sec, flush %.3f sec, wall %.3f sec, %.1f MB/s\n",
+            stats.readSec, stats.processSec - as.flushSec, as.flushSec, wallSec, mbps);
+}
+
+// What the command line uses, for OPTION_CONFLICTS
+enum OPTION_USE
+{
+    USE_BATCH = 1 << 0,
+    USE_INPUT_LIST = 1 << 1,
+    USE_INSPECT = 1 << 2,
+    USE_REMUX = 1 << 3,
+    USE_ARCHIVE_CONCAT = 1 << 4,
+    USE_REHYDRATE = 1 << 5,
+    USE_PARALLEL = 1 << 6,
+    USE_PARALLEL_WORKERS = 1 << 7,
+    USE_SRC_STDIN = 1 << 8,
+    USE_SRC_UDP = 1 << 9,
+    USE_SRC_LIST = 1 << 10,
+    USE_DEST_STDOUT = 1 << 11,
+    USE_J = 1 << 12,
+    USE_L = 1 << 13,
+    USE_F = 1 << 14,
+    USE_K = 1 << 15,
+    USE_O = 1 << 16,
+    USE_O_STDOUT = 1 << 17,
+    USE_M = 1 << 18,
+    USE_G = 1 << 19,
+    USE_T = 1 << 20,
+    USE_W = 1 << 21,
+    USE_STATS = 1 << 22,
+    USE_METRICS = 1 << 23,
+    USE_URING = 1 << 24
+};
+
+// An error is reported if all of "uses" and any of "conflicts" are used. The first matching entry is reported.
+struct OPTION_CONFLICT
+{
+    int uses;
+    int conflicts;
+    const char *message;
+};
+
+const OPTION_CONFLICT OPTION_CONFLICTS[] = {
+    {USE_BATCH, USE_L | USE_F | USE_K | USE_O | USE_M | USE_G, "batch mode cannot be used with -l, -f, -k, -o, -m or -g"},
+    {USE_INPUT_LIST, USE_F | USE_K | USE_J, "input list cannot be used with -f, -k or -j"},
+    {USE_REMUX, USE_INSPECT | USE_SRC_UDP | USE_SRC_LIST | USE_J | USE_K | USE_O | USE_M | USE_G,
+     "remuxing needs an archive src and cannot be used with -a, -j, -k, -o, -m or -g"},
+    {USE_ARCHIVE_CONCAT, USE_INSPECT | USE_REMUX | USE_SRC_UDP | USE_J | USE_K | USE_O | USE_M | USE_G,
+     "archive concatenation cannot be used with -a, -d, -j, -k, -o, -m or -g"},
+    {USE_REHYDRATE, USE_INSPECT | USE_REMUX | USE_ARCHIVE_CONCAT | USE_SRC_UDP | USE_SRC_LIST | USE_J | USE_K | USE_O | USE_M | USE_G | USE_T,
+     "rehydrating needs an archive src and cannot be used with -a, -d, -q, -j, -k, -o, -m, -g or -T"},
+    {USE_T, USE_INSPECT | USE_REMUX | USE_ARCHIVE_CONCAT, "token store cannot be used with -a, -d or -q"},
+    {USE_PARALLEL, USE_SRC_STDIN | USE_SRC_UDP | USE_L | USE_F | USE_K | USE_O | USE_W,
+     "parallel archiving needs a src file and cannot be used with -l, -f, -k, -o or -w"},
+    {USE_STATS, USE_BATCH | USE_INSPECT | USE_REMUX | USE_ARCHIVE_CONCAT | USE_REHYDRATE | USE_PARALLEL_WORKERS,
+     "statistics cannot be used with batch mode, -a, -d, -q, -R or parallel archiving"},
+    {USE_METRICS, USE_BATCH | USE_INSPECT | USE_REMUX | USE_ARCHIVE_CONCAT | USE_REHYDRATE | USE_PARALLEL_WORKERS,
+     "metrics socket cannot be used with batch mode, -a, -d, -q, -R or parallel archiving"},
+    {USE_URING, USE_BATCH | USE_INSPECT | USE_REMUX | USE_ARCHIVE_CONCAT | USE_REHYDRATE | USE_PARALLEL_WORKERS,
+     "io_uring cannot be used with batch mode, -a, -d, -q, -R or parallel archiving"},
+    {USE_O_STDOUT, USE_DEST_STDOUT, "dest and passthrough cannot both be stdout"},
+    {USE_K, USE_SRC_STDIN | USE_SRC_UDP | USE_DEST_STDOUT | USE_L | USE_O | USE_G,
+     "checkpoint needs src and dest files and cannot be used with -l, -o or -g"},
+};
 }
 
 #ifdef _WIN32
@@ -171,16 +625,43 @@ int main(int argc, char **argv)
 {
     CPsiArchiver psiArchiver;
     CPsiExtractor psiExtractor;
+    int completionTimeout = -1;
+    int latencyMsec = 0;
+    int followTimeout = 0;
+    int workerCount = -1;
+    std::string inspectMode;
+    double remuxSpeed = -1;
+    std::string concatMode;
+    std::string statsFormat;
+    std::string metricsSocketName;
+    std::string ioBackend = "stdio";
     std::string staPattern = "^ix";
     std::string endPattern = "^ox";
+    size_t shmSize = 4096 * 1024;
+    size_t externalTokenMinSize = 256;
+    uint32_t writeInterval = 0;
+    int segmentDuration = 0;
+    int segmentRetentionCount = 0;
 #ifdef _WIN32
     const wchar_t *srcName = L"";
     const wchar_t *destName = L"";
     const wchar_t *chapterFileName = L"";
+    const wchar_t *checkpointName = L"";
+    const wchar_t *passThroughName = L"";
+    std::wstring shmName;
+    std::wstring playlistName;
+    std::wstring tokenStoreName;
+    std::wstring rehydrateStoreName;
 #else
     const char *srcName = "";
     const char *destName = "";
     const char *chapterFileName = "";
+    const char *checkpointName = "";
+    const char *passThroughName = "";
+    std::string shmName;
+    std::string playlistName;
+    std::string tokenStoreName;
+    std::string rehydrateStoreName;
 #endif
 
     for (int i = 1; i < argc; ++i) {
@@ -190,7 +671,7 @@ int main(int argc, char **argv)
             c = s[1];
         }
         if (c == 'h') {
-            fprintf(stderr, "Usage: psisiarc [-p pids][-n prog_num_or_index][-t stream_types][-r preset][-i interval][-b maxbuf_kbytes][-c chapter][-s pattern][-e pattern] src dest\n");
+            fprintf(stderr, "Usage: psisiarc [-p pids][-n prog_num_or_index][-t stream_types][-r preset][-i interval][-l latency][-f timeout][-w timeout][-b maxbuf_kbytes][-c chapter][-s pattern][-e pattern][-k checkpoint][-o passthrough][-m shm_name][-g segment][-x retention][-y playlist][-j workers][-a inspect][-d speed][-q concat][-v stats][-u metrics_socket][-z io][-T token_store][-R token_store] src dest\n");
             return 2;
         }
         bool invalid = false;
@@ -201,7 +682,22 @@ int main(int argc, char **argv)
                     char *endp;
                     int pid = static_cast<int>(strtol(s.c_str() + j, &endp, 10));
                     psiExtractor.AddTargetPid(pid);
-                    invalid = !(0 <= pid && pid <= 8191 && s.c_str() + j != endp && (!*endp || *endp == '/'));
+                    invalid = !(0 <= pid && pid <= 8191 && s.c_str() + j != endp);
+                    if (!invalid && *endp == ':') {
+                        // "pid:table_id" or "pid:table_id-table_id"
+                        const char *p = endp + 1;
+                        int tableIdFrom = static_cast<int>(ParseDecimalOrHex(p, &endp));
+                        int tableIdTo = tableIdFrom;
+                        invalid = p == endp;
+                        if (!invalid && *endp == '-') {
+                            p = endp + 1;
+                            tableIdTo = static_cast<int>(ParseDecimalOrHex(p, &endp));
+                            invalid = p == endp;
+                        }
+                        invalid = invalid || !(0 <= tableIdFrom && tableIdFrom <= tableIdTo && tableIdTo <= 255);
+                        psiExtractor.AddTargetTableIdRange(pid, tableIdFrom, tableIdTo);
+                    }
+                    invalid = invalid || !(!*endp || *endp == '/');
                     if (invalid || !*endp) {
                         break;
                     }
@@ -227,28 +723,30 @@ int main(int argc, char **argv)
                 }
             }
             else if (c == 'r') {
-                s = NativeToString(argv[++i]);
-                bool isAribData = s == "arib-data";
-                bool isAribEpg = s == "arib-epg";
-                if (isAribData || isAribEpg) {
-                    psiExtractor.SetProgramNumberOrIndex(-1);
-                    psiExtractor.AddTargetPid(17);
-                    psiExtractor.AddTargetPid(18);
-                    psiExtractor.AddTargetPid(20);
-                    psiExtractor.AddTargetPid(31);
-                    psiExtractor.AddTargetPid(36);
-                    if (isAribData) {
-                        psiExtractor.AddTargetStreamType(11);
-                        psiExtractor.AddTargetStreamType(12);
-                        psiExtractor.AddTargetStreamType(13);
-                    }
-                }
-                invalid = !isAribData && !isAribEpg;
+                invalid = !psiExtractor.AddPreset(NativeToString(argv[++i]).c_str());
             }
             else if (c == 'i') {
-                uint32_t interval = static_cast<uint32_t>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10) * 11250);
-                psiArchiver.SetWriteInterval(interval);
-                invalid = interval > 600 * 11250;
+                double sec = strtod(NativeToString(argv[++i]).c_str(), nullptr);
+                invalid = !(0 <= sec && sec <= 600);
+                if (!invalid) {
+                    // 1/11250 seconds resolution
+                    uint32_t interval = static_cast<uint32_t>(sec * 11250 + 0.5);
+                    writeInterval = sec > 0 ? std::max<uint32_t>(interval, 1) : 0;
+                    psiArchiver.SetWriteInterval(writeInterval);
+                }
+            }
+            else if (c == 'l') {
+                latencyMsec = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                invalid = !(0 <= latencyMsec && latencyMsec <= 60000);
+            }
+            else if (c == 'f') {
+                followTimeout = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                invalid = !(0 <= followTimeout && followTimeout <= 86400);
+            }
+            else if (c == 'w') {
+                completionTimeout = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                psiExtractor.SetCheckCompletion(completionTimeout >= 0);
+                invalid = !(-1 <= completionTimeout && completionTimeout <= 86400);
             }
             else if (c == 'b') {
                 size_t size = static_cast<size_t>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10) * 1024);
@@ -264,6 +762,84 @@ int main(int argc, char **argv)
             else if (c == 'e') {
                 endPattern = NativeToString(argv[++i]);
             }
+            else if (c == 'k') {
+                checkpointName = argv[++i];
+            }
+            else if (c == 'o') {
+                passThroughName = argv[++i];
+                invalid = !passThroughName[0];
+            }
+            else if (c == 'm') {
+                // "name" or "name:ring_kbytes"
+                shmName = argv[++i];
+                size_t colon = shmName.rfind(':');
+                if (colon != shmName.npos) {
+                    s = NativeToString(shmName.c_str() + colon + 1);
+                    char *endp;
+                    int kbytes = static_cast<int>(strtol(s.c_str(), &endp, 10));
+                    invalid = !(64 <= kbytes && kbytes <= 1024 * 1024) || *endp;
+                    shmSize = static_cast<size_t>(kbytes) * 1024;
+                    shmName.erase(colon);
+                }
+                invalid = invalid || shmName.empty();
+            }
+            else if (c == 'g') {
+                segmentDuration = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                invalid = !(0 <= segmentDuration && segmentDuration <= 86400);
+            }
+            else if (c == 'x') {
+                segmentRetentionCount = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                invalid = !(0 <= segmentRetentionCount && segmentRetentionCount <= 100000);
+            }
+            else if (c == 'y') {
+                playlistName = argv[++i];
+            }
+            else if (c == 'a') {
+                inspectMode = NativeToString(argv[++i]);
+                invalid = inspectMode != "verify" && inspectMode != "info";
+            }
+            else if (c == 'd') {
+                remuxSpeed = strtod(NativeToString(argv[++i]).c_str(), nullptr);
+                invalid = !(0 <= remuxSpeed && remuxSpeed <= 100);
+            }
+            else if (c == 'q') {
+                concatMode = NativeToString(argv[++i]);
+                invalid = concatMode != "copy" && concatMode != "link";
+            }
+            else if (c == 'v') {
+                statsFormat = NativeToString(argv[++i]);
+                invalid = statsFormat != "text" && statsFormat != "json";
+            }
+            else if (c == 'u') {
+                metricsSocketName = NativeToString(argv[++i]);
+                invalid = metricsSocketName.empty();
+            }
+            else if (c == 'z') {
+                ioBackend = NativeToString(argv[++i]);
+                invalid = ioBackend != "stdio" && ioBackend != "uring" && ioBackend != "uring_direct";
+            }
+            else if (c == 'T') {
+                // "dir" or "dir:min_bytes"
+                tokenStoreName = argv[++i];
+                size_t colon = tokenStoreName.rfind(':');
+                s = NativeToString(tokenStoreName.c_str() + (colon == tokenStoreName.npos ? 0 : colon + 1));
+                // The path itself may contain ':' like a drive letter
+                if (colon != tokenStoreName.npos && !s.empty() && s.find_first_not_of("0123456789") == std::string::npos) {
+                    int bytes = static_cast<int>(strtol(s.c_str(), nullptr, 10));
+                    invalid = !(64 <= bytes && bytes <= 4096);
+                    externalTokenMinSize = bytes;
+                    tokenStoreName.erase(colon);
+                }
+                invalid = invalid || tokenStoreName.empty();
+            }
+            else if (c == 'R') {
+                rehydrateStoreName = argv[++i];
+                invalid = rehydrateStoreName.empty();
+            }
+            else if (c == 'j') {
+                workerCount = static_cast<int>(strtol(NativeToString(argv[++i]).c_str(), nullptr, 10));
+                invalid = !(0 <= workerCount && workerCount <= 256);
+            }
         }
         else if (i < argc - 1) {
             srcName = argv[i];
@@ -282,15 +858,58 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: not enough arguments.\n");
         return 1;
     }
+    bool isInspect = !inspectMode.empty();
+    bool isRemux = remuxSpeed >= 0;
+    bool isArchiveConcat = !concatMode.empty();
+    bool isRehydrate = !rehydrateStoreName.empty();
+    bool isBatch = !isInspect && !isRemux && !isArchiveConcat && !isRehydrate && srcName[0] == '@';
+    bool isConcat = !isInspect && !isRemux && !isArchiveConcat && !isRehydrate && srcName[0] == '+';
+    bool isUdp = NativeToString(srcName).compare(0, 6, "udp://") == 0;
+    bool isParallel = !isBatch && !isInspect && !isArchiveConcat && workerCount >= 0;
+    if (isParallel && workerCount == 0) {
+        workerCount = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+    bool useUring = ioBackend != "stdio";
+    int uses = (isBatch ? USE_BATCH : 0) | (isConcat ? USE_INPUT_LIST : 0) | (isInspect ? USE_INSPECT : 0) | (isRemux ? USE_REMUX : 0) |
+               (isArchiveConcat ? USE_ARCHIVE_CONCAT : 0) | (isRehydrate ? USE_REHYDRATE : 0) | (isParallel ? USE_PARALLEL : 0) |
+               (workerCount >= 2 ? USE_PARALLEL_WORKERS : 0) | (srcName[0] == '-' && !srcName[1] ? USE_SRC_STDIN : 0) |
+               (isUdp ? USE_SRC_UDP : 0) | (srcName[0] == '@' || srcName[0] == '+' ? USE_SRC_LIST : 0) |
+               (destName[0] == '-' && !destName[1] ? USE_DEST_STDOUT : 0) | (workerCount >= 0 ? USE_J : 0) | (latencyMsec > 0 ? USE_L : 0) |
+               (followTimeout > 0 ? USE_F : 0) | (checkpointName[0] ? USE_K : 0) | (passThroughName[0] ? USE_O : 0) |
+               (passThroughName[0] == '-' && !passThroughName[1] ? USE_O_STDOUT : 0) | (!shmName.empty() ? USE_M : 0) |
+               (segmentDuration > 0 ? USE_G : 0) | (!tokenStoreName.empty() ? USE_T : 0) | (completionTimeout >= 0 ? USE_W : 0) |
+               (!statsFormat.empty() ? USE_STATS : 0) | (!metricsSocketName.empty() ? USE_METRICS : 0) | (useUring ? USE_URING : 0);
+    for (size_t i = 0; i < sizeof(OPTION_CONFLICTS) / sizeof(OPTION_CONFLICTS[0]); ++i) {
+        if ((uses & OPTION_CONFLICTS[i].uses) == OPTION_CONFLICTS[i].uses && (uses & OPTION_CONFLICTS[i].conflicts)) {
+            fprintf(stderr, "Error: %s.\n", OPTION_CONFLICTS[i].message);
+            return 1;
+        }
+    }
+    CSegmentWriter segmentWriter;
+    if (segmentDuration > 0) {
+        // Segments are made of whole chunks
+        if (writeInterval == 0 || writeInterval > static_cast<uint32_t>(segmentDuration) * 11250) {
+            fprintf(stderr, "Error: segmented output needs an interval not longer than the segment.\n");
+            return 1;
+        }
+        if (!segmentWriter.Open(destName, playlistName, segmentDuration * 11250, writeInterval, segmentRetentionCount)) {
+            fprintf(stderr, "Error: dest must contain a single %%d for segmented output.\n");
+            return 1;
+        }
+    }
 
-    struct
-    {
-        bool enabled;
-        int totalCutMsec;
-        long long initialPcr;
-        long long lastPcr;
-        std::vector<int> cutList;
-    } cutContext;
+    // Resume only with the same arguments
+    std::string commandLine;
+    for (int i = 1; i < argc; ++i) {
+        commandLine += NativeToString(argv[i]);
+        commandLine += '\0';
+    }
+    std::vector<uint8_t> checkpoint;
+    if (checkpointName[0]) {
+        ReadCheckpoint(checkpointName, checkpoint);
+    }
+
+    CUT_CONTEXT cutContext;
     cutContext.enabled = false;
     cutContext.totalCutMsec = 0;
     cutContext.initialPcr = -1;
@@ -313,11 +932,117 @@ int main(int argc, char **argv)
         }
     }
 
+    CTokenStore tokenStore;
+    if (!tokenStoreName.empty() || isRehydrate) {
+        if (!tokenStore.Open(isRehydrate ? rehydrateStoreName : tokenStoreName)) {
+            fprintf(stderr, "Error: cannot open token store.\n");
+            return 1;
+        }
+        if (!isRehydrate) {
+            // Shared by the workers of batch mode
+            psiArchiver.SetExternalTokenCallback(externalTokenMinSize, [&tokenStore](const uint8_t *hash, const uint8_t *token, size_t size) {
+                return tokenStore.Put(hash, token, size);
+            });
+        }
+    }
+
+    if (isBatch || isInspect) {
+        // dest receives the status of each file
+        std::unique_ptr<FILE, decltype(&fclose)> statusFile(nullptr, fclose);
+        if (destName[0] != '-' || destName[1]) {
+#ifdef _WIN32
+            statusFile.reset(_wfopen(destName, L"w"));
+#else
+            statusFile.reset(fopen(destName, "w"));
+#endif
+            if (!statusFile) {
+                fprintf(stderr, "Error: cannot create file.\n");
+                return 1;
+            }
+        }
+        if (workerCount <= 0) {
+            workerCount = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        }
+        if (isInspect) {
+            // An archive, "@list" or "@-" (stdin)
+            std::vector<NATIVE_STRING> names;
+            std::vector<std::string> lines;
+            if (srcName[0] != '@') {
+                names.push_back(srcName);
+            }
+            else if (!ReadList(srcName + 1, lines)) {
+                fprintf(stderr, "Error: cannot open archive list.\n");
+                return 1;
+            }
+            for (auto it = lines.cbegin(); it != lines.end(); ++it) {
+                names.push_back(Utf8ToNative(*it));
+            }
+            return InspectArchives(names, statusFile ? statusFile.get() : stdout, workerCount, inspectMode == "info");
+        }
+        // "@list" or "@-" (stdin)
+        return RunBatch(srcName + 1, statusFile ? statusFile.get() : stdout, workerCount, psiExtractor, psiArchiver, cutContext, completionTimeout);
+    }
+
+    if (isArchiveConcat) {
+        // An archive, "@list" or "@-" (stdin)
+        std::vector<NATIVE_STRING> names;
+        std::vector<std::string> lines;
+        if (srcName[0] != '@') {
+            names.push_back(srcName);
+        }
+        else if (!ReadList(srcName + 1, lines)) {
+            fprintf(stderr, "Error: cannot open archive list.\n");
+            return 1;
+        }
+        for (auto it = lines.cbegin(); it != lines.end(); ++it) {
+            names.push_back(Utf8ToNative(*it));
+        }
+        std::unique_ptr<FILE, decltype(&fclose)> destFile(nullptr, fclose);
+        if (destName[0] != '-' || destName[1]) {
+#ifdef _WIN32
+            destFile.reset(_wfopen(destName, L"wb"));
+#else
+            destFile.reset(fopen(destName, "w"));
+#endif
+            if (!destFile) {
+                fprintf(stderr, "Error: cannot create file.\n");
+                return 1;
+            }
+        }
+#ifdef _WIN32
+        else if (_setmode(_fileno(stdout), _O_BINARY) < 0) {
+            fprintf(stderr, "Error: _setmode.\n");
+            return 1;
+        }
+#endif
+        return ConcatArchives(names, destFile ? destFile.get() : stdout, concatMode == "link");
+    }
+
+    // Files of "+list" or "+-" (stdin), read in order as one stream
+    std::vector<NATIVE_STRING> srcNames;
+    size_t srcNameIndex = 1;
+    if (isConcat) {
+        std::vector<std::string> lines;
+        if (!ReadList(srcName + 1, lines)) {
+            fprintf(stderr, "Error: cannot open input list.\n");
+            return 1;
+        }
+        if (lines.empty()) {
+            fprintf(stderr, "Error: input list is empty.\n");
+            return 1;
+        }
+        for (auto it = lines.cbegin(); it != lines.end(); ++it) {
+            srcNames.push_back(Utf8ToNative(*it));
+        }
+        srcName = srcNames[0].c_str();
+    }
+
     std::unique_ptr<FILE, decltype(&fclose)> srcFile(nullptr, fclose);
     std::unique_ptr<FILE, decltype(&fclose)> destFile(nullptr, fclose);
+    std::unique_ptr<FILE, decltype(&fclose)> passThroughFile(nullptr, fclose);
 
 #ifdef _WIN32
-    if (srcName[0] != L'-' || srcName[1]) {
+    if (!isUdp && (srcName[0] != L'-' || srcName[1])) {
         srcFile.reset(_wfopen(srcName, L"rbS"));
         if (!srcFile) {
             fprintf(stderr, "Error: cannot open file.\n");
@@ -328,8 +1053,8 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: _setmode.\n");
         return 1;
     }
-    if (destName[0] != L'-' || destName[1]) {
-        destFile.reset(_wfopen(destName, L"wb"));
+    if (segmentDuration == 0 && (destName[0] != L'-' || destName[1])) {
+        destFile.reset(_wfopen(destName, checkpoint.empty() ? L"wb" : L"r+b"));
         if (!destFile) {
             fprintf(stderr, "Error: cannot create file.\n");
             return 1;
@@ -339,79 +1064,539 @@ int main(int argc, char **argv)
         fprintf(stderr, "Error: _setmode.\n");
         return 1;
     }
+    if (passThroughName[0] && (passThroughName[0] != L'-' || passThroughName[1])) {
+        passThroughFile.reset(_wfopen(passThroughName, L"wb"));
+        if (!passThroughFile) {
+            fprintf(stderr, "Error: cannot create passthrough file.\n");
+            return 1;
+        }
+    }
+    else if (passThroughName[0] && _setmode(_fileno(stdout), _O_BINARY) < 0) {
+        fprintf(stderr, "Error: _setmode.\n");
+        return 1;
+    }
 #else
-    if (srcName[0] != '-' || srcName[1]) {
+    if (!isUdp && (srcName[0] != '-' || srcName[1])) {
         srcFile.reset(fopen(srcName, "r"));
         if (!srcFile) {
             fprintf(stderr, "Error: cannot open file.\n");
             return 1;
         }
     }
-    if (destName[0] != '-' || destName[1]) {
-        destFile.reset(fopen(destName, "w"));
+    if (segmentDuration == 0 && (destName[0] != '-' || destName[1])) {
+        destFile.reset(fopen(destName, checkpoint.empty() ? "w" : "r+"));
         if (!destFile) {
             fprintf(stderr, "Error: cannot create file.\n");
             return 1;
         }
     }
+    if (passThroughName[0] && (passThroughName[0] != '-' || passThroughName[1])) {
+        passThroughFile.reset(fopen(passThroughName, "w"));
+        if (!passThroughFile) {
+            fprintf(stderr, "Error: cannot create passthrough file.\n");
+            return 1;
+        }
+    }
 #endif
 
-    psiArchiver.SetFile(destFile ? destFile.get() : stdout);
+    if (isRemux) {
+        return RemuxArchive(srcFile ? srcFile.get() : stdin, destFile ? destFile.get() : stdout, remuxSpeed);
+    }
+    if (isRehydrate) {
+        return RehydrateArchive(srcFile ? srcFile.get() : stdin, destFile ? destFile.get() : stdout, tokenStore);
+    }
+
+    int64_t srcReadSize = 0;
+    int unitSize = 0;
+    int64_t completionInitialPcr = -1;
+    if (!checkpoint.empty()) {
+        // Resume from the checkpoint
+        STATE_READER r = {checkpoint.data(), checkpoint.data() + checkpoint.size(), 0};
+        bool invalid = checkpoint.size() < sizeof(CHECKPOINT_MAGIC) + 8 ||
+                       !std::equal(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC), checkpoint.begin());
+        if (!invalid) {
+            r.p += sizeof(CHECKPOINT_MAGIC);
+            r.end -= 8;
+            STATE_READER rCrc = {r.end, r.end + 8, 0};
+            invalid = static_cast<uint32_t>(get_state_int(&rCrc)) != calc_crc32(checkpoint.data(), static_cast<int>(checkpoint.size() - 8));
+        }
+        size_t size = 0;
+        const uint8_t *data = invalid ? nullptr : get_state_data(&r, &size);
+        invalid = invalid || size != commandLine.size() || !std::equal(data, data + size, commandLine.begin());
+        if (invalid) {
+            fprintf(stderr, "Error: checkpoint is broken or made with other arguments.\n");
+            return 1;
+        }
+        srcReadSize = get_state_int(&r);
+        unitSize = static_cast<int>(get_state_int(&r));
+        completionInitialPcr = get_state_int(&r);
+        cutContext.totalCutMsec = static_cast<int>(get_state_int(&r));
+        cutContext.initialPcr = get_state_int(&r);
+        cutContext.lastPcr = get_state_int(&r);
+        cutContext.cutList.clear();
+        for (int64_t n = get_state_int(&r); n > 0 && !r.failed; --n) {
+            cutContext.cutList.push_back(static_cast<int>(get_state_int(&r)));
+        }
+        if (!psiExtractor.LoadState(r) || !psiArchiver.LoadState(r)) {
+            fprintf(stderr, "Error: checkpoint is broken.\n");
+            return 1;
+        }
+        // Discard the incomplete chunk and go back to the input position
+#ifdef _WIN32
+        invalid = _fseeki64(destFile.get(), 0, SEEK_END) != 0 ||
+                  _ftelli64(destFile.get()) < psiArchiver.GetWrittenSize() ||
+                  _chsize_s(_fileno(destFile.get()), psiArchiver.GetWrittenSize()) != 0 ||
+                  _fseeki64(destFile.get(), psiArchiver.GetWrittenSize(), SEEK_SET) != 0 ||
+                  _fseeki64(srcFile.get(), srcReadSize, SEEK_SET) != 0;
+#else
+        invalid = fseeko(destFile.get(), 0, SEEK_END) != 0 ||
+                  ftello(destFile.get()) < psiArchiver.GetWrittenSize() ||
+                  ftruncate(fileno(destFile.get()), psiArchiver.GetWrittenSize()) != 0 ||
+                  fseeko(destFile.get(), psiArchiver.GetWrittenSize(), SEEK_SET) != 0 ||
+                  fseeko(srcFile.get(), srcReadSize, SEEK_SET) != 0;
+#endif
+        if (invalid) {
+            fprintf(stderr, "Error: cannot resume from checkpoint.\n");
+            return 1;
+        }
+        fprintf(stderr, "Resuming from input offset %lld.\n", static_cast<long long>(srcReadSize));
+    }
+    auto checkpointTime = std::chrono::steady_clock::now();
+
+    // Measured for live output (-i or -l) or along with the stats or metrics, and dumped on SIGUSR1.
+    // It costs a clock read per section and per write.
+#ifdef _WIN32
+    bool measureLatency = false;
+#else
+    bool measureLatency = writeInterval > 0 || latencyMsec > 0 || !statsFormat.empty() || !metricsSocketName.empty();
+#endif
+    CLatencyHistogram sectionLatency;
+    CLatencyHistogram flushLatency;
+    CSectionLatencyTracker sectionTracker(sectionLatency);
+    CAsyncWriter asyncWriter;
+    CUringWriter uringWriter;
+    if (segmentDuration > 0) {
+        psiArchiver.SetWriteCallback([&segmentWriter, &sectionTracker, measureLatency](const uint8_t *buf, size_t size) {
+            if (!segmentWriter.Write(buf, size)) {
+                return false;
+            }
+            if (measureLatency) {
+                sectionTracker.Written(size);
+            }
+            return true;
+        });
+    }
+    else if (latencyMsec > 0) {
+        // Never block on writing
+        if (measureLatency) {
+            asyncWriter.SetWrittenCallback([&sectionTracker](size_t size) { sectionTracker.Written(size); });
+        }
+        asyncWriter.Start(destFile ? destFile.get() : stdout);
+        psiArchiver.SetWriteCallback([&asyncWriter](const uint8_t *buf, size_t size) { return asyncWriter.Write(buf, size); });
+    }
+    else if (useUring && destFile && uringWriter.Open(destFile.get())) {
+        // Chunks are written while the next ones are being made
+        if (measureLatency) {
+            uringWriter.SetWrittenCallback([&sectionTracker](size_t size) { sectionTracker.Written(size); });
+        }
+        psiArchiver.SetWriteCallback([&uringWriter](const uint8_t *buf, size_t size) { return uringWriter.Write(buf, size); });
+    }
+    else {
+        if (useUring) {
+            fprintf(stderr, "Warning: cannot use io_uring for dest, falling back to stdio.\n");
+        }
+        psiArchiver.SetFile(destFile ? destFile.get() : stdout);
+    }
+    CShmRingWriter shmRing;
+    if (!shmName.empty()) {
+        if (!shmRing.Open(shmName.c_str(), shmSize)) {
+            fprintf(stderr, "Error: cannot create shared memory.\n");
+            return 1;
+        }
+    }
+    if (shmRing.IsOpen() || segmentDuration > 0) {
+        psiArchiver.SetChunkCallback([&shmRing, &segmentWriter, segmentDuration](const uint8_t *chunk, size_t size,
+                                                                                  uint32_t firstTime, uint32_t lastTime, bool independent) {
+            if (shmRing.IsOpen() && !shmRing.Publish(chunk, size, firstTime, lastTime, independent)) {
+                fprintf(stderr, "Warning: chunk is larger than the shared memory ring and skipped.\n");
+            }
+            return segmentDuration > 0 && segmentWriter.EndChunk(firstTime, lastTime);
+        });
+    }
+    if (!isBatch && workerCount >= 2) {
+        // Extract sections on worker threads
+        if (!ArchiveFileInParallel(srcName, srcFile.get(), workerCount, psiExtractor, psiArchiver, cutContext) || !psiArchiver.Flush()) {
+            return 1;
+        }
+        if (segmentDuration > 0 && !segmentWriter.Close()) {
+            fprintf(stderr, "Error: cannot finish segments.\n");
+            return 1;
+        }
+        return 0;
+    }
     FILE *fpSrc = srcFile ? srcFile.get() : stdin;
+    CUdpReceiver udpReceiver;
+    if (isUdp) {
+        if (!udpReceiver.Open(NativeToString(srcName).c_str())) {
+            fprintf(stderr, "Error: cannot open udp source.\n");
+            return 1;
+        }
+        // Datagrams carry whole packets
+        unitSize = 188;
+        // Live input has no end, so finish the archive on these signals
+        signal(SIGINT, OnStopSignal);
+        signal(SIGTERM, OnStopSignal);
+    }
+#ifndef _WIN32
+    if (measureLatency) {
+        psiArchiver.SetLatencyHistograms(&sectionTracker, &flushLatency);
+        signal(SIGUSR1, OnDumpSignal);
+    }
+#endif
+    FILE *fpPass = passThroughFile ? passThroughFile.get() : passThroughName[0] ? stdout : nullptr;
+    bool pipeTee = false;
+#ifdef __linux__
+    if (fpPass && !isUdp && !isConcat) {
+        // Forward without copying if both ends are pipes
+        struct stat stSrc;
+        struct stat stPass;
+        pipeTee = fstat(fileno(fpSrc), &stSrc) == 0 && S_ISFIFO(stSrc.st_mode) &&
+                  fstat(fileno(fpPass), &stPass) == 0 && S_ISFIFO(stPass.st_mode);
+    }
+#endif
+    CFileFollower fileFollower;
+    if (followTimeout > 0 && srcFile) {
+        fileFollower.Start(srcName, followTimeout * 1000);
+    }
+    CUringReader uringReader;
+    std::string directPath = NativeToString(srcName);
+    if (useUring && !isUdp) {
+        // A growing file is read by stdio to follow it
+        if (!srcFile || followTimeout > 0 || pipeTee ||
+            !uringReader.Open(srcFile.get(), ioBackend == "uring_direct" ? directPath.c_str() : nullptr)) {
+            fprintf(stderr, "Warning: cannot use io_uring for src, falling back to stdio.\n");
+        }
+    }
+
+    bool collectStats = !statsFormat.empty();
+    RUN_STATS runStats = RUN_STATS();
+    std::fill_n(runStats.lastCounter, 8192, -1);
+    if (collectStats) {
+        psiArchiver.EnableStats();
+    }
+    CMetricsServer metricsServer;
+    if (!metricsSocketName.empty() && !metricsServer.Open(metricsSocketName.c_str())) {
+        fprintf(stderr, "Error: cannot open metrics socket.\n");
+        return 1;
+    }
+    // Continuity counters are checked for either
+    bool countPackets = collectStats || metricsServer.IsOpen();
+    int64_t lastPcr = -1;
+    auto runStartTime = std::chrono::steady_clock::now();
+
+    // Cut regions of a file are skipped instead of read. Everything must be read to forward or follow it.
+    bool seekCut = cutContext.enabled && srcFile && !isUdp && !fpPass && followTimeout <= 0 && !isConcat;
+    // The end of the cut region last tried, so that each region is bisected once
+    int seekCutEndMsec = -1;
+    std::vector<uint8_t> seekBuf;
 
     static uint8_t buf[65536];
     int bufCount = 0;
-    int unitSize = 0;
+    bool completed = false;
+    bool pending = false;
+    auto pendingTime = std::chrono::steady_clock::now();
+    auto udpIdleTime = std::chrono::steady_clock::now();
     for (;;) {
-        int n = static_cast<int>(fread(buf + bufCount, 1, sizeof(buf) - bufCount, fpSrc));
-        bufCount += n;
-        if (bufCount == sizeof(buf) || n == 0) {
-            int bufPos = resync_ts(buf, bufCount, &unitSize);
-            for (int i = bufPos; unitSize != 0 && i + unitSize <= bufCount; i += unitSize) {
-                bool writeFailed = false;
-                psiExtractor.AddPacket(buf + i, [&psiArchiver, &cutContext, &writeFailed](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
-                    if (!cutContext.enabled) {
-                        writeFailed = !psiArchiver.Add(pid, pcr, psiSize, psi);
-                        return;
-                    }
-                    if (cutContext.initialPcr < 0) {
-                        cutContext.initialPcr = cutContext.lastPcr = pcr;
-                    }
-                    // Check if PCR is valid and not go back.
-                    if (pcr < 0 || ((0x200000000 + pcr - cutContext.lastPcr) & 0x1ffffffff) >= 0x100000000) {
-                        return;
+        auto readStartTime = std::chrono::steady_clock::now();
+        int n;
+        if (isUdp) {
+            // Wake up regularly to check the deadline of pending sections and stop requests
+            auto now = std::chrono::steady_clock::now();
+            int timeout = 100;
+            if (pending) {
+                int elapsed = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - pendingTime).count());
+                timeout = std::max(std::min(latencyMsec - elapsed, timeout), 0);
+            }
+            n = udpReceiver.Receive(buf + bufCount, static_cast<int>(sizeof(buf)) - bufCount, timeout);
+            if (n < 0) {
+                fprintf(stderr, "Error: cannot receive udp source.\n");
+                return 1;
+            }
+            now = std::chrono::steady_clock::now();
+            if (n > 0) {
+                udpIdleTime = now;
+                if (fpPass && (fwrite(buf + bufCount, 1, n, fpPass) != static_cast<size_t>(n) || fflush(fpPass) != 0)) {
+                    n = -1;
+                }
+            }
+            else {
+                if (pending && now - pendingTime >= std::chrono::milliseconds(latencyMsec)) {
+                    if (!psiArchiver.Flush(true)) {
+                        return 1;
                     }
-                    cutContext.lastPcr = pcr;
-                    int pcrMsec = static_cast<int>(((0x200000000 + pcr - cutContext.initialPcr) & 0x1ffffffff) / 90);
-                    while (cutContext.cutList.size() >= 2 && cutContext.cutList[cutContext.cutList.size() - 2] <= pcrMsec) {
-                        cutContext.totalCutMsec += cutContext.cutList[cutContext.cutList.size() - 2] - cutContext.cutList.back();
-                        cutContext.cutList.pop_back();
-                        cutContext.cutList.pop_back();
+                    pending = false;
+                }
+                if (!g_stopRequested && !(followTimeout > 0 && now - udpIdleTime >= std::chrono::seconds(followTimeout))) {
+                    continue;
+                }
+            }
+        }
+        else {
+#ifndef _WIN32
+            if (pending) {
+                // Wait for input until the deadline of pending sections
+                struct pollfd pfd = {};
+                pfd.fd = fileno(fpSrc);
+                pfd.events = POLLIN;
+                int ret;
+                do {
+                    // Recomputed when interrupted by a signal
+                    int timeout = latencyMsec - static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                                     std::chrono::steady_clock::now() - pendingTime).count());
+                    ret = timeout <= 0 ? 0 : poll(&pfd, 1, timeout);
+                }
+                while (ret < 0 && errno == EINTR);
+                if (ret == 0) {
+                    if (!psiArchiver.Flush(true)) {
+                        return 1;
                     }
-                    if (cutContext.cutList.empty() || cutContext.cutList.back() > pcrMsec) {
-                        writeFailed = !psiArchiver.Add(pid, (0x200000000 + pcr - cutContext.totalCutMsec * 90) & 0x1ffffffff, psiSize, psi);
+                    pending = false;
+                }
+            }
+#endif
+            n = ReadAndForwardInput(buf + bufCount, static_cast<int>(sizeof(buf)) - bufCount, fpSrc, latencyMsec > 0, fpPass, pipeTee, uringReader);
+            for (; n == 0 && srcNameIndex < srcNames.size() && !uringReader.IsFailed(); ++srcNameIndex) {
+                // Continue with the next file as if it followed in the same stream. The rest of the buffer is kept.
+                bool reopenUring = uringReader.IsOpen();
+                uringReader.Close();
+#ifdef _WIN32
+                srcFile.reset(_wfopen(srcNames[srcNameIndex].c_str(), L"rbS"));
+#else
+                srcFile.reset(fopen(srcNames[srcNameIndex].c_str(), "r"));
+#endif
+                if (!srcFile) {
+                    fprintf(stderr, "Error: cannot open file.\n");
+                    return 1;
+                }
+                fpSrc = srcFile.get();
+                directPath = NativeToString(srcNames[srcNameIndex].c_str());
+                if (reopenUring && !uringReader.Open(fpSrc, ioBackend == "uring_direct" ? directPath.c_str() : nullptr)) {
+                    fprintf(stderr, "Warning: cannot use io_uring for src, falling back to stdio.\n");
+                }
+                n = ReadAndForwardInput(buf + bufCount, static_cast<int>(sizeof(buf)) - bufCount, fpSrc, latencyMsec > 0, fpPass, pipeTee, uringReader);
+            }
+        }
+        if (n < 0) {
+            fprintf(stderr, "Error: cannot write passthrough output.\n");
+            return 1;
+        }
+        bufCount += n;
+        srcReadSize += n;
+        if (n > 0) {
+            fileFollower.Reset();
+        }
+        auto processStartTime = std::chrono::steady_clock::now();
+        runStats.readSec += std::chrono::duration<double>(processStartTime - readStartTime).count();
+        if (isUdp || bufCount == sizeof(buf) || n == 0 || (latencyMsec > 0 && bufCount >= (unitSize != 0 ? unitSize : 8 * 204))) {
+            PSISIARC_PROBE2(ingest, bufCount, unitSize);
+            // A followed file may grow later
+            bool isFinal = n == 0 && !fileFollower.IsEnabled();
+            int bufPos = 0;
+            for (;; bufPos += unitSize) {
+                int droppedSize;
+                bool found = find_ts_packet(buf, bufCount, &bufPos, &unitSize, isFinal, &droppedSize) != 0;
+                if (collectStats && droppedSize > 0) {
+                    // Bytes out of sync are skipped
+                    ++runStats.resyncCount;
+                    runStats.droppedBytes += droppedSize;
+                }
+                if (!found) {
+                    break;
+                }
+                bool writeFailed = false;
+                if (countPackets) {
+                    CountPacket(runStats, buf + bufPos);
+                }
+                psiExtractor.AddPacket(buf + bufPos, [&psiArchiver, &cutContext, &writeFailed, collectStats, &runStats](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+                    PSISIARC_PROBE3(section, pid, psi[0], psiSize);
+                    if (collectStats) {
+                        ++runStats.sectionCounts[pid << 8 | psi[0]];
                     }
+                    writeFailed = !AddSection(psiArchiver, cutContext, pid, pcr, psiSize, psi) || writeFailed;
                 });
+                if (latencyMsec > 0 && !cutContext.enabled) {
+                    // Write even if no more sections arrive
+                    writeFailed = !psiArchiver.CheckWriteInterval(psiExtractor.GetPcr()) || writeFailed;
+                }
                 if (writeFailed) {
                     return 1;
                 }
+                if (completionTimeout >= 0) {
+                    // Stop reading when all tables are received or the time is up
+                    completed = CheckCompletion(psiExtractor, completionTimeout, completionInitialPcr);
+                    if (completed) {
+                        break;
+                    }
+                }
             }
-            if (n == 0) {
+            if (latencyMsec > 0) {
+                auto now = std::chrono::steady_clock::now();
+                if (psiArchiver.IsEmpty()) {
+                    pending = false;
+                }
+                else if (!pending) {
+                    pending = true;
+                    pendingTime = now;
+                }
+                else if (now - pendingTime >= std::chrono::milliseconds(latencyMsec)) {
+                    if (!psiArchiver.Flush(true)) {
+                        return 1;
+                    }
+                    pending = false;
+                }
+            }
+            runStats.processSec += std::chrono::duration<double>(std::chrono::steady_clock::now() - processStartTime).count();
+            if (metricsServer.IsOpen()) {
+                UpdateMetrics(metricsServer.GetMetrics(), runStats, psiArchiver);
+                if (psiExtractor.GetPcr() != lastPcr) {
+                    lastPcr = psiExtractor.GetPcr();
+                    metricsServer.GetMetrics().lastPcrTime.store(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(),
+                        std::memory_order_relaxed);
+                }
+            }
+#ifndef _WIN32
+            if (g_dumpRequested) {
+                g_dumpRequested = 0;
+                sectionLatency.Dump(stderr, "section_to_disk");
+                flushLatency.Dump(stderr, "flush");
+            }
+#endif
+            if (completed || g_stopRequested || (n == 0 && !(fileFollower.IsEnabled() && fileFollower.Wait()))) {
                 break;
             }
-            if (unitSize == 0) {
-                bufCount = 0;
+            if (n == 0) {
+                // The file may have grown
+                clearerr(fpSrc);
             }
-            else {
-                if ((bufPos != 0 || bufCount >= unitSize) && (bufCount - bufPos) % unitSize != 0) {
-                    std::copy(buf + bufPos + (bufCount - bufPos) / unitSize * unitSize, buf + bufCount, buf);
+            if (seekCut && unitSize != 0 && cutContext.initialPcr >= 0 && cutContext.cutList.size() >= 2 && psiExtractor.GetPcr() >= 0 &&
+                ((0x200000000 + psiExtractor.GetPcr() - cutContext.lastPcr) & 0x1ffffffff) < 0x100000000) {
+                int pcrMsec = static_cast<int>(((0x200000000 + psiExtractor.GetPcr() - cutContext.initialPcr) & 0x1ffffffff) / 90);
+                int endMsec = cutContext.cutList[cutContext.cutList.size() - 2];
+                if (cutContext.cutList.back() <= pcrMsec && pcrMsec < endMsec && endMsec != seekCutEndMsec) {
+                    // In a cut region
+                    seekCutEndMsec = endMsec;
+                    int64_t pos = srcReadSize - (bufCount - bufPos);
+                    int64_t fileSize = GetFileSize(fpSrc);
+                    int64_t seekPos = pos;
+                    if (fileSize < 0) {
+                        seekCut = false;
+                    }
+                    else {
+                        seekBuf.resize(sizeof(buf));
+                        seekPos = FindCutEndPosition(fpSrc, pos, fileSize, psiExtractor.GetPcrPid(), unitSize, psiExtractor.GetPcr(),
+                                                     pcrMsec, endMsec, seekBuf);
+                    }
+                    if (seekPos != pos) {
+                        // Jump there as if the packets between were lost
+                        bool reopenUring = uringReader.IsOpen();
+                        uringReader.Close();
+                        if (!SeekFile(fpSrc, seekPos)) {
+                            fprintf(stderr, "Error: cannot seek file.\n");
+                            return 1;
+                        }
+                        if (reopenUring && !uringReader.Open(fpSrc, ioBackend == "uring_direct" ? directPath.c_str() : nullptr)) {
+                            fprintf(stderr, "Warning: cannot use io_uring for src, falling back to stdio.\n");
+                        }
+                        psiExtractor.ResetContinuity();
+                        std::fill_n(runStats.lastCounter, 8192, -1);
+                        ++runStats.seekCount;
+                        runStats.skippedBytes += seekPos - pos;
+                        srcReadSize = seekPos;
+                        bufPos = bufCount;
+                    }
+                    else if (!uringReader.IsOpen() && !SeekFile(fpSrc, srcReadSize)) {
+                        fprintf(stderr, "Error: cannot seek file.\n");
+                        return 1;
+                    }
+                }
+            }
+            // Keep the rest for the next buffer
+            std::copy(buf + bufPos, buf + bufCount, buf);
+            bufCount -= bufPos;
+            if (checkpointName[0] && std::chrono::steady_clock::now() - checkpointTime >= std::chrono::seconds(10)) {
+                // Save the state at the beginning of the next buffer
+                checkpoint.assign(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC + sizeof(CHECKPOINT_MAGIC));
+                put_state_data(checkpoint, reinterpret_cast<const uint8_t *>(commandLine.data()), commandLine.size());
+                put_state_int(checkpoint, srcReadSize - bufCount);
+                put_state_int(checkpoint, unitSize);
+                put_state_int(checkpoint, completionInitialPcr);
+                put_state_int(checkpoint, cutContext.totalCutMsec);
+                put_state_int(checkpoint, cutContext.initialPcr);
+                put_state_int(checkpoint, cutContext.lastPcr);
+                put_state_int(checkpoint, cutContext.cutList.size());
+                for (size_t i = 0; i < cutContext.cutList.size(); ++i) {
+                    put_state_int(checkpoint, cutContext.cutList[i]);
+                }
+                psiExtractor.SaveState(checkpoint);
+                psiArchiver.SaveState(checkpoint);
+                put_state_int(checkpoint, calc_crc32(checkpoint.data(), static_cast<int>(checkpoint.size())));
+                // The archive must be on the disk up to the saved size before the checkpoint is
+                if (!uringWriter.Flush() || !SyncFile(destFile.get()) || !WriteCheckpoint(checkpointName, checkpoint)) {
+                    fprintf(stderr, "Error: cannot write checkpoint.\n");
+                    return 1;
                 }
-                bufCount = (bufCount - bufPos) % unitSize;
+                checkpointTime = std::chrono::steady_clock::now();
             }
         }
     }
-    if (!psiArchiver.Flush()) {
+    if (uringReader.IsFailed()) {
+        fprintf(stderr, "Error: cannot read file.\n");
+        return 1;
+    }
+    if (!psiArchiver.Flush() || !asyncWriter.Close() || !uringWriter.Close()) {
         return 1;
     }
+    if (segmentDuration > 0 && !segmentWriter.Close()) {
+        fprintf(stderr, "Error: cannot finish segments.\n");
+        return 1;
+    }
+    if (collectStats) {
+        PrintRunStats(stderr, statsFormat == "json", runStats, srcReadSize - runStats.skippedBytes, unitSize, psiArchiver,
+                      std::chrono::duration<double>(std::chrono::steady_clock::now() - runStartTime).count());
+    }
+    if (udpReceiver.GetLostCount() > 0) {
+        fprintf(stderr, "Warning: %lld RTP packets were lost.\n", udpReceiver.GetLostCount());
+    }
+    if (fpPass) {
+        if (completed && !isUdp) {
+            // Keep forwarding the rest of the input
+            for (;;) {
+                int n = ReadAndForwardInput(buf, static_cast<int>(sizeof(buf)), fpSrc, latencyMsec > 0, fpPass, pipeTee, uringReader);
+                if (n < 0) {
+                    fprintf(stderr, "Error: cannot write passthrough output.\n");
+                    return 1;
+                }
+                if (n == 0) {
+                    if (!(fileFollower.IsEnabled() && fileFollower.Wait())) {
+                        break;
+                    }
+                    clearerr(fpSrc);
+                }
+            }
+        }
+        if (fflush(fpPass) != 0) {
+            fprintf(stderr, "Error: cannot write passthrough output.\n");
+            return 1;
+        }
+    }
+    if (checkpointName[0]) {
+        // Completed
+#ifdef _WIN32
+        _wremove(checkpointName);
+#else
+        remove(checkpointName);
+#endif
+    }
     return 0;
 }
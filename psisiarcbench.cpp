@@ -0,0 +1,495 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "psiarchiver.hpp"
+#include "psiextractor.hpp"
+#include "util.hpp"
+
+namespace
+{
+// Archive of the default stream with "-r arib-data -i 1"
+const uint64_t GOLDEN_ARCHIVE_HASH = 0x33ab616c88094cfe;
+
+struct GENERATOR_PARAMS
+{
+    int seconds;
+    // Packets in each 100 msec step
+    int videoPacketCount;
+    int eitScheduleSize;
+    // In 100 msec steps
+    int eitScheduleInterval;
+    int carouselPidCount;
+    int carouselSize;
+    int carouselInterval;
+};
+
+struct SECTION_REF
+{
+    int pid;
+    int64_t pcr;
+    size_t pos;
+    size_t size;
+};
+
+// Makes an ISDB-like stream from a fixed seed, so that the same params always give the same bytes
+class CTsGenerator
+{
+public:
+    CTsGenerator(std::vector<uint8_t> &ts) : m_ts(ts), m_random(1) { std::fill_n(m_counter, 8192, 0); }
+    void Generate(const GENERATOR_PARAMS &params);
+
+private:
+    static std::vector<uint8_t> MakeSection(int tableId, int extension, int version, int sectionNumber, int lastSectionNumber,
+                                            const std::vector<uint8_t> &body);
+    void AddSection(int pid, const std::vector<uint8_t> &section);
+    void AddPcr(int pid, int64_t pcr);
+    void AddVideo(int pid);
+    uint8_t Random()
+    {
+        // xorshift32
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        return static_cast<uint8_t>(m_random);
+    }
+
+    std::vector<uint8_t> &m_ts;
+    uint8_t m_counter[8192];
+    uint32_t m_random;
+};
+
+void CTsGenerator::Generate(const GENERATOR_PARAMS &params)
+{
+    static const int PMT_PID = 0x1f0;
+    static const int PCR_PID = 0x1ff;
+    static const int VIDEO_PID = 0x100;
+    static const int CAROUSEL_PID = 0x740;
+
+    std::vector<uint8_t> body = {0x00, 0x00, 0xe0, 0x10, 0x04, 0x00, 0xe0 | PMT_PID >> 8, PMT_PID & 0xff};
+    std::vector<uint8_t> pat = MakeSection(0x00, 0x7fe0, 1, 0, 0, body);
+    body = {0xe0 | PCR_PID >> 8, PCR_PID & 0xff, 0xf0, 0x00, 0x02, 0xe0 | VIDEO_PID >> 8, VIDEO_PID & 0xff, 0xf0, 0x00};
+    for (int i = 0; i < params.carouselPidCount; ++i) {
+        // Data carousel
+        int pid = CAROUSEL_PID + i;
+        uint8_t es[] = {0x0d, static_cast<uint8_t>(0xe0 | pid >> 8), static_cast<uint8_t>(pid), 0xf0, 0x00};
+        body.insert(body.end(), es, es + 5);
+    }
+    std::vector<uint8_t> pmt = MakeSection(0x02, 0x0400, 3, 0, 0, body);
+    body = {0xf0, 0x00, 0xf0, 0x00};
+    std::vector<uint8_t> nit = MakeSection(0x40, 0x0004, 2, 0, 0, body);
+
+    int64_t pcr = 1000000;
+    for (int step = 0; step < params.seconds * 10; ++step) {
+        pcr = (pcr + 9000) & 0x1ffffffff;
+        AddPcr(PCR_PID, pcr);
+        if (step % 2 == 0) {
+            AddSection(0x00, pat);
+            AddSection(PMT_PID, pmt);
+        }
+        if (step % 10 == 0) {
+            AddSection(0x10, nit);
+        }
+        // EIT present/following
+        for (int service = 0x0400; service <= 0x0401; ++service) {
+            body.assign(26, 0);
+            body[0] = 0x7f;
+            body[1] = 0xe0;
+            body[3] = 0x04;
+            body[4] = 1;
+            body[5] = 0x4e;
+            AddSection(0x12, MakeSection(0x4e, service, 1, step % 2, 1, body));
+        }
+        // EIT schedule
+        if (params.eitScheduleInterval > 0 && step % params.eitScheduleInterval == 0) {
+            static const int SECTION_NUMBERS[] = {0, 1, 8, 16};
+            int sectionNumber = SECTION_NUMBERS[step % 4];
+            body.assign(6, 0);
+            body[0] = 0x7f;
+            body[1] = 0xe0;
+            body[3] = 0x04;
+            body[4] = static_cast<uint8_t>(sectionNumber < 8 ? 1 : sectionNumber);
+            body[5] = 0x51;
+            for (int i = params.eitScheduleSize + params.eitScheduleSize / 2 * (step % 3); i > 0; --i) {
+                body.push_back(Random());
+            }
+            AddSection(0x12, MakeSection(0x50 + step / 5 % 2, 0x0400, step / 300 % 32, sectionNumber, 16, body));
+        }
+        // Carousel blocks repeated in a cycle of 7
+        if (params.carouselInterval > 0 && step % params.carouselInterval == 0) {
+            for (int i = 0; i < params.carouselPidCount; ++i) {
+                body.clear();
+                for (int j = 0; j < params.carouselSize; ++j) {
+                    body.push_back(static_cast<uint8_t>(step % 7 + i + j));
+                }
+                AddSection(CAROUSEL_PID + i, MakeSection(0x3c, 1, 0, step % 7, 6, body));
+            }
+        }
+        for (int i = 0; i < params.videoPacketCount; ++i) {
+            AddVideo(VIDEO_PID);
+        }
+    }
+}
+
+std::vector<uint8_t> CTsGenerator::MakeSection(int tableId, int extension, int version, int sectionNumber, int lastSectionNumber,
+                                               const std::vector<uint8_t> &body)
+{
+    size_t sectionLength = 5 + body.size() + 4;
+    std::vector<uint8_t> section(3 + sectionLength);
+    section[0] = static_cast<uint8_t>(tableId);
+    section[1] = static_cast<uint8_t>(0xb0 | sectionLength >> 8);
+    section[2] = static_cast<uint8_t>(sectionLength);
+    section[3] = static_cast<uint8_t>(extension >> 8);
+    section[4] = static_cast<uint8_t>(extension);
+    section[5] = static_cast<uint8_t>(0xc1 | version << 1);
+    section[6] = static_cast<uint8_t>(sectionNumber);
+    section[7] = static_cast<uint8_t>(lastSectionNumber);
+    std::copy(body.begin(), body.end(), section.begin() + 8);
+    uint32_t crc = calc_crc32(section.data(), static_cast<int>(section.size() - 4));
+    for (int i = 0; i < 4; ++i) {
+        section[section.size() - 4 + i] = static_cast<uint8_t>(crc >> (24 - i * 8));
+    }
+    return section;
+}
+
+void CTsGenerator::AddSection(int pid, const std::vector<uint8_t> &section)
+{
+    // A section per unit, with a pointer_field
+    for (size_t pos = 0; pos == 0 || pos < section.size() + 1; pos += 184) {
+        uint8_t packet[188];
+        packet[0] = 0x47;
+        packet[1] = static_cast<uint8_t>((pos == 0 ? 0x40 : 0) | pid >> 8);
+        packet[2] = static_cast<uint8_t>(pid);
+        packet[3] = static_cast<uint8_t>(0x10 | m_counter[pid]);
+        m_counter[pid] = (m_counter[pid] + 1) & 0x0f;
+        for (size_t i = 0; i < 184; ++i) {
+            size_t j = pos + i;
+            packet[4 + i] = j == 0 ? 0 : j <= section.size() ? section[j - 1] : 0xff;
+        }
+        m_ts.insert(m_ts.end(), packet, packet + 188);
+    }
+}
+
+void CTsGenerator::AddPcr(int pid, int64_t pcr)
+{
+    uint8_t packet[188] = {
+        0x47, static_cast<uint8_t>(pid >> 8), static_cast<uint8_t>(pid), static_cast<uint8_t>(0x20 | m_counter[pid]),
+        // Adaptation field with PCR only
+        7, 0x10,
+        static_cast<uint8_t>(pcr >> 25),
+        static_cast<uint8_t>(pcr >> 17),
+        static_cast<uint8_t>(pcr >> 9),
+        static_cast<uint8_t>(pcr >> 1),
+        static_cast<uint8_t>((pcr & 1) << 7 | 0x7e),
+        0
+    };
+    std::fill(packet + 12, packet + 188, 0xff);
+    m_ts.insert(m_ts.end(), packet, packet + 188);
+}
+
+void CTsGenerator::AddVideo(int pid)
+{
+    uint8_t packet[188] = {0x47, static_cast<uint8_t>(pid >> 8), static_cast<uint8_t>(pid), static_cast<uint8_t>(0x10 | m_counter[pid])};
+    m_counter[pid] = (m_counter[pid] + 1) & 0x0f;
+    for (int i = 4; i < 188; ++i) {
+        packet[i] = Random();
+    }
+    m_ts.insert(m_ts.end(), packet, packet + 188);
+}
+
+// FNV-1a
+uint64_t UpdateHash(uint64_t hash, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+const uint64_t HASH_INIT = 0xcbf29ce484222325;
+
+// Returns the best seconds of repeated runs
+double MeasureBest(int repeatCount, const std::function<void ()> &func)
+{
+    double best = 0;
+    for (int i = 0; i < repeatCount; ++i) {
+        auto startTime = std::chrono::steady_clock::now();
+        func();
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        best = i == 0 ? sec : std::min(best, sec);
+    }
+    return best;
+}
+
+void PrintResult(const char *name, double bytes, double sec, const std::string &note)
+{
+    printf("%-24s %9.1f MB/s  %8.3f sec  %s\n", name, sec > 0 ? bytes / 1e6 / sec : 0.0, sec, note.c_str());
+}
+
+// The same processing as the command without file I/O. Returns the hash of the archive.
+uint64_t ArchiveStream(const std::vector<uint8_t> &ts, size_t &archiveSize)
+{
+    CPsiExtractor psiExtractor;
+    psiExtractor.AddPreset("arib-data");
+    CPsiArchiver psiArchiver;
+    psiArchiver.SetWriteInterval(11250);
+    uint64_t hash = HASH_INIT;
+    archiveSize = 0;
+    psiArchiver.SetWriteCallback([&hash, &archiveSize](const uint8_t *data, size_t size) {
+        hash = UpdateHash(hash, data, size);
+        archiveSize += size;
+        return true;
+    });
+    int unitSize = 0;
+    size_t pos = 0;
+    while (pos < ts.size()) {
+        int bufCount = static_cast<int>(std::min<size_t>(ts.size() - pos, 188 * 348));
+        const uint8_t *buf = ts.data() + pos;
+        int bufPos = 0;
+        for (; find_ts_packet(buf, bufCount, &bufPos, &unitSize, pos + bufCount == ts.size(), nullptr); bufPos += unitSize) {
+            psiExtractor.AddPacket(buf + bufPos, [&psiArchiver](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+                psiArchiver.Add(pid, pcr, psiSize, psi);
+            });
+        }
+        if (pos + bufCount == ts.size()) {
+            break;
+        }
+        pos += bufPos;
+    }
+    psiArchiver.Flush();
+    return hash;
+}
+
+int RunBenchmarks(const std::vector<uint8_t> &ts, int repeatCount, bool isDefault)
+{
+    double tsSize = static_cast<double>(ts.size());
+    char note[256];
+
+    // Walk all packets by resync_ts alone, on a copy whose sync bytes are cleared in 8 packets of every 64
+    std::vector<uint8_t> broken(ts);
+    for (size_t pos = 0; pos + 188 <= broken.size(); pos += 188) {
+        if (pos / 188 % 64 < 8) {
+            broken[pos] = 0;
+        }
+    }
+    int syncCount = 0;
+    int64_t droppedBytes = 0;
+    double sec = MeasureBest(repeatCount, [&]() {
+        syncCount = 0;
+        droppedBytes = 0;
+        int unitSize = 0;
+        for (size_t pos = 0; pos < broken.size();) {
+            int bufCount = static_cast<int>(std::min<size_t>(broken.size() - pos, 65536));
+            int bufPos = 0;
+            int droppedSize;
+            for (; resync_ts(broken.data() + pos, bufCount, &bufPos, &unitSize, pos + bufCount == broken.size(), &droppedSize);
+                 bufPos += unitSize) {
+                ++syncCount;
+                droppedBytes += droppedSize;
+            }
+            droppedBytes += droppedSize;
+            if (pos + bufCount == broken.size()) {
+                break;
+            }
+            pos += bufPos;
+        }
+    });
+    sprintf(note, "%d packets, %lld bytes dropped", syncCount, static_cast<long long>(droppedBytes));
+    PrintResult("resync_ts", tsSize, sec, note);
+
+    // Walk all packets as the main loop does
+    int packetCount = 0;
+    sec = MeasureBest(repeatCount, [&]() {
+        packetCount = 0;
+        int unitSize = 0;
+        for (size_t pos = 0; pos < ts.size();) {
+            int bufCount = static_cast<int>(std::min<size_t>(ts.size() - pos, 65536));
+            int bufPos = 0;
+            for (; find_ts_packet(ts.data() + pos, bufCount, &bufPos, &unitSize, pos + bufCount == ts.size(), nullptr); bufPos += unitSize) {
+                ++packetCount;
+            }
+            if (pos + bufCount == ts.size()) {
+                break;
+            }
+            pos += bufPos;
+        }
+    });
+    sprintf(note, "%d packets", packetCount);
+    PrintResult("find_ts_packet", tsSize, sec, note);
+
+    uint32_t crc = 0;
+    sec = MeasureBest(repeatCount, [&]() {
+        crc = 0;
+        for (size_t pos = 0; pos < ts.size(); pos += 4096) {
+            crc ^= calc_crc32(ts.data() + pos, static_cast<int>(std::min<size_t>(ts.size() - pos, 4096)));
+        }
+    });
+    sprintf(note, "4KiB blocks (%08x)", static_cast<unsigned int>(crc));
+    PrintResult("calc_crc32", tsSize, sec, note);
+
+    std::vector<uint8_t> sectionData;
+    std::vector<SECTION_REF> sections;
+    sec = MeasureBest(repeatCount, [&]() {
+        CPsiExtractor psiExtractor;
+        psiExtractor.AddPreset("arib-data");
+        sectionData.clear();
+        sections.clear();
+        for (size_t pos = 0; pos + 188 <= ts.size(); pos += 188) {
+            psiExtractor.AddPacket(ts.data() + pos, [&](int pid, int64_t pcr, size_t psiSize, const uint8_t *psi) {
+                SECTION_REF ref = {pid, pcr, sectionData.size(), psiSize};
+                sections.push_back(ref);
+                sectionData.insert(sectionData.end(), psi, psi + psiSize);
+            });
+        }
+    });
+    sprintf(note, "%d packets, %d sections", static_cast<int>(ts.size() / 188), static_cast<int>(sections.size()));
+    PrintResult("CPsiExtractor::AddPacket", tsSize, sec, note);
+
+    // Flush every second of PCR separately from adding. The interval only enables leaving items in the dictionary.
+    double addSec = 0;
+    double flushSec = 0;
+    size_t archiveSize = 0;
+    MeasureBest(repeatCount, [&]() {
+        CPsiArchiver psiArchiver;
+        psiArchiver.SetWriteInterval(11250 * 2);
+        archiveSize = 0;
+        psiArchiver.SetWriteCallback([&archiveSize](const uint8_t *, size_t size) {
+            archiveSize += size;
+            return true;
+        });
+        double runAddSec = 0;
+        double runFlushSec = 0;
+        int64_t nextFlushPcr = -1;
+        auto segmentTime = std::chrono::steady_clock::now();
+        for (auto it = sections.cbegin(); it != sections.end(); ++it) {
+            if (it->pcr >= 0 && (nextFlushPcr < 0 || it->pcr >= nextFlushPcr || it->pcr < nextFlushPcr - 90000)) {
+                auto flushTime = std::chrono::steady_clock::now();
+                psiArchiver.Flush(true);
+                auto now = std::chrono::steady_clock::now();
+                runAddSec += std::chrono::duration<double>(flushTime - segmentTime).count();
+                runFlushSec += std::chrono::duration<double>(now - flushTime).count();
+                segmentTime = now;
+                nextFlushPcr = it->pcr + 90000;
+            }
+            psiArchiver.Add(it->pid, it->pcr, it->size, sectionData.data() + it->pos);
+        }
+        auto flushTime = std::chrono::steady_clock::now();
+        psiArchiver.Flush();
+        runAddSec += std::chrono::duration<double>(flushTime - segmentTime).count();
+        runFlushSec += std::chrono::duration<double>(std::chrono::steady_clock::now() - flushTime).count();
+        bool first = addSec == 0 && flushSec == 0;
+        addSec = first ? runAddSec : std::min(addSec, runAddSec);
+        flushSec = first ? runFlushSec : std::min(flushSec, runFlushSec);
+    });
+    sprintf(note, "%d sections", static_cast<int>(sections.size()));
+    PrintResult("CPsiArchiver::Add", static_cast<double>(sectionData.size()), addSec, note);
+    sprintf(note, "%.1f MB archive", archiveSize / 1e6);
+    PrintResult("CPsiArchiver::Flush", static_cast<double>(sectionData.size()), flushSec, note);
+
+    uint64_t hash = 0;
+    sec = MeasureBest(repeatCount, [&]() { hash = ArchiveStream(ts, archiveSize); });
+    sprintf(note, "%.1f MB archive, hash %016llx", archiveSize / 1e6, static_cast<unsigned long long>(hash));
+    PrintResult("end-to-end", tsSize, sec, note);
+
+    if (isDefault && hash != GOLDEN_ARCHIVE_HASH) {
+        fprintf(stderr, "Error: archive hash differs from the golden one (%016llx).\n", static_cast<unsigned long long>(GOLDEN_ARCHIVE_HASH));
+        return 1;
+    }
+    return 0;
+}
+}
+
+int main(int argc, char **argv)
+{
+    GENERATOR_PARAMS params = {600, 30, 100, 1, 1, 1000, 3};
+    int repeatCount = 3;
+    const char *generateName = "";
+    bool isDefault = true;
+
+    for (int i = 1; i < argc; ++i) {
+        char c = '\0';
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
+            c = argv[i][1];
+        }
+        if (c == 'h') {
+            fprintf(stderr, "Usage: psisiarcbench [-d seconds][-v video_packets][-e eit_bytes][-u eit_interval][-c carousel_pids][-k carousel_bytes][-r carousel_interval][-n repeat][-g dest]\n");
+            return 2;
+        }
+        bool invalid = c == '\0' || i + 1 >= argc;
+        if (!invalid) {
+            int n = static_cast<int>(strtol(argv[++i], nullptr, 10));
+            if (c == 'd') {
+                params.seconds = n;
+                invalid = !(1 <= n && n <= 86400);
+            }
+            else if (c == 'v') {
+                params.videoPacketCount = n;
+                invalid = !(0 <= n && n <= 100000);
+            }
+            else if (c == 'e') {
+                params.eitScheduleSize = n;
+                invalid = !(0 <= n && n <= 2700);
+            }
+            else if (c == 'u') {
+                params.eitScheduleInterval = n;
+                invalid = !(0 <= n && n <= 10000);
+            }
+            else if (c == 'c') {
+                params.carouselPidCount = n;
+                invalid = !(0 <= n && n <= 64);
+            }
+            else if (c == 'k') {
+                params.carouselSize = n;
+                invalid = !(0 <= n && n <= 4084);
+            }
+            else if (c == 'r') {
+                params.carouselInterval = n;
+                invalid = !(0 <= n && n <= 10000);
+            }
+            else if (c == 'n') {
+                repeatCount = n;
+                invalid = !(1 <= n && n <= 100);
+            }
+            else if (c == 'g') {
+                generateName = argv[i];
+            }
+            else {
+                invalid = true;
+            }
+            isDefault = isDefault && (c == 'n' || c == 'g');
+        }
+        if (invalid) {
+            fprintf(stderr, "Error: argument %d is invalid.\n", i);
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> ts;
+    auto startTime = std::chrono::steady_clock::now();
+    CTsGenerator(ts).Generate(params);
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    if (generateName[0]) {
+        std::unique_ptr<FILE, decltype(&fclose)> file(nullptr, fclose);
+        if (strcmp(generateName, "-")) {
+            file.reset(fopen(generateName, "wb"));
+            if (!file) {
+                fprintf(stderr, "Error: cannot create file.\n");
+                return 1;
+            }
+        }
+        FILE *fp = file ? file.get() : stdout;
+        if (fwrite(ts.data(), 1, ts.size(), fp) != ts.size() || fflush(fp) != 0) {
+            fprintf(stderr, "Error: cannot write the stream.\n");
+            return 1;
+        }
+        return 0;
+    }
+    printf("# %.1f MB stream of %d sec generated in %.3f sec, best of %d runs\n", ts.size() / 1e6, params.seconds, sec, repeatCount);
+    return RunBenchmarks(ts, repeatCount, isDefault);
+}
@@ -0,0 +1,121 @@
+#include "sectionpacketizer.hpp"
+#include <algorithm>
+#include <string.h>
+
+CSectionPacketizer::CSectionPacketizer()
+{
+    std::fill_n(m_counter, 8192, 0);
+    std::fill_n(m_pendingFill, 8192, 0);
+    std::fill_n(m_slot, 8192, -1);
+    std::fill_n(m_listed, 8192, false);
+}
+
+void CSectionPacketizer::AddSection(int pid, const uint8_t *section, size_t size, std::vector<uint8_t> &buf)
+{
+    size_t pos = 0;
+    if (m_pendingFill[pid] > 0) {
+        uint8_t *packet = m_pending.data() + m_slot[pid] * PACKET_SIZE;
+        size_t fill = m_pendingFill[pid];
+        if (!(packet[1] & 0x40) && fill + 1 < PACKET_SIZE) {
+            // Insert a pointer_field to start the section in this packet
+            memmove(packet + 5, packet + 4, fill - 4);
+            packet[1] |= 0x40;
+            packet[4] = static_cast<uint8_t>(fill - 4);
+            ++fill;
+        }
+        if (packet[1] & 0x40) {
+            pos = std::min(PACKET_SIZE - fill, size);
+            memcpy(packet + fill, section, pos);
+            fill += pos;
+        }
+        m_pendingFill[pid] = static_cast<uint8_t>(fill);
+        if (fill == PACKET_SIZE || pos < size) {
+            EndPacket(pid, buf);
+        }
+    }
+    while (pos < size) {
+        // Only the last packet not filled up is kept pending
+        size_t headerSize = pos == 0 ? 5 : 4;
+        size_t n = std::min(PACKET_SIZE - headerSize, size - pos);
+        uint8_t *packet;
+        if (headerSize + n == PACKET_SIZE) {
+            buf.resize(buf.size() + PACKET_SIZE);
+            packet = buf.data() + buf.size() - PACKET_SIZE;
+        }
+        else {
+            packet = GetPendingPacket(pid);
+            m_pendingFill[pid] = static_cast<uint8_t>(headerSize + n);
+        }
+        WriteHeader(packet, pid, pos == 0);
+        memcpy(packet + headerSize, section + pos, n);
+        pos += n;
+    }
+}
+
+void CSectionPacketizer::FlushPending(std::vector<uint8_t> &buf)
+{
+    for (auto it = m_pendingPids.cbegin(); it != m_pendingPids.end(); ++it) {
+        if (m_pendingFill[*it] > 0) {
+            EndPacket(*it, buf);
+        }
+        m_listed[*it] = false;
+    }
+    m_pendingPids.clear();
+}
+
+void CSectionPacketizer::AddPcr(int pid, int64_t pcrBase, bool discontinuity, std::vector<uint8_t> &buf)
+{
+    buf.resize(buf.size() + PACKET_SIZE, 0xff);
+    uint8_t *packet = buf.data() + buf.size() - PACKET_SIZE;
+    packet[0] = 0x47;
+    packet[1] = static_cast<uint8_t>(pid >> 8);
+    packet[2] = static_cast<uint8_t>(pid);
+    // Adaptation field only, which does not increment the counter
+    packet[3] = static_cast<uint8_t>(0x20 | ((m_counter[pid] + 15) & 0x0f));
+    packet[4] = PACKET_SIZE - 5;
+    packet[5] = discontinuity ? 0x90 : 0x10;
+    packet[6] = static_cast<uint8_t>(pcrBase >> 25);
+    packet[7] = static_cast<uint8_t>(pcrBase >> 17);
+    packet[8] = static_cast<uint8_t>(pcrBase >> 9);
+    packet[9] = static_cast<uint8_t>(pcrBase >> 1);
+    // Reserved bits and zero extension
+    packet[10] = static_cast<uint8_t>(pcrBase << 7 | 0x7e);
+    packet[11] = 0;
+}
+
+void CSectionPacketizer::WriteHeader(uint8_t *packet, int pid, bool unitStart)
+{
+    packet[0] = 0x47;
+    packet[1] = static_cast<uint8_t>((unitStart ? 0x40 : 0) | pid >> 8);
+    packet[2] = static_cast<uint8_t>(pid);
+    // Payload only
+    packet[3] = static_cast<uint8_t>(0x10 | m_counter[pid]);
+    m_counter[pid] = (m_counter[pid] + 1) & 0x0f;
+    if (unitStart) {
+        // pointer_field
+        packet[4] = 0;
+    }
+}
+
+uint8_t *CSectionPacketizer::GetPendingPacket(int pid)
+{
+    if (m_slot[pid] < 0) {
+        // Reserved once for each PID
+        m_slot[pid] = static_cast<int>(m_pending.size() / PACKET_SIZE);
+        m_pending.resize(m_pending.size() + PACKET_SIZE);
+    }
+    if (!m_listed[pid]) {
+        m_listed[pid] = true;
+        m_pendingPids.push_back(pid);
+    }
+    return m_pending.data() + m_slot[pid] * PACKET_SIZE;
+}
+
+void CSectionPacketizer::EndPacket(int pid, std::vector<uint8_t> &buf)
+{
+    // Fill the rest with stuffing bytes
+    uint8_t *packet = m_pending.data() + m_slot[pid] * PACKET_SIZE;
+    std::fill(packet + m_pendingFill[pid], packet + PACKET_SIZE, 0xff);
+    buf.insert(buf.end(), packet, packet + PACKET_SIZE);
+    m_pendingFill[pid] = 0;
+}
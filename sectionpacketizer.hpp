@@ -0,0 +1,37 @@
+#ifndef INCLUDE_SECTIONPACKETIZER_HPP
+#define INCLUDE_SECTIONPACKETIZER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Packs sections into TS packets, sharing packets between consecutive sections of the same PID
+class CSectionPacketizer
+{
+public:
+    CSectionPacketizer();
+    // Appends the packets filled up to buf. The last packet of each PID is kept pending for the next section.
+    void AddSection(int pid, const uint8_t *section, size_t size, std::vector<uint8_t> &buf);
+    // Appends pending packets to buf with stuffing bytes
+    void FlushPending(std::vector<uint8_t> &buf);
+    // Appends a packet carrying only the PCR (33bit base in 90kHz) in its adaptation field
+    void AddPcr(int pid, int64_t pcrBase, bool discontinuity, std::vector<uint8_t> &buf);
+
+private:
+    static const size_t PACKET_SIZE = 188;
+    void WriteHeader(uint8_t *packet, int pid, bool unitStart);
+    uint8_t *GetPendingPacket(int pid);
+    void EndPacket(int pid, std::vector<uint8_t> &buf);
+
+    uint8_t m_counter[8192];
+    // Bytes filled in the pending packet, or 0 if none
+    uint8_t m_pendingFill[8192];
+    // Index of the packet reserved in m_pending, or -1
+    int m_slot[8192];
+    bool m_listed[8192];
+    std::vector<uint8_t> m_pending;
+    // In the order of appearance
+    std::vector<int> m_pendingPids;
+};
+
+#endif
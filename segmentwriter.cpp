@@ -0,0 +1,199 @@
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "segmentwriter.hpp"
+#include <algorithm>
+
+CSegmentWriter::CSegmentWriter()
+    : m_width(0)
+    , m_zeroPad(false)
+    , m_duration(0)
+    , m_interval(0)
+    , m_retentionCount(0)
+    , m_fp(nullptr)
+    , m_endPending(false)
+{
+    m_current.number = 0;
+    m_current.firstTime = UNKNOWN_TIME;
+    m_current.lastTime = UNKNOWN_TIME;
+}
+
+CSegmentWriter::~CSegmentWriter()
+{
+    if (m_fp) {
+        fclose(m_fp);
+    }
+}
+
+bool CSegmentWriter::Open(const NATIVE_STRING &pattern, const NATIVE_STRING &playlistName, uint32_t duration, uint32_t interval, int retentionCount)
+{
+    // Accept only "%d", "%5d" or "%05d" like conversions
+    size_t pos = pattern.find('%');
+    if (pos == NATIVE_STRING::npos) {
+        return false;
+    }
+    size_t i = pos + 1;
+    m_zeroPad = i < pattern.size() && pattern[i] == '0';
+    m_width = 0;
+    for (; i < pattern.size() && '0' <= pattern[i] && pattern[i] <= '9' && m_width < 100; ++i) {
+        m_width = m_width * 10 + (pattern[i] - '0');
+    }
+    if (i >= pattern.size() || pattern[i] != 'd' || pattern.find('%', i) != NATIVE_STRING::npos) {
+        return false;
+    }
+    m_prefix = pattern.substr(0, pos);
+    m_suffix = pattern.substr(i + 1);
+    m_playlistName = playlistName;
+    m_duration = duration;
+    m_interval = interval;
+    m_retentionCount = retentionCount;
+    return true;
+}
+
+bool CSegmentWriter::Write(const uint8_t *buf, size_t size)
+{
+    if (!m_fp) {
+        m_current.name = GetSegmentName(m_current.number);
+#ifdef _WIN32
+        m_fp = _wfopen(m_current.name.c_str(), L"wb");
+#else
+        m_fp = fopen(m_current.name.c_str(), "w");
+#endif
+        if (!m_fp) {
+            return false;
+        }
+    }
+    if (fwrite(buf, 1, size, m_fp) != size || fflush(m_fp) != 0) {
+        return false;
+    }
+    // The trailer of the last chunk is already in buf
+    return !m_endPending || EndSegment();
+}
+
+bool CSegmentWriter::EndChunk(uint32_t firstTime, uint32_t lastTime)
+{
+    if (m_current.firstTime == UNKNOWN_TIME) {
+        m_current.firstTime = firstTime;
+    }
+    if (lastTime != UNKNOWN_TIME) {
+        m_current.lastTime = lastTime;
+    }
+    if (m_current.firstTime != UNKNOWN_TIME && firstTime != UNKNOWN_TIME) {
+        // End if the next chunk would go beyond the duration. Allow the beginning of chunks to jitter by half the interval.
+        uint32_t elapsedTime = (0x40000000 + firstTime - m_current.firstTime) & 0x3fffffff;
+        m_endPending = elapsedTime + m_interval + m_interval / 2 > m_duration;
+    }
+    return m_endPending;
+}
+
+bool CSegmentWriter::Close()
+{
+    bool ret = true;
+    if (m_fp) {
+        ret = EndSegment();
+    }
+    return WritePlaylist(true) && ret;
+}
+
+CSegmentWriter::NATIVE_STRING CSegmentWriter::GetSegmentName(int number) const
+{
+    NATIVE_STRING digits;
+    do {
+        digits.insert(digits.begin(), static_cast<NATIVE_STRING::value_type>('0' + number % 10));
+        number /= 10;
+    }
+    while (number > 0);
+    if (static_cast<int>(digits.size()) < m_width) {
+        digits.insert(digits.begin(), m_width - digits.size(), m_zeroPad ? '0' : ' ');
+    }
+    return m_prefix + digits + m_suffix;
+}
+
+bool CSegmentWriter::EndSegment()
+{
+    bool ret = fclose(m_fp) == 0;
+    m_fp = nullptr;
+    m_endPending = false;
+    m_segments.push_back(m_current);
+    while (m_retentionCount > 0 && static_cast<int>(m_segments.size()) > m_retentionCount) {
+        // Rotate out
+#ifdef _WIN32
+        _wremove(m_segments.front().name.c_str());
+#else
+        remove(m_segments.front().name.c_str());
+#endif
+        m_segments.pop_front();
+    }
+    ret = WritePlaylist(false) && ret;
+    ++m_current.number;
+    m_current.name.clear();
+    m_current.firstTime = UNKNOWN_TIME;
+    m_current.lastTime = UNKNOWN_TIME;
+    return ret;
+}
+
+bool CSegmentWriter::WritePlaylist(bool endList) const
+{
+    if (m_playlistName.empty()) {
+        return true;
+    }
+    char buf[128];
+    double targetDuration = m_duration / 11250.0;
+    std::string entries;
+    for (auto it = m_segments.cbegin(); it != m_segments.end(); ++it) {
+        double duration = 0;
+        if (it->firstTime != UNKNOWN_TIME) {
+            // Until the beginning of the next segment if known
+            uint32_t endTime = it + 1 != m_segments.end() && (it + 1)->firstTime != UNKNOWN_TIME ? (it + 1)->firstTime : it->lastTime;
+            duration = ((0x40000000 + endTime - it->firstTime) & 0x3fffffff) / 11250.0;
+        }
+        targetDuration = std::max(targetDuration, duration);
+        snprintf(buf, sizeof(buf), "#EXTINF:%.3f,\n", duration);
+        entries += buf;
+        if (it->firstTime != UNKNOWN_TIME) {
+            // 33bit PCR (90kHz) range of the sections
+            snprintf(buf, sizeof(buf), "#PSISIARC-PCR-RANGE:%lld,%lld\n",
+                     static_cast<long long>(it->firstTime) << 3, static_cast<long long>(it->lastTime) << 3);
+            entries += buf;
+        }
+        // Relative to the playlist
+#ifdef _WIN32
+        size_t pos = it->name.find_last_of(L"/\\:");
+        NATIVE_STRING name = it->name.substr(pos == NATIVE_STRING::npos ? 0 : pos + 1);
+        int len = WideCharToMultiByte(CP_UTF8, 0, name.c_str(), -1, nullptr, 0, nullptr, nullptr);
+        std::string utf8Name(std::max(len, 1), '\0');
+        WideCharToMultiByte(CP_UTF8, 0, name.c_str(), -1, &utf8Name[0], len, nullptr, nullptr);
+        utf8Name.pop_back();
+        entries += utf8Name;
+#else
+        size_t pos = it->name.rfind('/');
+        entries += it->name.substr(pos == NATIVE_STRING::npos ? 0 : pos + 1);
+#endif
+        entries += '\n';
+    }
+    snprintf(buf, sizeof(buf), "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%d\n",
+             static_cast<int>(targetDuration + 0.999), m_segments.empty() ? m_current.number : m_segments.front().number);
+    std::string playlist = buf + entries;
+    if (endList) {
+        playlist += "#EXT-X-ENDLIST\n";
+    }
+
+    // Replace atomically
+#ifdef _WIN32
+    NATIVE_STRING tmpName = m_playlistName + L".tmp";
+    FILE *fp = _wfopen(tmpName.c_str(), L"wb");
+#else
+    NATIVE_STRING tmpName = m_playlistName + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "w");
+#endif
+    if (!fp) {
+        return false;
+    }
+    bool ret = fwrite(playlist.data(), 1, playlist.size(), fp) == playlist.size();
+    ret = fclose(fp) == 0 && ret;
+#ifdef _WIN32
+    return ret && MoveFileExW(tmpName.c_str(), m_playlistName.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    return ret && rename(tmpName.c_str(), m_playlistName.c_str()) == 0;
+#endif
+}
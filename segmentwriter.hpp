@@ -0,0 +1,56 @@
+#ifndef INCLUDE_SEGMENTWRITER_HPP
+#define INCLUDE_SEGMENTWRITER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <string>
+
+// Splits the archive into segment files at chunk boundaries and maintains a playlist of them
+class CSegmentWriter
+{
+public:
+    CSegmentWriter();
+    ~CSegmentWriter();
+#ifdef _WIN32
+    typedef std::wstring NATIVE_STRING;
+#else
+    typedef std::string NATIVE_STRING;
+#endif
+    // pattern contains a single "%d" (with optional zero padding and width like "%05d") replaced by the segment number.
+    // Times are in 1/11250 seconds. retentionCount == 0 keeps all segments.
+    bool Open(const NATIVE_STRING &pattern, const NATIVE_STRING &playlistName, uint32_t duration, uint32_t interval, int retentionCount);
+    bool Write(const uint8_t *buf, size_t size);
+    // Returns true if the segment should end with this chunk
+    bool EndChunk(uint32_t firstTime, uint32_t lastTime);
+    bool Close();
+
+private:
+    struct SEGMENT
+    {
+        int number;
+        NATIVE_STRING name;
+        uint32_t firstTime;
+        uint32_t lastTime;
+    };
+    static const uint32_t UNKNOWN_TIME = 0xffffffff;
+    NATIVE_STRING GetSegmentName(int number) const;
+    bool EndSegment();
+    bool WritePlaylist(bool endList) const;
+
+    NATIVE_STRING m_prefix;
+    NATIVE_STRING m_suffix;
+    NATIVE_STRING m_playlistName;
+    int m_width;
+    bool m_zeroPad;
+    uint32_t m_duration;
+    uint32_t m_interval;
+    int m_retentionCount;
+    FILE *m_fp;
+    bool m_endPending;
+    SEGMENT m_current;
+    std::deque<SEGMENT> m_segments;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "shmring.hpp"
+#include <string.h>
+
+static_assert(sizeof(SHM_RING_HEADER) == 64, "Unexpected layout");
+static_assert(sizeof(SHM_RING_ENTRY) == 32, "Unexpected layout");
+
+CShmRingWriter::CShmRingWriter()
+    : m_header(nullptr)
+    , m_entries(nullptr)
+    , m_data(nullptr)
+    , m_mapSize(0)
+    , m_position(0)
+#ifdef _WIN32
+    , m_handle(nullptr)
+#endif
+{
+}
+
+CShmRingWriter::~CShmRingWriter()
+{
+    Close();
+}
+
+#ifdef _WIN32
+bool CShmRingWriter::Open(const wchar_t *name, size_t dataSize)
+#else
+bool CShmRingWriter::Open(const char *name, size_t dataSize)
+#endif
+{
+    Close();
+    size_t entryOffset = sizeof(SHM_RING_HEADER);
+    size_t dataOffset = (entryOffset + ENTRY_COUNT * sizeof(SHM_RING_ENTRY) + 4095) / 4096 * 4096;
+    size_t mapSize = dataOffset + dataSize;
+    void *p;
+#ifdef _WIN32
+    m_handle = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                  static_cast<DWORD>(static_cast<uint64_t>(mapSize) >> 32), static_cast<DWORD>(mapSize), name);
+    if (!m_handle) {
+        return false;
+    }
+    p = MapViewOfFile(m_handle, FILE_MAP_WRITE, 0, 0, mapSize);
+    if (!p) {
+        CloseHandle(m_handle);
+        m_handle = nullptr;
+        return false;
+    }
+#else
+    // Names of POSIX shared memory objects begin with a slash
+    std::string shmName = name[0] == '/' ? name : std::string("/") + name;
+    int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    p = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(mapSize)) == 0) {
+        p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(shmName.c_str());
+        return false;
+    }
+    m_name = shmName;
+#endif
+    m_mapSize = mapSize;
+    m_header = static_cast<SHM_RING_HEADER *>(p);
+    m_entries = reinterpret_cast<SHM_RING_ENTRY *>(static_cast<uint8_t *>(p) + entryOffset);
+    m_data = static_cast<uint8_t *>(p) + dataOffset;
+    m_position = 0;
+
+    memcpy(m_header->magic, "PsscRing", 8);
+    m_header->entryCount = ENTRY_COUNT;
+    m_header->entryOffset = entryOffset;
+    m_header->dataOffset = dataOffset;
+    m_header->dataSize = dataSize;
+    m_header->nextSequence.store(0, std::memory_order_relaxed);
+    m_header->writePosition.store(0, std::memory_order_relaxed);
+    m_header->closed.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < ENTRY_COUNT; ++i) {
+        m_entries[i].sequence.store(SHM_RING_INVALID_SEQUENCE, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+void CShmRingWriter::Close()
+{
+    if (m_header) {
+        m_header->closed.store(1, std::memory_order_release);
+#ifdef _WIN32
+        UnmapViewOfFile(m_header);
+        CloseHandle(m_handle);
+        m_handle = nullptr;
+#else
+        munmap(m_header, m_mapSize);
+        // Readers that already mapped it can still read the rest
+        shm_unlink(m_name.c_str());
+#endif
+        m_header = nullptr;
+    }
+}
+
+bool CShmRingWriter::Publish(const uint8_t *chunk, size_t size, uint32_t firstTime, uint32_t lastTime, bool independent)
+{
+    uint64_t dataSize = m_header->dataSize;
+    if (size > dataSize) {
+        return false;
+    }
+    uint64_t pos = m_position;
+    if (pos % dataSize + size > dataSize) {
+        // Keep the chunk contiguous
+        pos += dataSize - pos % dataSize;
+    }
+    uint64_t seq = m_header->nextSequence.load(std::memory_order_relaxed);
+    SHM_RING_ENTRY &entry = m_entries[seq % ENTRY_COUNT];
+
+    // Invalidate the entry and the data to be overwritten before touching them
+    entry.sequence.store(SHM_RING_INVALID_SEQUENCE, std::memory_order_relaxed);
+    m_header->writePosition.store(pos + size, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(m_data + pos % dataSize, chunk, size);
+    entry.position = pos;
+    entry.size = static_cast<uint32_t>(size);
+    entry.flags = independent ? 1 : 0;
+    entry.firstTime = firstTime;
+    entry.lastTime = lastTime;
+    entry.sequence.store(seq, std::memory_order_release);
+    m_header->nextSequence.store(seq + 1, std::memory_order_release);
+    m_position = pos + size;
+    return true;
+}
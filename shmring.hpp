@@ -0,0 +1,82 @@
+#ifndef INCLUDE_SHMRING_HPP
+#define INCLUDE_SHMRING_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Layout of the shared memory ring. Readers map it read-only and follow the protocol below.
+//
+// A reader that wants the chunk of sequence number "seq":
+//  1. Waits until header.nextSequence (acquire) > seq.
+//     If header.nextSequence > seq + header.entryCount, the chunk is gone.
+//  2. Loads entry = entries[seq % entryCount] and checks that entry.sequence (acquire) == seq.
+//  3. Reads entry fields and the data at dataOffset + entry.position % dataSize.
+//  4. Issues an acquire fence and checks that entry.sequence is still seq and that
+//     header.writePosition - entry.position <= dataSize. Otherwise the data was overwritten.
+struct SHM_RING_HEADER
+{
+    // "PsscRing"
+    uint8_t magic[8];
+    uint32_t entryCount;
+    uint32_t reserved;
+    uint64_t entryOffset;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+    // Sequence number of the next chunk
+    std::atomic<uint64_t> nextSequence;
+    // End position of the data being written (monotonic)
+    std::atomic<uint64_t> writePosition;
+    // Nonzero after the writer finished
+    std::atomic<uint32_t> closed;
+    uint32_t reserved2;
+};
+
+struct SHM_RING_ENTRY
+{
+    // SHM_RING_INVALID_SEQUENCE while being rewritten
+    std::atomic<uint64_t> sequence;
+    // Position of the chunk (monotonic). Chunks never wrap around the end of the data area.
+    uint64_t position;
+    uint32_t size;
+    // Bit0: the chunk does not refer to the dictionary of the previous chunk
+    uint32_t flags;
+    // Time range of the sections in 1/11250 seconds (30bit), or 0xffffffff if unknown
+    uint32_t firstTime;
+    uint32_t lastTime;
+};
+
+static const uint64_t SHM_RING_INVALID_SEQUENCE = ~static_cast<uint64_t>(0);
+
+// Publishes archive chunks into a shared memory ring. Never waits for readers.
+class CShmRingWriter
+{
+public:
+    CShmRingWriter();
+    ~CShmRingWriter();
+#ifdef _WIN32
+    bool Open(const wchar_t *name, size_t dataSize);
+#else
+    bool Open(const char *name, size_t dataSize);
+#endif
+    void Close();
+    bool IsOpen() const { return m_header != nullptr; }
+    // Returns false if the chunk is larger than the ring and skipped
+    bool Publish(const uint8_t *chunk, size_t size, uint32_t firstTime, uint32_t lastTime, bool independent);
+
+private:
+    static const uint32_t ENTRY_COUNT = 1024;
+    SHM_RING_HEADER *m_header;
+    SHM_RING_ENTRY *m_entries;
+    uint8_t *m_data;
+    size_t m_mapSize;
+    uint64_t m_position;
+#ifdef _WIN32
+    void *m_handle;
+#else
+    std::string m_name;
+#endif
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#include "tokenstore.hpp"
+#include "fileutil.hpp"
+#include "util.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace
+{
+#ifdef _WIN32
+FILE *OpenFile(const std::wstring &name, bool write) { return _wfopen(name.c_str(), write ? L"wb" : L"rb"); }
+bool IsDirectory(const std::wstring &name)
+{
+    DWORD attr = GetFileAttributesW(name.c_str());
+    return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+}
+// Returns true if created
+bool MakeDirectory(const std::wstring &name) { return _wmkdir(name.c_str()) == 0; }
+// Fails if newName exists. Returns after the move is flushed to the disk.
+bool RenameFile(const std::wstring &oldName, const std::wstring &newName)
+{
+    return !!MoveFileExW(oldName.c_str(), newName.c_str(), MOVEFILE_WRITE_THROUGH);
+}
+void RemoveFile(const std::wstring &name) { _wremove(name.c_str()); }
+#else
+FILE *OpenFile(const std::string &name, bool write) { return fopen(name.c_str(), write ? "w" : "r"); }
+bool IsDirectory(const std::string &name)
+{
+    struct stat st;
+    return stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+// Returns true if created
+bool MakeDirectory(const std::string &name) { return mkdir(name.c_str(), 0777) == 0; }
+// Replaces newName atomically
+bool RenameFile(const std::string &oldName, const std::string &newName) { return rename(oldName.c_str(), newName.c_str()) == 0; }
+void RemoveFile(const std::string &name) { remove(name.c_str()); }
+#endif
+}
+
+CTokenStore::CTokenStore()
+    : m_random(std::random_device()())
+    , m_writtenCount(0)
+    , m_writtenBytes(0)
+{
+}
+
+bool CTokenStore::Open(const NATIVE_STRING &dirName)
+{
+    m_dirName = dirName;
+    while (m_dirName.size() > 1 && (m_dirName.back() == '/' || m_dirName.back() == '\\')) {
+        m_dirName.pop_back();
+    }
+    if (m_dirName.empty()) {
+        return false;
+    }
+    MakeDirectory(m_dirName);
+    return IsDirectory(m_dirName);
+}
+
+bool CTokenStore::Put(const uint8_t *hash, const uint8_t *token, size_t size)
+{
+    std::string key(reinterpret_cast<const char *>(hash), 32);
+    char suffix[32];
+    {
+        // The files are written without the lock. The same token may be written twice at the same time, which is harmless.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_storedHashes.count(key)) {
+            return true;
+        }
+        snprintf(suffix, sizeof(suffix), ".%016llx.tmp", static_cast<unsigned long long>(m_random()));
+    }
+    NATIVE_STRING name = GetTokenName(hash);
+    FILE *fp = OpenFile(name, false);
+    if (fp) {
+        // Stored by another archive
+        fclose(fp);
+        AddStoredHash(key);
+        return true;
+    }
+    NATIVE_STRING subdirName = name.substr(0, name.size() - 63);
+    if (MakeDirectory(subdirName) && !SyncDirectoryOf(subdirName.c_str())) {
+        return false;
+    }
+
+    NATIVE_STRING tmpName = name;
+    tmpName.append(suffix, suffix + strlen(suffix));
+    fp = OpenFile(tmpName, true);
+    if (!fp) {
+        return false;
+    }
+    // The archive referring to the token may be flushed right after this
+    bool ret = fwrite(token, 1, size, fp) == size && SyncFile(fp);
+    ret = fclose(fp) == 0 && ret;
+    if (ret && !RenameFile(tmpName, name)) {
+        // Someone may have stored the same token meanwhile
+        fp = OpenFile(name, false);
+        ret = fp != nullptr;
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    else if (ret && !SyncDirectoryOf(name.c_str())) {
+        ret = false;
+        tmpName.clear();
+    }
+    else if (ret) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_writtenCount;
+        m_writtenBytes += size;
+        tmpName.clear();
+    }
+    if (!tmpName.empty()) {
+        RemoveFile(tmpName);
+    }
+    if (ret) {
+        AddStoredHash(key);
+    }
+    return ret;
+}
+
+void CTokenStore::AddStoredHash(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_storedHashes.size() >= MAX_STORED_HASHES) {
+        // Forgetting only costs an existence check
+        m_storedHashes.clear();
+    }
+    m_storedHashes.insert(key);
+}
+
+bool CTokenStore::Get(const uint8_t *hash, size_t size, std::vector<uint8_t> &token) const
+{
+    FILE *fp = OpenFile(GetTokenName(hash), false);
+    if (!fp) {
+        return false;
+    }
+    // Read one more byte to see the size
+    token.resize(size + 1);
+    size_t n = fread(token.data(), 1, token.size(), fp);
+    fclose(fp);
+    token.resize(n);
+    uint8_t tokenHash[32];
+    calc_sha256(token.data(), token.size(), tokenHash);
+    return n == size && std::equal(tokenHash, tokenHash + 32, hash);
+}
+
+CTokenStore::NATIVE_STRING CTokenStore::GetTokenName(const uint8_t *hash) const
+{
+    static const char HEX[] = "0123456789abcdef";
+    NATIVE_STRING name = m_dirName;
+    name += '/';
+    for (int i = 0; i < 32; ++i) {
+        if (i == 1) {
+            name += '/';
+        }
+        name += HEX[hash[i] >> 4];
+        name += HEX[hash[i] & 0x0f];
+    }
+    return name;
+}
@@ -0,0 +1,48 @@
+#ifndef INCLUDE_TOKENSTORE_HPP
+#define INCLUDE_TOKENSTORE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Content-addressed store of archive tokens moved out of chunks by CPsiArchiver::SetExternalTokenCallback().
+// Each token is a file named by the hex SHA-256 of its content, in a subdirectory named by the first 2 digits.
+// Files are created under a temporary name and renamed, so writers on several hosts can share the directory.
+class CTokenStore
+{
+public:
+    CTokenStore();
+#ifdef _WIN32
+    typedef std::wstring NATIVE_STRING;
+#else
+    typedef std::string NATIVE_STRING;
+#endif
+    // Creates the directory if missing
+    bool Open(const NATIVE_STRING &dirName);
+    // Does nothing if the token is already stored. Thread safe.
+    bool Put(const uint8_t *hash, const uint8_t *token, size_t size);
+    // Fails if the token is missing or its content does not match the hash
+    bool Get(const uint8_t *hash, size_t size, std::vector<uint8_t> &token) const;
+    // Tokens newly written by this instance
+    int64_t GetWrittenCount() const { return m_writtenCount; }
+    int64_t GetWrittenBytes() const { return m_writtenBytes; }
+
+private:
+    static const size_t MAX_STORED_HASHES = 65536;
+    NATIVE_STRING GetTokenName(const uint8_t *hash) const;
+    void AddStoredHash(const std::string &key);
+
+    NATIVE_STRING m_dirName;
+    std::mutex m_mutex;
+    // Hashes known to be stored, up to MAX_STORED_HASHES
+    std::unordered_set<std::string> m_storedHashes;
+    std::mt19937_64 m_random;
+    int64_t m_writtenCount;
+    int64_t m_writtenBytes;
+};
+
+#endif
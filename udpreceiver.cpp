@@ -0,0 +1,224 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+#include "udpreceiver.hpp"
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+
+CUdpReceiver::CUdpReceiver()
+    : m_sock(INVALID_SOCK)
+    , m_datagramCount(0)
+    , m_datagramIndex(0)
+    , m_lastSequenceNumber(-1)
+    , m_ssrc(0)
+    , m_behindCount(0)
+    , m_lostCount(0)
+{
+}
+
+CUdpReceiver::~CUdpReceiver()
+{
+    Close();
+}
+
+bool CUdpReceiver::Open(const char *url)
+{
+    Close();
+    std::string s = url;
+    if (s.compare(0, 6, "udp://") != 0) {
+        return false;
+    }
+    s.erase(0, s[6] == '@' ? 7 : 6);
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    char *endp;
+    int port = static_cast<int>(strtol(s.c_str() + colon + 1, &endp, 10));
+    if (!(1 <= port && port <= 65535) || *endp) {
+        return false;
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (colon != 0 && inet_pton(AF_INET, s.substr(0, colon).c_str(), &addr.sin_addr) != 1) {
+        return false;
+    }
+    bool isMulticast = IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        return false;
+    }
+#endif
+    m_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (m_sock == INVALID_SOCK) {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return false;
+    }
+    // Best effort, to absorb bursts while sections are being archived
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&rcvbuf), sizeof(rcvbuf));
+    bool ok = true;
+    if (isMulticast) {
+        // Let other receivers join the same group
+        int reuse = 1;
+        setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+        struct sockaddr_in bindAddr = addr;
+        bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        struct ip_mreq mreq = {};
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        ok = bind(m_sock, reinterpret_cast<const struct sockaddr *>(&bindAddr), sizeof(bindAddr)) == 0 &&
+             setsockopt(m_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, reinterpret_cast<const char *>(&mreq), sizeof(mreq)) == 0;
+    }
+    else {
+        ok = bind(m_sock, reinterpret_cast<const struct sockaddr *>(&addr), sizeof(addr)) == 0;
+    }
+    if (!ok) {
+        Close();
+        return false;
+    }
+    m_datagrams.resize(BATCH_COUNT * DATAGRAM_MAX_SIZE);
+    m_datagramCount = 0;
+    m_datagramIndex = 0;
+    m_lastSequenceNumber = -1;
+    m_behindCount = 0;
+    m_lostCount = 0;
+    return true;
+}
+
+void CUdpReceiver::Close()
+{
+    if (m_sock != INVALID_SOCK) {
+#ifdef _WIN32
+        closesocket(m_sock);
+        WSACleanup();
+#else
+        close(m_sock);
+#endif
+        m_sock = INVALID_SOCK;
+    }
+}
+
+int CUdpReceiver::Receive(uint8_t *buf, int size, int timeoutMsec)
+{
+    if (m_sock == INVALID_SOCK) {
+        return -1;
+    }
+    if (m_datagramIndex >= m_datagramCount) {
+        m_datagramCount = 0;
+        m_datagramIndex = 0;
+#ifdef _WIN32
+        WSAPOLLFD pfd = {};
+        pfd.fd = m_sock;
+        pfd.events = POLLRDNORM;
+        int ret = WSAPoll(&pfd, 1, timeoutMsec);
+#else
+        struct pollfd pfd = {};
+        pfd.fd = m_sock;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, timeoutMsec);
+        if (ret < 0 && errno == EINTR) {
+            return 0;
+        }
+#endif
+        if (ret <= 0) {
+            return ret < 0 ? -1 : 0;
+        }
+#ifdef __linux__
+        // Receive as many datagrams as possible with a single call
+        struct mmsghdr msgs[BATCH_COUNT] = {};
+        struct iovec iovs[BATCH_COUNT];
+        for (int i = 0; i < BATCH_COUNT; ++i) {
+            iovs[i].iov_base = m_datagrams.data() + i * DATAGRAM_MAX_SIZE;
+            iovs[i].iov_len = DATAGRAM_MAX_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(m_sock, msgs, BATCH_COUNT, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            // Drop truncated datagrams
+            m_datagramSizes[i] = msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? 0 : static_cast<int>(msgs[i].msg_len);
+        }
+        m_datagramCount = n;
+#else
+        int n = static_cast<int>(recv(m_sock, reinterpret_cast<char *>(m_datagrams.data()), DATAGRAM_MAX_SIZE, 0));
+        if (n < 0) {
+            return -1;
+        }
+        m_datagramSizes[0] = n;
+        m_datagramCount = 1;
+#endif
+    }
+
+    int count = 0;
+    for (; m_datagramIndex < m_datagramCount; ++m_datagramIndex) {
+        const uint8_t *p = m_datagrams.data() + m_datagramIndex * DATAGRAM_MAX_SIZE;
+        int len = m_datagramSizes[m_datagramIndex];
+        if (len > 0 && p[0] != 0x47 && (p[0] & 0xc0) == 0x80 && len >= 12) {
+            // RTP (RFC 3550)
+            int sequenceNumber = p[2] << 8 | p[3];
+            uint32_t ssrc = static_cast<uint32_t>(p[8]) << 24 | p[9] << 16 | p[10] << 8 | p[11];
+            if (m_lastSequenceNumber >= 0 && ssrc == m_ssrc) {
+                int diff = (0x10000 + sequenceNumber - m_lastSequenceNumber) & 0xffff;
+                if (diff == 0 || diff >= 0x8000) {
+                    // Duplicated or reordered, unless the sender keeps going from an earlier number
+                    if (++m_behindCount < RTP_RESYNC_COUNT) {
+                        continue;
+                    }
+                }
+                else {
+                    m_lostCount += diff - 1;
+                }
+            }
+            // A new SSRC means a new sequence
+            m_ssrc = ssrc;
+            m_behindCount = 0;
+            m_lastSequenceNumber = sequenceNumber;
+            int headerSize = 12 + (p[0] & 0x0f) * 4;
+            if ((p[0] & 0x10) && headerSize + 4 <= len) {
+                // Header extension
+                headerSize += 4 + (p[headerSize + 2] << 8 | p[headerSize + 3]) * 4;
+            }
+            if ((p[0] & 0x20) && len > headerSize) {
+                // Padding
+                len -= p[len - 1];
+            }
+            p += headerSize;
+            len -= headerSize;
+        }
+        if (len <= 0 || len % 188 != 0) {
+            continue;
+        }
+        if (count + len > size) {
+            // The rest is returned by the next call
+            break;
+        }
+        for (int i = 0; i < len; i += 188) {
+            if (p[i] == 0x47) {
+                std::copy(p + i, p + i + 188, buf + count);
+                count += 188;
+            }
+        }
+    }
+    return count;
+}
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_UDPRECEIVER_HPP
+#define INCLUDE_UDPRECEIVER_HPP
+
+#include <stdint.h>
+#include <vector>
+
+// Receives TS over UDP or RTP (unicast or multicast)
+class CUdpReceiver
+{
+public:
+    CUdpReceiver();
+    ~CUdpReceiver();
+    // "udp://addr:port" or "udp://@addr:port". Empty addr means any.
+    bool Open(const char *url);
+    void Close();
+    bool IsOpen() const { return m_sock != INVALID_SOCK; }
+    // Returns the size of TS packets (a multiple of 188) stored in buf, 0 on timeout, or -1 on error
+    int Receive(uint8_t *buf, int size, int timeoutMsec);
+    long long GetLostCount() const { return m_lostCount; }
+
+private:
+    static const int BATCH_COUNT = 32;
+    static const int DATAGRAM_MAX_SIZE = 8192;
+    // Consecutive RTP datagrams behind the expected sequence number after which the sender is assumed to have restarted
+    static const int RTP_RESYNC_COUNT = 16;
+#ifdef _WIN32
+    static const uintptr_t INVALID_SOCK = ~static_cast<uintptr_t>(0);
+    uintptr_t m_sock;
+#else
+    static const int INVALID_SOCK = -1;
+    int m_sock;
+#endif
+    std::vector<uint8_t> m_datagrams;
+    int m_datagramSizes[BATCH_COUNT];
+    int m_datagramCount;
+    int m_datagramIndex;
+    int m_lastSequenceNumber;
+    uint32_t m_ssrc;
+    int m_behindCount;
+    long long m_lostCount;
+};
+
+#endif
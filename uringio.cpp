@@ -0,0 +1,578 @@
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URINGIO_ENABLED
+#endif
+#endif
+#ifdef URINGIO_ENABLED
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#include "uringio.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef URINGIO_ENABLED
+namespace
+{
+unsigned LoadAcquire(const unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void StoreRelease(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+bool IsRetryable(int res)
+{
+    return res == -EINTR || res == -EAGAIN;
+}
+
+// Returns the position, or -1 if fp is not a regular file
+int64_t GetRegularFilePos(FILE *fp)
+{
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    return ftello(fp);
+}
+}
+
+CIoUring::CIoUring()
+    : m_fd(-1)
+    , m_sqRing(MAP_FAILED)
+    , m_sqRingSize(0)
+    , m_cqRing(MAP_FAILED)
+    , m_cqRingSize(0)
+    , m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED))
+    , m_sqesSize(0)
+    , m_sqeTail(0)
+    , m_submittedTail(0)
+{
+}
+
+CIoUring::~CIoUring()
+{
+    Close();
+}
+
+bool CIoUring::Init(unsigned entries)
+{
+    Close();
+    io_uring_params params = {};
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+        return false;
+    }
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        Close();
+        return false;
+    }
+    if (!singleMap) {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            Close();
+            return false;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if (m_sqes == MAP_FAILED) {
+        Close();
+        return false;
+    }
+    uint8_t *sq = static_cast<uint8_t *>(m_sqRing);
+    uint8_t *cq = static_cast<uint8_t *>(singleMap ? m_sqRing : m_cqRing);
+    m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    m_sqEntries = params.sq_entries;
+    m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+    m_sqeTail = m_submittedTail = *m_sqTail;
+    return true;
+}
+
+void CIoUring::Close()
+{
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqesSize);
+        m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    }
+    if (m_cqRing != MAP_FAILED) {
+        munmap(m_cqRing, m_cqRingSize);
+        m_cqRing = MAP_FAILED;
+    }
+    if (m_sqRing != MAP_FAILED) {
+        munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = MAP_FAILED;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool CIoUring::RegisterBuffers(const struct iovec *iov, unsigned count)
+{
+    return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+}
+
+io_uring_sqe *CIoUring::GetSqe()
+{
+    if (m_sqeTail - LoadAcquire(m_sqHead) >= m_sqEntries) {
+        return nullptr;
+    }
+    unsigned index = m_sqeTail & *m_sqMask;
+    m_sqArray[index] = index;
+    ++m_sqeTail;
+    memset(&m_sqes[index], 0, sizeof(io_uring_sqe));
+    return &m_sqes[index];
+}
+
+bool CIoUring::Submit(unsigned waitCount)
+{
+    StoreRelease(m_sqTail, m_sqeTail);
+    for (;;) {
+        unsigned submitCount = m_sqeTail - m_submittedTail;
+        if (submitCount == 0 && waitCount == 0) {
+            return true;
+        }
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, submitCount, waitCount,
+                                           waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        m_submittedTail += ret;
+        if (m_submittedTail == m_sqeTail) {
+            return true;
+        }
+    }
+}
+
+bool CIoUring::PeekCompletion(uint64_t &userData, int &res)
+{
+    unsigned head = *m_cqHead;
+    if (head == LoadAcquire(m_cqTail)) {
+        return false;
+    }
+    const io_uring_cqe &cqe = static_cast<const io_uring_cqe *>(m_cqes)[head & *m_cqMask];
+    userData = cqe.user_data;
+    res = cqe.res;
+    StoreRelease(m_cqHead, head + 1);
+    return true;
+}
+
+CUringReader::CUringReader()
+    : m_fd(-1)
+    , m_directFd(-1)
+    , m_buf(nullptr)
+    , m_fixed(false)
+    , m_head(0)
+    , m_headOffset(0)
+    , m_nextPos(0)
+    , m_eof(false)
+    , m_failed(false)
+{
+    std::fill_n(m_busy, QUEUE_DEPTH, false);
+}
+
+CUringReader::~CUringReader()
+{
+    Close();
+}
+
+bool CUringReader::Open(FILE *fp, const char *directPath)
+{
+    Close();
+    int64_t pos = GetRegularFilePos(fp);
+    if (pos < 0) {
+        return false;
+    }
+    int fd = fileno(fp);
+    if (directPath) {
+        m_directFd = open(directPath, O_RDONLY | O_DIRECT);
+        if (m_directFd < 0) {
+            return false;
+        }
+        fd = m_directFd;
+    }
+    void *p;
+    if (posix_memalign(&p, ALIGNMENT, SLOT_SIZE * QUEUE_DEPTH) != 0) {
+        Close();
+        return false;
+    }
+    m_buf = static_cast<uint8_t *>(p);
+    if (!m_ring.Init(QUEUE_DEPTH)) {
+        Close();
+        return false;
+    }
+    // Plain reads are used if buffers cannot be registered (e.g. by RLIMIT_MEMLOCK)
+    struct iovec iov[QUEUE_DEPTH];
+    for (int i = 0; i < QUEUE_DEPTH; ++i) {
+        iov[i].iov_base = m_buf + SLOT_SIZE * i;
+        iov[i].iov_len = SLOT_SIZE;
+    }
+    m_fixed = m_ring.RegisterBuffers(iov, QUEUE_DEPTH);
+    m_fd = fd;
+    m_head = 0;
+    // O_DIRECT needs aligned positions
+    m_headOffset = directPath ? static_cast<int>(pos % ALIGNMENT) : 0;
+    m_nextPos = pos - m_headOffset;
+    m_eof = false;
+    m_failed = false;
+    for (int i = 0; i < QUEUE_DEPTH; ++i) {
+        if (!SubmitRead(i, m_nextPos)) {
+            Close();
+            return false;
+        }
+        m_nextPos += SLOT_SIZE;
+    }
+    if (!m_ring.Submit(0)) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CUringReader::Close()
+{
+    if (m_ring.IsOpen()) {
+        // The kernel may still be writing into the buffers
+        for (int i = 0; i < QUEUE_DEPTH; ++i) {
+            if (m_busy[i] && !WaitSlot(i)) {
+                // Cannot wait. Leak the buffers rather than free them in use.
+                m_buf = nullptr;
+                break;
+            }
+        }
+        m_ring.Close();
+    }
+    std::fill_n(m_busy, QUEUE_DEPTH, false);
+    free(m_buf);
+    m_buf = nullptr;
+    if (m_directFd >= 0) {
+        close(m_directFd);
+        m_directFd = -1;
+    }
+    m_fd = -1;
+}
+
+int CUringReader::Read(uint8_t *buf, int size)
+{
+    int count = 0;
+    while (count < size && !m_eof) {
+        if (!WaitSlot(m_head)) {
+            m_failed = true;
+            m_eof = true;
+            break;
+        }
+        int res = m_slotResult[m_head];
+        if (res < 0) {
+            if (IsRetryable(res) && SubmitRead(m_head, m_slotPos[m_head]) && m_ring.Submit(0)) {
+                continue;
+            }
+            m_failed = true;
+            m_eof = true;
+            break;
+        }
+        int n = std::min(std::max(res - m_headOffset, 0), size - count);
+        memcpy(buf + count, m_buf + SLOT_SIZE * m_head + m_headOffset, n);
+        count += n;
+        m_headOffset += n;
+        if (m_headOffset < res) {
+            continue;
+        }
+        if (res == SLOT_SIZE) {
+            // Read further ahead into the consumed block
+            if (!SubmitRead(m_head, m_nextPos) || !m_ring.Submit(0)) {
+                m_failed = true;
+                m_eof = true;
+                break;
+            }
+            m_nextPos += SLOT_SIZE;
+            m_head = (m_head + 1) % QUEUE_DEPTH;
+            m_headOffset = 0;
+        }
+        else if (res == 0 || m_directFd >= 0) {
+            // A short read of O_DIRECT is at the end
+            m_eof = true;
+        }
+        else {
+            // Read the rest of this block again, after the reads ahead are discarded
+            for (int i = 0; i < QUEUE_DEPTH; ++i) {
+                if (m_busy[i] && !WaitSlot(i)) {
+                    m_failed = true;
+                    m_eof = true;
+                    return count;
+                }
+            }
+            m_nextPos = m_slotPos[m_head] + res;
+            for (int i = 0; i < QUEUE_DEPTH; ++i) {
+                if (!SubmitRead((m_head + i) % QUEUE_DEPTH, m_nextPos)) {
+                    m_failed = true;
+                    m_eof = true;
+                    return count;
+                }
+                m_nextPos += SLOT_SIZE;
+            }
+            if (!m_ring.Submit(0)) {
+                m_failed = true;
+                m_eof = true;
+                break;
+            }
+            m_headOffset = 0;
+        }
+    }
+    return count;
+}
+
+bool CUringReader::SubmitRead(int slot, int64_t pos)
+{
+    io_uring_sqe *sqe = m_ring.GetSqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = m_fd;
+    sqe->off = pos;
+    sqe->addr = reinterpret_cast<uintptr_t>(m_buf + SLOT_SIZE * slot);
+    sqe->len = SLOT_SIZE;
+    sqe->buf_index = static_cast<uint16_t>(m_fixed ? slot : 0);
+    sqe->user_data = slot;
+    m_busy[slot] = true;
+    m_slotPos[slot] = pos;
+    return true;
+}
+
+bool CUringReader::WaitSlot(int slot)
+{
+    while (m_busy[slot]) {
+        uint64_t userData;
+        int res;
+        if (m_ring.PeekCompletion(userData, res)) {
+            m_busy[userData] = false;
+            m_slotResult[userData] = res;
+        }
+        else if (!m_ring.Submit(1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+CUringWriter::CUringWriter()
+    : m_fd(-1)
+    , m_buf(nullptr)
+    , m_fixed(false)
+    , m_current(0)
+    , m_oldest(0)
+    , m_pos(0)
+    , m_failed(false)
+{
+    std::fill_n(m_state, QUEUE_DEPTH, SLOT_FREE);
+}
+
+CUringWriter::~CUringWriter()
+{
+    Close();
+}
+
+bool CUringWriter::Open(FILE *fp)
+{
+    Close();
+    // Nothing must be left in the stdio buffer
+    int64_t pos = fflush(fp) == 0 ? GetRegularFilePos(fp) : -1;
+    if (pos < 0) {
+        return false;
+    }
+    void *p;
+    if (posix_memalign(&p, 4096, SLOT_SIZE * QUEUE_DEPTH) != 0) {
+        return false;
+    }
+    m_buf = static_cast<uint8_t *>(p);
+    if (!m_ring.Init(QUEUE_DEPTH)) {
+        free(m_buf);
+        m_buf = nullptr;
+        return false;
+    }
+    struct iovec iov[QUEUE_DEPTH];
+    for (int i = 0; i < QUEUE_DEPTH; ++i) {
+        iov[i].iov_base = m_buf + SLOT_SIZE * i;
+        iov[i].iov_len = SLOT_SIZE;
+    }
+    m_fixed = m_ring.RegisterBuffers(iov, QUEUE_DEPTH);
+    m_fd = fileno(fp);
+    m_current = 0;
+    m_oldest = 0;
+    m_pos = pos;
+    m_failed = false;
+    return true;
+}
+
+bool CUringWriter::Write(const uint8_t *buf, size_t size)
+{
+    if (!m_ring.IsOpen() || m_failed) {
+        return false;
+    }
+    while (size > 0) {
+        if (m_state[m_current] != SLOT_FREE && !WaitSlot(m_current)) {
+            return false;
+        }
+        size_t n = std::min<size_t>(SLOT_SIZE, size);
+        memcpy(m_buf + SLOT_SIZE * m_current, buf, n);
+        m_slotPos[m_current] = m_pos;
+        m_slotSize[m_current] = n;
+        m_slotWritten[m_current] = 0;
+        if (!SubmitWrite(m_current)) {
+            m_failed = true;
+            return false;
+        }
+        m_pos += n;
+        buf += n;
+        size -= n;
+        m_current = (m_current + 1) % QUEUE_DEPTH;
+    }
+    if (!m_ring.Submit(0)) {
+        m_failed = true;
+    }
+    Reap();
+    return !m_failed;
+}
+
+bool CUringWriter::Flush()
+{
+    // Not relative to m_oldest, which moves while waiting
+    for (int slot = 0; slot < QUEUE_DEPTH; ++slot) {
+        if (m_state[slot] != SLOT_FREE && !WaitSlot(slot)) {
+            return false;
+        }
+    }
+    return !m_failed;
+}
+
+bool CUringWriter::Close()
+{
+    bool ret = true;
+    if (m_ring.IsOpen()) {
+        ret = Flush();
+        if (!ret) {
+            // Cannot wait. Leak the buffers rather than free them in use.
+            m_buf = nullptr;
+        }
+        m_ring.Close();
+    }
+    std::fill_n(m_state, QUEUE_DEPTH, SLOT_FREE);
+    free(m_buf);
+    m_buf = nullptr;
+    m_fd = -1;
+    return ret;
+}
+
+bool CUringWriter::SubmitWrite(int slot)
+{
+    io_uring_sqe *sqe = m_ring.GetSqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = m_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = m_fd;
+    sqe->off = m_slotPos[slot] + m_slotWritten[slot];
+    sqe->addr = reinterpret_cast<uintptr_t>(m_buf + SLOT_SIZE * slot + m_slotWritten[slot]);
+    sqe->len = static_cast<unsigned>(m_slotSize[slot] - m_slotWritten[slot]);
+    sqe->buf_index = static_cast<uint16_t>(m_fixed ? slot : 0);
+    sqe->user_data = slot;
+    m_state[slot] = SLOT_IN_FLIGHT;
+    return true;
+}
+
+void CUringWriter::Reap()
+{
+    uint64_t userData;
+    int res;
+    while (m_ring.PeekCompletion(userData, res)) {
+        int slot = static_cast<int>(userData);
+        if (res > 0) {
+            m_slotWritten[slot] += res;
+        }
+        if ((res > 0 && m_slotWritten[slot] < m_slotSize[slot]) || IsRetryable(res)) {
+            // Write the rest
+            if (SubmitWrite(slot) && m_ring.Submit(0)) {
+                continue;
+            }
+            res = -EIO;
+        }
+        m_state[slot] = SLOT_DONE;
+        if (res <= 0) {
+            m_failed = true;
+        }
+    }
+    // Report in order
+    while (m_state[m_oldest] == SLOT_DONE) {
+        m_state[m_oldest] = SLOT_FREE;
+        if (!m_failed && m_writtenCallback) {
+            m_writtenCallback(m_slotSize[m_oldest]);
+        }
+        m_oldest = (m_oldest + 1) % QUEUE_DEPTH;
+    }
+}
+
+bool CUringWriter::WaitSlot(int slot)
+{
+    for (;;) {
+        Reap();
+        if (m_state[slot] == SLOT_FREE) {
+            return true;
+        }
+        if (!m_ring.Submit(1)) {
+            m_failed = true;
+            return false;
+        }
+    }
+}
+
+#else
+CIoUring::CIoUring() : m_fd(-1) {}
+CIoUring::~CIoUring() {}
+bool CIoUring::Init(unsigned) { return false; }
+void CIoUring::Close() {}
+bool CIoUring::RegisterBuffers(const struct iovec *, unsigned) { return false; }
+io_uring_sqe *CIoUring::GetSqe() { return nullptr; }
+bool CIoUring::Submit(unsigned) { return false; }
+bool CIoUring::PeekCompletion(uint64_t &, int &) { return false; }
+
+CUringReader::CUringReader() : m_failed(false) {}
+CUringReader::~CUringReader() {}
+bool CUringReader::Open(FILE *, const char *) { return false; }
+void CUringReader::Close() {}
+int CUringReader::Read(uint8_t *, int) { return 0; }
+
+CUringWriter::CUringWriter() {}
+CUringWriter::~CUringWriter() {}
+bool CUringWriter::Open(FILE *) { return false; }
+bool CUringWriter::Write(const uint8_t *, size_t) { return false; }
+bool CUringWriter::Flush() { return true; }
+bool CUringWriter::Close() { return true; }
+#endif
@@ -0,0 +1,126 @@
+#ifndef INCLUDE_URINGIO_HPP
+#define INCLUDE_URINGIO_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+
+struct io_uring_sqe;
+struct iovec;
+
+// Minimal io_uring without liburing. Init() fails on systems other than Linux or if the kernel refuses it.
+class CIoUring
+{
+public:
+    CIoUring();
+    ~CIoUring();
+    bool Init(unsigned entries);
+    void Close();
+    bool IsOpen() const { return m_fd >= 0; }
+    bool RegisterBuffers(const struct iovec *iov, unsigned count);
+    // Returns nullptr if the submission queue is full
+    io_uring_sqe *GetSqe();
+    // Submits queued entries and waits until at least waitCount completions are available
+    bool Submit(unsigned waitCount);
+    // Returns false if no completion is available
+    bool PeekCompletion(uint64_t &userData, int &res);
+
+private:
+    int m_fd;
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+    unsigned *m_sqHead;
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    unsigned *m_sqArray;
+    unsigned m_sqEntries;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    void *m_cqes;
+    unsigned m_sqeTail;
+    unsigned m_submittedTail;
+};
+
+// Reads a file with several large reads in flight ahead of the caller
+class CUringReader
+{
+public:
+    CUringReader();
+    ~CUringReader();
+    // Reads a regular file from the current position of fp. If directPath is not null, the file is opened again with O_DIRECT.
+    bool Open(FILE *fp, const char *directPath);
+    void Close();
+    bool IsOpen() const { return m_ring.IsOpen(); }
+    // Same as fread(). Returns less than size only at the end or on error.
+    int Read(uint8_t *buf, int size);
+    bool IsFailed() const { return m_failed; }
+
+private:
+    static const int SLOT_SIZE = 1024 * 1024;
+    static const int QUEUE_DEPTH = 4;
+    // Alignment for O_DIRECT
+    static const int ALIGNMENT = 4096;
+    bool SubmitRead(int slot, int64_t pos);
+    bool WaitSlot(int slot);
+
+    CIoUring m_ring;
+    int m_fd;
+    int m_directFd;
+    uint8_t *m_buf;
+    bool m_fixed;
+    bool m_busy[QUEUE_DEPTH];
+    int64_t m_slotPos[QUEUE_DEPTH];
+    int m_slotResult[QUEUE_DEPTH];
+    int m_head;
+    int m_headOffset;
+    int64_t m_nextPos;
+    bool m_eof;
+    bool m_failed;
+};
+
+// Writes to a file asynchronously from registered buffers. Write() waits only when all buffers are in flight.
+class CUringWriter
+{
+public:
+    CUringWriter();
+    ~CUringWriter();
+    // Called with the size of each block written, in order
+    void SetWrittenCallback(const std::function<void (size_t)> &writtenCallback) { m_writtenCallback = writtenCallback; }
+    // Writes a regular file from the current position of fp
+    bool Open(FILE *fp);
+    bool IsOpen() const { return m_ring.IsOpen(); }
+    bool Write(const uint8_t *buf, size_t size);
+    // Waits for all writes
+    bool Flush();
+    bool Close();
+
+private:
+    static const int SLOT_SIZE = 256 * 1024;
+    static const int QUEUE_DEPTH = 8;
+    enum SLOT_STATE { SLOT_FREE, SLOT_IN_FLIGHT, SLOT_DONE };
+    bool SubmitWrite(int slot);
+    void Reap();
+    bool WaitSlot(int slot);
+
+    CIoUring m_ring;
+    std::function<void (size_t)> m_writtenCallback;
+    int m_fd;
+    uint8_t *m_buf;
+    bool m_fixed;
+    SLOT_STATE m_state[QUEUE_DEPTH];
+    int64_t m_slotPos[QUEUE_DEPTH];
+    size_t m_slotSize[QUEUE_DEPTH];
+    size_t m_slotWritten[QUEUE_DEPTH];
+    int m_current;
+    int m_oldest;
+    int64_t m_pos;
+    bool m_failed;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "util.hpp"
+#include <string.h>
 #include <algorithm>
 
 uint32_t calc_crc32(const uint8_t *data, int data_size, uint32_t crc)
@@ -13,6 +14,69 @@ uint32_t calc_crc32(const uint8_t *data, int data_size, uint32_t crc)
     return crc;
 }
 
+void calc_sha256(const uint8_t *data, size_t data_size, uint8_t *hash)
+{
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    // Whole blocks, then the rest with padding and the bit length
+    size_t tail_size = data_size % 64;
+    uint8_t tail[128] = {};
+    memcpy(tail, data + data_size - tail_size, tail_size);
+    tail[tail_size] = 0x80;
+    size_t tail_end = tail_size < 56 ? 64 : 128;
+    uint64_t bits = static_cast<uint64_t>(data_size) * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_end - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    }
+    for (size_t pos = 0; pos < data_size - tail_size + tail_end; pos += 64) {
+        const uint8_t *block = pos < data_size - tail_size ? data + pos : tail + (pos - (data_size - tail_size));
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (static_cast<uint32_t>(block[i * 4]) << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = ((w[i - 15] >> 7) | (w[i - 15] << 25)) ^ ((w[i - 15] >> 18) | (w[i - 15] << 14)) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ((w[i - 2] >> 17) | (w[i - 2] << 15)) ^ ((w[i - 2] >> 19) | (w[i - 2] << 13)) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t s1 = ((e >> 6) | (e << 26)) ^ ((e >> 11) | (e << 21)) ^ ((e >> 25) | (e << 7));
+            uint32_t t1 = hh + s1 + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t s0 = ((a >> 2) | (a << 30)) ^ ((a >> 13) | (a << 19)) ^ ((a >> 22) | (a << 10));
+            uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+    for (int i = 0; i < 32; ++i) {
+        hash[i] = static_cast<uint8_t>(h[i / 4] >> (24 - i % 4 * 8));
+    }
+}
+
 int extract_psi(PSI *psi, const uint8_t *payload, int payload_size, int unit_start, int counter)
 {
     int copy_pos = 0;
@@ -67,9 +131,10 @@ int extract_psi(PSI *psi, const uint8_t *payload, int payload_size, int unit_sta
     return done;
 }
 
-void extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_start, int counter)
+int extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_start, int counter)
 {
     int done;
+    int updated = 0;
     do {
         done = extract_psi(&pat->psi, payload, payload_size, unit_start, counter);
         if (pat->psi.version_number &&
@@ -77,10 +142,18 @@ void extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_st
             pat->psi.table_id == 0 &&
             pat->psi.section_length >= 5)
         {
-            // Update PAT
             const uint8_t *table = pat->psi.data;
+            const uint8_t *crc = table + 3 + pat->psi.section_length - 4;
+            uint32_t crc32 = (static_cast<uint32_t>(crc[0]) << 24) | (crc[1] << 16) | (crc[2] << 8) | crc[3];
+            if (pat->version_number == pat->psi.version_number && pat->crc32 == crc32) {
+                // Unchanged
+                continue;
+            }
+            // Update PAT
             pat->transport_stream_id = (table[3] << 8) | table[4];
             pat->version_number = pat->psi.version_number;
+            pat->crc32 = crc32;
+            updated = 1;
 
             // Update PMT list
             pat->pmt.clear();
@@ -95,6 +168,7 @@ void extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_st
         }
     }
     while (!done);
+    return updated;
 }
 
 int get_ts_payload_size(const uint8_t *packet)
@@ -114,32 +188,91 @@ int get_ts_payload_size(const uint8_t *packet)
     return 0;
 }
 
-int resync_ts(const uint8_t *data, int data_size, int *unit_size)
+int resync_ts(const uint8_t *data, int data_size, int *pos, int *unit_size, int is_final, int *dropped_size)
 {
-    if (*unit_size == 188 || *unit_size == 192 || *unit_size == 204) {
-        for (int offset = 0; offset < data_size && offset < *unit_size; ++offset) {
-            int i = offset;
-            for (; i < data_size; i += *unit_size) {
-                if (data[i] != 0x47) {
-                    break;
-                }
+    // Enough to rule out sync bytes found by chance
+    static const int SYNC_CHECK_COUNT = 8;
+    static const int UNIT_SIZES[] = {188, 192, 204};
+    int p = *pos;
+    int found = 0;
+    while (p < data_size) {
+        // memchr() is usually vectorized
+        const void *q = memchr(data + p, 0x47, data_size - p);
+        if (!q) {
+            p = data_size;
+            break;
+        }
+        p = static_cast<int>(static_cast<const uint8_t *>(q) - data);
+        bool pending = false;
+        for (int i = -1; i < 3 && !found; ++i) {
+            int unit = i < 0 ? *unit_size : UNIT_SIZES[i];
+            if (unit == 0 || (i >= 0 && unit == *unit_size)) {
+                continue;
             }
-            if (i >= data_size) {
-                return offset;
+            int n = 1;
+            while (n < SYNC_CHECK_COUNT && p + n * unit < data_size && data[p + n * unit] == 0x47) {
+                ++n;
             }
-        }
-    }
-    else {
-        // Unknown unit size
-        for (int i = 0; i < 3; ++i) {
-            *unit_size = i == 0 ? 188 : i == 1 ? 192 : 204;
-            int offset = resync_ts(data, data_size, unit_size);
-            if (offset < data_size) {
-                return offset;
+            if (n == SYNC_CHECK_COUNT || (p + n * unit >= data_size && is_final && p + unit <= data_size)) {
+                found = unit;
             }
+            else if (p + n * unit >= data_size) {
+                // Not denied yet
+                pending = true;
+            }
+        }
+        if (found || pending) {
+            break;
         }
-        *unit_size = 0;
+        ++p;
+    }
+    if (found) {
+        *unit_size = found;
+    }
+    if (dropped_size) {
+        *dropped_size = p - *pos;
+    }
+    *pos = p;
+    return found != 0;
+}
+
+void put_state_int(std::vector<uint8_t> &state, int64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        state.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (i * 8)));
+    }
+}
+
+void put_state_data(std::vector<uint8_t> &state, const uint8_t *data, size_t size)
+{
+    put_state_int(state, size);
+    state.insert(state.end(), data, data + size);
+}
+
+int64_t get_state_int(STATE_READER *r)
+{
+    if (r->failed || r->end - r->p < 8) {
+        r->failed = 1;
+        return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(r->p[i]) << (i * 8);
+    }
+    r->p += 8;
+    return static_cast<int64_t>(value);
+}
+
+const uint8_t *get_state_data(STATE_READER *r, size_t *size)
+{
+    int64_t n = get_state_int(r);
+    if (r->failed || n < 0 || r->end - r->p < n) {
+        r->failed = 1;
+        *size = 0;
+        return r->p;
     }
-    // Failed
-    return data_size;
+    const uint8_t *data = r->p;
+    r->p += n;
+    *size = static_cast<size_t>(n);
+    return data;
 }
@@ -1,6 +1,7 @@
 #ifndef INCLUDE_UTIL_HPP
 #define INCLUDE_UTIL_HPP
 
+#include <stddef.h>
 #include <stdint.h>
 #include <vector>
 
@@ -25,19 +26,55 @@ struct PAT
 {
     int transport_stream_id;
     int version_number;
+    uint32_t crc32;
     std::vector<PMT_REF> pmt;
     PSI psi;
 };
 
+struct STATE_READER
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    int failed;
+};
+
 uint32_t calc_crc32(const uint8_t *data, int data_size, uint32_t crc = 0xffffffff);
+void calc_sha256(const uint8_t *data, size_t data_size, uint8_t *hash);
 int extract_psi(PSI *psi, const uint8_t *payload, int payload_size, int unit_start, int counter);
-void extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_start, int counter);
+int extract_pat(PAT *pat, const uint8_t *payload, int payload_size, int unit_start, int counter);
 int get_ts_payload_size(const uint8_t *packet);
-int resync_ts(const uint8_t *data, int data_size, int *unit_size);
+int resync_ts(const uint8_t *data, int data_size, int *pos, int *unit_size, int is_final, int *dropped_size);
+void put_state_int(std::vector<uint8_t> &state, int64_t value);
+void put_state_data(std::vector<uint8_t> &state, const uint8_t *data, size_t size);
+int64_t get_state_int(STATE_READER *r);
+const uint8_t *get_state_data(STATE_READER *r, size_t *size);
 
 inline int extract_ts_header_unit_start(const uint8_t *packet) { return !!(packet[1] & 0x40); }
 inline int extract_ts_header_pid(const uint8_t *packet) { return ((packet[1] & 0x1f) << 8) | packet[2]; }
 inline int extract_ts_header_adaptation(const uint8_t *packet) { return (packet[3] >> 4) & 0x03; }
 inline int extract_ts_header_counter(const uint8_t *packet) { return packet[3] & 0x0f; }
+// Returns -1 if the packet has no PCR
+inline int64_t extract_ts_header_pcr(const uint8_t *packet)
+{
+    if ((extract_ts_header_adaptation(packet) & 2) && packet[4] >= 6 && (packet[5] & 0x10)) {
+        return (packet[10] >> 7) | (packet[9] << 1) | (packet[8] << 9) | (packet[7] << 17) | (static_cast<int64_t>(packet[6]) << 25);
+    }
+    return -1;
+}
+
+// Finds the TS packet at or after *pos, and returns 1 if the whole packet is in data. Otherwise returns 0 and *pos is where
+// the data to be kept for the next call begins. Only the sync byte is checked while in sync, so data should be passed once.
+// When out of sync, resync_ts() looks for the next position where the sync byte repeats at intervals of 188, 192 or 204
+// (*unit_size first). Bytes skipped are stored in *dropped_size (if not null).
+inline int find_ts_packet(const uint8_t *data, int data_size, int *pos, int *unit_size, int is_final, int *dropped_size)
+{
+    if (*unit_size != 0 && *pos + *unit_size <= data_size && data[*pos] == 0x47) {
+        if (dropped_size) {
+            *dropped_size = 0;
+        }
+        return 1;
+    }
+    return resync_ts(data, data_size, pos, unit_size, is_final, dropped_size);
+}
 
 #endif